@@ -0,0 +1,62 @@
+#!/bin/sh
+# Times making and checking a torrent of many small files.  Each piece read
+# has to find the file holding its offset, so this shows how that lookup
+# scales with the number of files.
+#
+# usage: manyfiles.sh ctorrent [files [file_size [piece_length]]]
+#   defaults: 1000000 files of 1024 bytes, 65536-byte pieces
+#
+# Torrents of more than about 350000 files are too big for ctorrent to
+# load, so only the making of those is timed.
+#
+# The data is made in a temporary directory under $TMPDIR (default /tmp),
+# which needs room for files * file_size bytes plus the file system's
+# per-file overhead.
+
+CTORRENT=$1
+FILES=${2:-1000000}
+SIZE=${3:-1024}
+PIECE=${4:-65536}
+PERDIR=1000
+
+if [ -z "$CTORRENT" ] || [ ! -x "$CTORRENT" ]; then
+  echo "usage: $0 ctorrent [files [file_size [piece_length]]]" >&2
+  exit 1
+fi
+case $CTORRENT in
+  /*) ;;
+  *) CTORRENT=`pwd`/$CTORRENT ;;
+esac
+
+WORK=`mktemp -d "${TMPDIR:-/tmp}/manyfiles.XXXXXX"` || exit 1
+trap 'rm -rf "$WORK"' 0 1 2 15
+cd "$WORK" || exit 1
+
+echo "Making $FILES files of $SIZE bytes..."
+mkdir data
+n=0
+while [ $n -lt $FILES ]; do
+  count=$PERDIR
+  [ `expr $FILES - $n` -lt $count ] && count=`expr $FILES - $n`
+  dir=data/`printf %06d \`expr $n / $PERDIR\``
+  mkdir $dir
+  head -c `expr $count \* $SIZE` /dev/urandom |
+    (cd $dir && split -b $SIZE -a 4 -d - f)
+  n=`expr $n + $count`
+done
+
+elapsed(){
+  start=`date +%s`
+  "$@" > /dev/null 2>&1 < /dev/null
+  status=$?
+  echo "`expr \`date +%s\` - $start` s (exit status $status)"
+}
+
+printf "Make torrent:  "
+elapsed "$CTORRENT" -t -u http://localhost/announce -l $PIECE -s t.torrent data
+printf "Check pieces:  "
+if [ `wc -c < t.torrent` -gt 16777216 ]; then
+  echo "skipped, torrent is over the 16MB ctorrent will load"
+else
+  elapsed "$CTORRENT" -c t.torrent
+fi
@@ -19,10 +19,8 @@ enum dt_query_t{
   DT_QUERY_POS,
 };
 
-size_t buf_long(const char *b, size_t len, char beginchar, char endchar,
-  int64_t *pi);
 size_t buf_int(const char *b, size_t len, char beginchar, char endchar,
-  size_t *pi);
+  int64_t *pi);
 size_t buf_str(const char *b, size_t len, const char **pstr, size_t *slen);
 size_t decode_int(const char *b, size_t len);
 size_t decode_str(const char *b, size_t len);
@@ -1,12 +1,14 @@
 #include <errno.h>
 #include <ctype.h>      // ctype()
 #include <sys/stat.h>   // chmod(), stat()
+#include <unistd.h>     // sysconf()
 
 #include "btconfig.h"
 #include "bttime.h"
 #include "btcontent.h"
 #include "peerlist.h"
 #include "ctcs.h"
+#include "workpool.h"
 
 // btconfig.cpp:  Copyright 2008-2009 Dennis Holmes  (dholmes@rahul.net)
 
@@ -629,6 +631,120 @@ static void InfoCfgCacheSize(Config<unsigned int> *config)
 
 //---------------------------------------------------------------------------
 
+Config<unsigned char> cfg_cache_policy = DT_CACHE_LRU;
+
+static void CfgCachePolicy(Config<unsigned char> *config)
+{
+  BTCONTENT.SetCachePolicy();
+}
+
+static void InfoCfgCachePolicy(Config<unsigned char> *config)
+{
+  char info[80];
+  size_t len;
+  dt_count_t hits, total;
+
+  snprintf(info, sizeof(info), "0=%s/1=%s; hits",
+    CachePolicyName(0), CachePolicyName(1));
+  for( int i = 0; i < DT_CACHE_NPOLICIES; i++ ){
+    hits = BTCONTENT.CacheHits(i);
+    total = hits + BTCONTENT.CacheMiss(i);
+    len = strlen(info);
+    snprintf(info + len, sizeof(info) - len, " %s %d%%", CachePolicyName(i),
+      total ? (int)(100 * (double)hits / total) : 0);
+  }
+  config->SetInfo(info);
+}
+
+//---------------------------------------------------------------------------
+
+Config<bool> cfg_seed_mmap = false;
+
+static void CfgSeedMmap(Config<bool> *config)
+{
+  if( !*cfg_seed_mmap ) BTCONTENT.UnmapAll();
+}
+
+static void InfoCfgSeedMmap(Config<bool> *config)
+{
+  char info[48];
+  snprintf(info, 48, "Send from mapped files; %d slices sent",
+    (int)BTCONTENT.MapSent());
+  config->SetInfo(info);
+}
+
+//---------------------------------------------------------------------------
+
+Config<bool> cfg_direct_io = false;
+
+static void CfgDirectIO(Config<bool> *config)
+{
+  BTCONTENT.SetDirectIO();
+}
+
+//---------------------------------------------------------------------------
+
+Config<dt_count_t> cfg_open_files = 20;
+
+// Descriptors available to the process (RLIMIT_NOFILE), within select()'s reach
+static dt_count_t FileLimit()
+{
+  long n = -1;
+#ifdef _SC_OPEN_MAX
+  n = sysconf(_SC_OPEN_MAX);
+#endif
+#ifdef FD_SETSIZE
+  if( n < 0 || n > FD_SETSIZE ) n = FD_SETSIZE;
+#endif
+  return (n < 40) ? 40 : (dt_count_t)n;
+}
+
+static void CfgOpenFiles(Config<dt_count_t> *config)
+{
+  BTCONTENT.CloseExcessFiles();
+}
+
+static void InfoCfgOpenFiles(Config<dt_count_t> *config)
+{
+  char info[48];
+  snprintf(info, 48, "%d opens, %d closes",
+    (int)BTCONTENT.FileOpens(), (int)BTCONTENT.FileCloses());
+  config->SetInfo(info);
+}
+
+//---------------------------------------------------------------------------
+
+Config<int> cfg_workers = 0;
+
+static void CfgWorkers(Config<int> *config)
+{
+  WORKERS.Start(*cfg_workers);
+  READER.Start(*cfg_workers);
+}
+
+//---------------------------------------------------------------------------
+
+Config<bool> cfg_write_behind = false;
+
+static void CfgWriteBehind(Config<bool> *config)
+{
+  FLUSHER.Start(*cfg_write_behind ? 1 : 0);
+}
+
+//---------------------------------------------------------------------------
+
+Config<unsigned int> cfg_scrub_rate = 0;
+
+static void InfoCfgScrubRate(Config<unsigned int> *config)
+{
+  char info[48];
+  snprintf(info, 48, "MB/s; %d pieces scrubbed, %d bad",
+    (int)BTCONTENT.ScrubbedPieces(), (int)BTCONTENT.ScrubFailures());
+  config->SetInfo(info);
+}
+
+//---------------------------------------------------------------------------
+
 Config<dt_count_t> cfg_max_peers = 100;
 Config<dt_count_t> cfg_min_peers = 1;
 
@@ -1037,6 +1153,61 @@ void InitConfig()
   cfg_cache_size.SetMax((unsigned int)-1);
   CONFIG.Add("cache_size", cfg_cache_size);
 
+  cfg_cache_policy.Init("Cache policy");
+  cfg_cache_policy.Setup(CfgCachePolicy, 0, InfoCfgCachePolicy, 0,
+    DT_CACHE_NPOLICIES - 1);
+  CONFIG.Add("cache_policy", cfg_cache_policy);
+
+  cfg_seed_mmap.Init("Map files when seeding",
+    "Truncating a mapped file is fatal");
+  cfg_seed_mmap.Setup(CfgSeedMmap, 0, InfoCfgSeedMmap);
+#ifndef USE_MMAP
+  cfg_seed_mmap.Hide();
+#endif
+  CONFIG.Add("seed_mmap", cfg_seed_mmap);
+
+  cfg_direct_io.Init("Direct file I/O", "Bypass the system cache");
+  cfg_direct_io.Setup(CfgDirectIO);
+#ifndef USE_DIRECT_IO
+  cfg_direct_io.Hide();
+#endif
+  CONFIG.Add("direct_io", cfg_direct_io);
+
+  cfg_open_files.Init("Max open files");
+  cfg_open_files.Setup(CfgOpenFiles, 0, InfoCfgOpenFiles, 4, FileLimit() / 2);
+  if( FileLimit() / 8 > *cfg_open_files ){
+    cfg_open_files.Override(FileLimit() / 8);
+    cfg_open_files.SetDefault(*cfg_open_files);
+  }
+  CONFIG.Add("open_files", cfg_open_files);
+
+  cfg_workers.Init("Worker threads", "For hash checking and read-ahead");
+  cfg_workers.Setup(CfgWorkers);
+  cfg_workers.SetMax(MAX_WORKERS);
+#ifdef USE_PTHREADS
+  cfg_workers.Override(CpuCount());
+  cfg_workers.SetDefault(*cfg_workers);
+  CfgWorkers(&cfg_workers);
+#else
+  cfg_workers.Hide();
+#endif
+  CONFIG.Add("workers", cfg_workers);
+
+  cfg_write_behind.Init("Write-behind thread", "Flush cache in background");
+  cfg_write_behind.Setup(CfgWriteBehind);
+#ifdef USE_PTHREADS
+  cfg_write_behind.Override(true);
+  cfg_write_behind.SetDefault(true);
+  CfgWriteBehind(&cfg_write_behind);
+#else
+  cfg_write_behind.Hide();
+#endif
+  CONFIG.Add("write_behind", cfg_write_behind);
+
+  cfg_scrub_rate.Init("Scrub rate", "MB/s (0 to disable)");
+  cfg_scrub_rate.Setup(0, 0, InfoCfgScrubRate, 0, 10000);
+  CONFIG.Add("scrub_rate", cfg_scrub_rate);
+
   cfg_min_peers.Init("Min peers [-m]");
   cfg_min_peers.Setup(CfgMinPeers, 0, InfoCfgPeers, 1, 1000);
   CONFIG.Add("peers_min", cfg_min_peers);
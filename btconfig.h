@@ -427,6 +427,14 @@ extern Configuration CONFIG;
 // Global declarations
 
 extern Config<unsigned int> cfg_cache_size;  // megabytes
+extern Config<unsigned char> cfg_cache_policy;  // dt_cachepolicy_t
+extern Config<bool> cfg_seed_mmap;  // send from mapped files when seeding
+extern Config<dt_count_t> cfg_open_files;  // data file descriptors
+extern Config<bool> cfg_direct_io;  // bypass the system cache for data files
+
+extern Config<int> cfg_workers;  // worker threads
+extern Config<bool> cfg_write_behind;  // flush cache from a thread
+extern Config<unsigned int> cfg_scrub_rate;  // megabytes per second
 
 extern Config<dt_count_t> cfg_max_peers;
 extern Config<dt_count_t> cfg_min_peers;
@@ -27,10 +27,21 @@
 #include "bttime.h"
 #include "util.h"
 #include "sha1.h"
+#include "workpool.h"
 
 // This filesize allows torrenting out ~250GB files.
 #define MAX_METAINFO_FILESIZ (16*1024*1024)
 #define FLUSH_RETRY_INTERVAL 300  // seconds to retry after disk write error
+#define MAX_HASH_BATCH 8             // max pieces to hash at once
+#define HASH_BATCH_MEM (8*1024*1024) // buffer size limit for a hash batch
+// Number of check jobs to keep in progress at once.
+#define CHECK_WINDOW ((bt_index_t)WORKERS.Threads() + 1)
+#define PARTIAL_UNIT MIN_SLICE_SIZE  // granularity of received-data maps
+#define CACHE_BLOCK_SIZE DEFAULT_SLICE_SIZE  // largest cache entry
+#define CACHE_BLOCK_UNITS (1 << (CACHE_ORDERS - 1))
+#define CACHE_UNIT (CACHE_BLOCK_SIZE / CACHE_BLOCK_UNITS)  // smallest entry
+#define DIRTY_SHARE 75  // percent of the cache that may wait to be written
+#define FLUSH_BATCH (1024*1024)      // data per flusher job
 
 #define meta_str(keylist, pstr, psiz) \
   decode_query(b, flen, (keylist), (pstr), (psiz), (int64_t *)0, DT_QUERY_STR)
@@ -46,6 +57,10 @@
   (max_datalen((ca)->bc_off, (roff)) <= \
    min_datalen(((ca)->bc_off + (ca)->bc_len - 1), (roff + rlen - 1)))
 
+// Which block of its piece does offset "off" lie in?
+#define CACHE_SLOT(off) \
+  ((bt_length_t)(((off) % m_piece_length) / CACHE_BLOCK_SIZE))
+
 
 btContent BTCONTENT;
 
@@ -64,12 +79,37 @@ btContent::btContent()
   pBRefer = (Bitfield *)0;
   pBChecked = (Bitfield *)0;
   pBMultPeer = (Bitfield *)0;
+  pBVerify = (Bitfield *)0;
+  pBLost = (Bitfield *)0;
   time(&m_start_timestamp);
-  m_cache_oldest = m_cache_newest = (BTCACHE *)0;
+  m_policy = (btCachePolicy *)0;
+  for( int i = 0; i < DT_CACHE_NPOLICIES; i++ )
+    m_policies[i] = (btCachePolicy *)0;
+  m_piece_hash = (BTHASH **)0;
+  m_partial = (unsigned char **)0;
   m_cache_size = m_cache_used = 0;
-  m_flush_failed = 0;
+  m_cache = (BTCACHE **)0;
+  m_cache_slot = (BTCACHE ***)0;
+  m_cache_nslots = 0;
+  m_cache_lookups = m_cache_probes = m_cache_walks = 0;
+  m_map_sent = 0;
+  m_arena = (BTARENA *)0;
+  for( int k = 0; k < CACHE_ORDERS; k++ ) m_arena_free[k] = (BTCACHE *)0;
+  m_arena_units = m_arena_avail = 0;
+  m_cache_dirty = m_flush_writing = 0;
+  m_flush_inflight = 0;
+  m_flush_failed = m_flush_draining = 0;
   m_flush_tried = (time_t)0;
-  m_check_piece = 0;
+  m_check_piece = m_check_next = m_check_inflight = 0;
+  m_check_jobs = (btCheckJob *)0;
+  m_check_batch = 0;
+  m_check_failed = 0;
+  m_scrub_next = m_scrub_inflight = 0;
+  m_scrub_pieces = m_scrub_failures = m_scrub_passes = 0;
+  m_scrub_bytes = m_scrub_mark_bytes = 0;
+  m_scrub_due = m_scrub_mark = 0;
+  m_scrub_rate = 0;
+  m_creating = 0;
   m_flushq = (BTFLUSH *)0;
   m_filters = m_current_filter = (BFNODE *)0;
   m_prevdlrate = 0;
@@ -171,6 +211,8 @@ int btContent::CreateMetainfoFile(const char *mifn, const char *comment,
 int btContent::InitialFromFS(const char *pathname, bt_length_t piece_length)
 {
   bt_index_t n, percent;
+  int batch;
+  double start, elapsed;
 
   // piece length
   m_piece_length = piece_length;
@@ -189,12 +231,6 @@ int btContent::InitialFromFS(const char *pathname, bt_length_t piece_length)
 
   if( m_btfiles.BuildFromFS(pathname) < 0 ) return -1;
 
-  global_piece_buffer = new char[m_piece_length];
-#ifndef WINDOWS
-  if( !global_piece_buffer ) return -1;
-#endif
-  global_buffer_size = m_piece_length;
-
   // n pieces
   m_npieces = m_btfiles.GetTotalLength() / m_piece_length;
   if( m_btfiles.GetTotalLength() % m_piece_length ) m_npieces++;
@@ -209,12 +245,35 @@ int btContent::InitialFromFS(const char *pathname, bt_length_t piece_length)
   percent = m_npieces / 100;
   if( !percent ) percent = 1;
 
+  /* Keep the worker pool busy reading and hashing batches of pieces.  The
+     digests are stored by index as the jobs finish, in any order. */
+  m_creating = 1;
+  m_check_batch = batch = HashBatchSize();
+  start = PreciseTime();
   CONSOLE.Interact_n();
-  for( n = 0; n < m_npieces; n++ ){
-    if( GetHashValue(n, m_hash_table + n * 20) < 0 ) return -1;
-    if( n % percent == 0 || n == m_npieces-1 ){
-      CONSOLE.InteractU("Create hash table: %d/%d", (int)n+1, (int)m_npieces);
+  for( n = 0; n < m_npieces && !m_check_failed; ){
+    bt_index_t idx[MAX_HASH_BATCH];
+    int i;
+    for( i = 0; i < batch && n < m_npieces; i++ ) idx[i] = n++;
+    while( m_check_inflight >= CHECK_WINDOW ) WORKERS.WaitOne();
+    if( CheckSubmit(idx, i, false) < 0 ){
+      CONSOLE.Warning(1, "error, failed to allocate memory for hashing");
+      m_check_failed = 1;
+      break;
     }
+    if( (n - i) / percent != n / percent || n == m_npieces ){
+      elapsed = PreciseTime() - start;
+      CONSOLE.InteractU("Create hash table: %d/%d  %.1f MB/s", (int)n,
+        (int)m_npieces, (elapsed > 0) ?
+          (double)n * m_piece_length / elapsed / (1024*1024) : 0.0);
+    }
+  }
+  while( m_check_inflight ) WORKERS.WaitOne();
+  CheckRelease();
+  m_creating = 0;
+  if( m_check_failed ){
+    CONSOLE.Warning(1, "error, failed to read piece data");
+    return -1;
   }
   return 0;
 }
@@ -252,6 +311,7 @@ int btContent::InitialFromMI(const char *metainfo_fname, const char *saveas,
   size_t flen, q, bsiz;
   int64_t bint;
   int check_pieces = 0;
+  bool resumed = false;
   char torrentid[41];
 
   m_cache_hit = m_cache_miss = m_cache_pre = 0;
@@ -378,6 +438,7 @@ int btContent::InitialFromMI(const char *metainfo_fname, const char *saveas,
   for( int i=0; i < 20; i++ ){
     sprintf(torrentid + i*2, "%.2x", (int)m_shake_buffer[28+i]);
   }
+  m_btfiles.SetWritable(!check_only);  // avoid reopening files to write
   if( (check_pieces = m_btfiles.SetupFiles(torrentid, check_only)) < 0 )
     goto err;
 
@@ -407,6 +468,16 @@ int btContent::InitialFromMI(const char *metainfo_fname, const char *saveas,
   if( !pBMultPeer ) goto err;
 #endif
 
+  pBVerify = new Bitfield(m_npieces);
+#ifndef WINDOWS
+  if( !pBVerify ) goto err;
+#endif
+
+  pBLost = new Bitfield(m_npieces);
+#ifndef WINDOWS
+  if( !pBLost ) goto err;
+#endif
+
   // create the file filter
   pBMasterFilter = new Bitfield(m_npieces);
 #ifndef WINDOWS
@@ -415,6 +486,7 @@ int btContent::InitialFromMI(const char *metainfo_fname, const char *saveas,
   if( *cfg_file_to_download ) SetFilter();
 
   check_pieces *= m_btfiles.CreateFiles();
+  if( check_pieces ) SkipHoles();
 
   m_left_bytes = m_btfiles.GetTotalLength() / m_piece_length;
   if( m_btfiles.GetTotalLength() % m_piece_length ) m_left_bytes++;
@@ -442,7 +514,15 @@ int btContent::InitialFromMI(const char *metainfo_fname, const char *saveas,
       return 0;
     }
   }else if( check_pieces ){  // files exist already
-    if( *cfg_bitfield_file && pBRefer->SetReferFile(*cfg_bitfield_file) < 0 ){
+    if( *cfg_bitfield_file &&
+        LoadResume(*cfg_bitfield_file, force_seed) == 0 ){
+      resumed = true;
+      if( remove(*cfg_bitfield_file) < 0 ){
+        CONSOLE.Warning(2, "warn, couldn't delete bit field file \"%s\":  %s",
+          *cfg_bitfield_file, strerror(errno));
+      }
+    }else if( *cfg_bitfield_file &&
+              pBRefer->SetReferFile(*cfg_bitfield_file) < 0 ){
       if( !force_seed ){
         CONSOLE.Warning(2,
           "warn, couldn't set bit field refer file \"%s\":  %s",
@@ -471,7 +551,7 @@ int btContent::InitialFromMI(const char *metainfo_fname, const char *saveas,
     }
   }else if( force_seed && !check_only ){
     bt_index_t idx = 0;
-    *pBF = *pBRefer;
+    if( !resumed ) pBF->Or(*pBRefer);
     if( pBF->IsFull() ){
       CONSOLE.Interact("Skipping hash checks and forcing seed mode.");
       CONSOLE.Interact(
@@ -481,8 +561,15 @@ int btContent::InitialFromMI(const char *metainfo_fname, const char *saveas,
       if( pBF->IsSet(idx) )
         m_left_bytes -= GetPieceLength(idx);
     }
-    m_check_piece = m_npieces;
-    pBChecked->SetAll();
+    if( !resumed || pBRefer->IsEmpty() ){  // else check changed files
+      m_check_piece = m_npieces;
+      pBChecked->SetAll();
+    }
+  }else{
+    for( bt_index_t idx = 0; idx < m_npieces; idx++ ){
+      if( pBF->IsSet(idx) )
+        m_left_bytes -= GetPieceLength(idx);
+    }
   }
   delete pBRefer;
 
@@ -492,6 +579,22 @@ int btContent::InitialFromMI(const char *metainfo_fname, const char *saveas,
     goto err;
   }
   memset(m_cache, 0, m_npieces * sizeof(BTCACHE *));
+
+  m_cache_slot = new BTCACHE **[m_npieces];
+  if( !m_cache_slot ){
+    CONSOLE.Warning(1, "error, allocate cache slot index failed");
+    goto err;
+  }
+  memset(m_cache_slot, 0, m_npieces * sizeof(BTCACHE **));
+  m_cache_nslots = (m_piece_length + CACHE_BLOCK_SIZE - 1) / CACHE_BLOCK_SIZE;
+  if( SetCachePolicy() < 0 ) goto err;
+
+  m_piece_hash = new BTHASH *[m_npieces];
+  if( !m_piece_hash ){
+    CONSOLE.Warning(1, "error, allocate piece hash index failed");
+    goto err;
+  }
+  memset(m_piece_hash, 0, m_npieces * sizeof(BTHASH *));
   CacheConfigure();
 
   *ptr++ = (unsigned char)19;              // protocol string length
@@ -522,35 +625,68 @@ btContent::~btContent()
   if( m_hash_table ) delete []m_hash_table;
   if( global_piece_buffer ) delete []global_piece_buffer;
   if( pBF ) delete pBF;
+  if( m_piece_hash ){
+    for( bt_index_t i = 0; i < m_npieces; i++ ) HashReset(i);
+    delete []m_piece_hash;
+  }
+  if( m_partial ){
+    for( bt_index_t i = 0; i < m_npieces; i++ ) PartialReset(i);
+    delete []m_partial;
+  }
+  CheckRelease();
+  CacheRelease();
+  for( int i = 0; i < DT_CACHE_NPOLICIES; i++ )
+    if( m_policies[i] ) delete m_policies[i];
   if( m_metainfo_file ) delete []m_metainfo_file;
 }
 
+// Cache hits and misses are counted in slices, overall and for the policy.
+inline void btContent::CountHit(bt_length_t len)
+{
+  dt_count_t n = (len + DEFAULT_SLICE_SIZE - 1) / DEFAULT_SLICE_SIZE;
+  m_cache_hit += n;
+  m_policy->CountHits(n);
+}
+
+inline void btContent::CountMiss(bt_length_t len)
+{
+  dt_count_t n = (len + DEFAULT_SLICE_SIZE - 1) / DEFAULT_SLICE_SIZE;
+  m_cache_miss += n;
+  m_policy->CountMisses(n);
+}
+
 int btContent::ReadSlice(char *buf, bt_index_t idx, bt_offset_t off,
   bt_length_t len)
 {
   dt_datalen_t offset = (dt_datalen_t)idx * (dt_datalen_t)m_piece_length + off;
 
+  // Mapped data is prefetched by the system instead of into the cache.
+  if( !buf && Mappable(idx) && m_btfiles.Map(offset, len, true) ) return 0;
+
   if( !m_cache_size ) return buf ? FileIO(buf, NULL, offset, len) : 0;
   else{
     bt_length_t len2;
     BTCACHE *p;
 
-    p = m_cache[idx];
-    while( len && p ){
-      while( p && offset + len > p->bc_off && !CACHE_FIT(p, offset, len) ){
-        p = p->bc_next;
+    p = (BTCACHE *)0;
+    while( len ){
+      if( !p || !CACHE_FIT(p, offset, len) ){
+        if( !(p = CacheFind(idx, offset, len)) ) break;
       }
-      if( !p || !CACHE_FIT(p, offset, len) ) break;
       if( offset < p->bc_off ){
         len2 = p->bc_off - offset;
         if( CacheIO(buf, NULL, offset, len2, 0) < 0 ) return -1;
-        if( buf ) m_cache_miss += len2 / DEFAULT_SLICE_SIZE +
-                                  ((len2 % DEFAULT_SLICE_SIZE) ? 1 : 0);
+        if( buf ) CountMiss(len2);
         else m_cache_pre += len2 / DEFAULT_SLICE_SIZE +
                             ((len2 % DEFAULT_SLICE_SIZE) ? 1 : 0);
-        p = m_cache[idx];  // p may not be valid after CacheIO
+        p = (BTCACHE *)0;  // p may not be valid after CacheIO
       }else{
         char *src;
+        if( buf && p->bc_f_load && READER.Pending() ){
+          LoadWait(idx);  // the data isn't here yet
+          p = (BTCACHE *)0;
+          continue;
+        }
         if( offset > p->bc_off ){
           len2 = p->bc_off + p->bc_len - offset;
           if( len2 > len ) len2 = len;
@@ -561,19 +697,9 @@ int btContent::ReadSlice(char *buf, bt_index_t idx, bt_offset_t off,
         }
         if( buf ){
           memcpy(buf, src, len2);
-          m_cache_hit += len2 / DEFAULT_SLICE_SIZE +
-                         ((len2 % DEFAULT_SLICE_SIZE) ? 1 : 0);
-        }else{  // prefetch only, update the age
-          if( m_cache_newest != p ){
-            if( m_cache_oldest == p ) m_cache_oldest = p->age_next;
-            else p->age_prev->age_next = p->age_next;
-            p->age_next->age_prev = p->age_prev;
-            m_cache_newest->age_next = p;
-            p->age_next = (BTCACHE *)0;
-            p->age_prev = m_cache_newest;
-            m_cache_newest = p;
-          }
+          CountHit(len2);
         }
+        m_policy->Touch(p, buf ? true : false);
         p = p->bc_next;
       }
 
@@ -583,8 +709,7 @@ int btContent::ReadSlice(char *buf, bt_index_t idx, bt_offset_t off,
     }  // end while
 
     if( len ){
-      if( buf ) m_cache_miss += len / DEFAULT_SLICE_SIZE +
-                                ((len % DEFAULT_SLICE_SIZE) ? 1 : 0);
+      if( buf ) CountMiss(len);
       else m_cache_pre += len / DEFAULT_SLICE_SIZE +
                           ((len % DEFAULT_SLICE_SIZE) ? 1 : 0);
       return CacheIO(buf, NULL, offset, len, 0);
@@ -594,49 +719,73 @@ int btContent::ReadSlice(char *buf, bt_index_t idx, bt_offset_t off,
 }
 
 
+// Can the piece be sent straight from the files?
+bool btContent::Mappable(bt_index_t idx) const
+{
+  if( !*cfg_seed_mmap || !Seeding() || !pBF->IsSet(idx) ) return false;
+  for( BTCACHE *p = m_cache[idx]; p; p = p->bc_next ){
+    if( p->bc_f_flush ) return false;  // not written yet
+  }
+  return true;
+}
+
+/* Get a slice to send directly from a file mapping, bypassing the cache.
+   The data is only valid until the next call.
+   Returns NULL if the slice must be read with ReadSlice() instead. */
+const char *btContent::MapSlice(bt_index_t idx, bt_offset_t off,
+  bt_length_t len)
+{
+  const char *data;
+
+  if( !Mappable(idx) ) return (char *)0;
+  data = m_btfiles.Map((dt_datalen_t)idx * (dt_datalen_t)m_piece_length + off,
+    len, false);
+  if( data ) m_map_sent++;
+  return data;
+}
+
+
 inline void btContent::CacheClean(bt_length_t need)
 {
   CacheClean(need, m_npieces);
 }
 
-/* idx is a piece we wish to avoid expiring */
+/* idx is a piece we wish to avoid expiring.
+   When seeding, data that fewer connected peers still need is expired first:
+   each pass lets pieces needed by up to twice as many peers go, so pieces
+   that every peer already has go before the ones much of the swarm lacks. */
 void btContent::CacheClean(bt_length_t need, bt_index_t idx)
 {
   BTCACHE *p, *pnext;
   int f_flush = 0;
+  bool popular = IsFull() && WORLD.GetPeersCount();
+  dt_count_t limit = 0;
 
   if( m_flush_failed && now >= m_flush_tried + FLUSH_RETRY_INTERVAL && need )
     FlushCache();  // try again
 
   again:
-  for( p=m_cache_oldest; p && m_cache_size < m_cache_used + need; p=pnext ){
-    pnext = p->age_next;
-    if( f_flush && p->bc_f_flush && !m_flush_failed ){
+  for( p = m_policy->First(); p && m_cache_size < m_cache_used + need;
+       p = pnext ){
+    pnext = m_policy->Next(p);
+    if( f_flush && p->bc_f_flush && !p->bc_f_busy && !m_flush_failed ){
       if( FlushPiece(p->bc_off / m_piece_length) ){
-        pnext = m_cache_oldest;
+        pnext = m_policy->First();
         continue;
       }
     }
-    if( !p->bc_f_flush ){
+    if( !p->bc_f_flush && !p->bc_f_load ){
       if( !f_flush && idx == p->bc_off / m_piece_length ) continue;
-      if(*cfg_verbose)
-        CONSOLE.Debug("Expiring %d/%d/%d", (int)(p->bc_off / m_piece_length),
-          (int)(p->bc_off % m_piece_length), (int)p->bc_len);
-
-      if( m_cache_oldest == p ) m_cache_oldest = p->age_next;
-      else p->age_prev->age_next = p->age_next;
-      if( m_cache_newest == p ) m_cache_newest = p->age_prev;
-      else p->age_next->age_prev = p->age_prev;
-
-      if( p->bc_prev ) p->bc_prev->bc_next = p->bc_next;
-      else m_cache[p->bc_off / m_piece_length] = p->bc_next;
-      if( p->bc_next ) p->bc_next->bc_prev = p->bc_prev;
-
-      m_cache_used -= p->bc_len;
-      delete []p->bc_buf;
-      delete p;
+      if( popular && WORLD.PieceNeed(p->bc_off / m_piece_length) > limit )
+        continue;
+      CacheExpire(p);
     }
   }
+  if( popular && m_cache_size < m_cache_used + need &&
+      limit < WORLD.GetPeersCount() ){
+    limit = limit ? limit * 2 : 1;
+    goto again;
+  }
   if( m_cache_size < m_cache_used + need ){  // still not enough
     if( m_cache_size < (*cfg_cache_size)*1024U*1024U ){  // can alloc more
       m_cache_size = (m_cache_used + need > (*cfg_cache_size)*1024U*1024U) ?
@@ -646,14 +795,80 @@ void btContent::CacheClean(bt_length_t need, bt_index_t idx)
       if(*cfg_verbose) CONSOLE.Debug("CacheClean flushing to obtain space");
       f_flush = 1;
       goto again;
+    }
+    if( m_cache_size < m_cache_used + need && m_flush_inflight ){
+      FLUSHER.WaitOne();  // the only way to get space is to finish writing
+      goto again;
     }  // else we tried...
   }
 }
 
+// Remove an entry from the cache and free it.
+void btContent::CacheExpire(BTCACHE *p)
+{
+  bt_index_t idx = p->bc_off / m_piece_length;
+  BTCACHE **slot = m_cache_slot[idx];
+  bt_length_t b = CACHE_SLOT(p->bc_off);
+
+  if(*cfg_verbose)
+    CONSOLE.Debug("Expiring %d/%d/%d", (int)idx,
+      (int)(p->bc_off % m_piece_length), (int)p->bc_len);
+
+  m_policy->Remove(p, true);
+  if( p->bc_f_flush ) m_cache_dirty -= p->bc_len;
+
+  if( slot[b] == p ){
+    slot[b] = (p->bc_next && CACHE_SLOT(p->bc_next->bc_off) == b) ?
+      p->bc_next : (BTCACHE *)0;
+  }
+  if( p->bc_prev ) p->bc_prev->bc_next = p->bc_next;
+  else m_cache[idx] = p->bc_next;
+  if( p->bc_next ) p->bc_next->bc_prev = p->bc_prev;
+  if( !m_cache[idx] ){
+    delete []slot;
+    m_cache_slot[idx] = (BTCACHE **)0;
+  }
+
+  m_cache_used -= p->bc_len;
+  CacheFree(p);
+}
+
+/* Find the first cache entry that overlaps the given range of a piece.
+   Entries never cross a block boundary, and each piece's slot index points
+   to the first entry in each block, so only the blocks within the range are
+   examined.  Without count, the lookup isn't included in the statistics. */
+BTCACHE *btContent::CacheFind(bt_index_t idx, dt_datalen_t off,
+  bt_length_t len, bool count)
+{
+  BTCACHE *p, **slot;
+  bt_length_t b, last;
+
+  if( count ) m_cache_lookups++;
+  if( !m_cache_slot || !(slot = m_cache_slot[idx]) ) return (BTCACHE *)0;
+
+  if( count && *cfg_verbose ){
+    // For comparison, count what a walk from the head of the list examines.
+    for( p = m_cache[idx]; p; p = p->bc_next ){
+      m_cache_walks++;
+      if( p->bc_off + p->bc_len > off ) break;
+    }
+  }
+
+  last = CACHE_SLOT(off + len - 1);
+  for( b = CACHE_SLOT(off); b <= last; b++ ){
+    for( p = slot[b]; p && CACHE_SLOT(p->bc_off) == b; p = p->bc_next ){
+      if( count ) m_cache_probes++;
+      if( p->bc_off >= off + len ) return (BTCACHE *)0;
+      if( p->bc_off + p->bc_len > off ) return p;
+    }
+  }
+  return (BTCACHE *)0;
+}
+
 // Don't call this function if cfg_cache_size==0 !
 void btContent::CacheEval()
 {
-  BTCACHE *p = m_cache_oldest;
+  BTCACHE *p = m_policy->First();
   time_t interval;
   dt_mem_t unflushed = 0, dlnext, upadd = 0, upmax = 0, upmin = 0, total;
 
@@ -674,7 +889,7 @@ void btContent::CacheEval()
   if( pBF->IsFull() ) dlnext = 0;
   else{
     if( pBF->Count() < 2 ) unflushed = m_cache_used;
-    else for( ; p; p = p->age_next )
+    else for( ; p; p = m_policy->Next(p) )
       if( p->bc_f_flush ) unflushed += p->bc_len;
     /* Make sure we can read back and check a completed piece.
        But free some cache if download has completely stalled. */
@@ -757,85 +972,318 @@ void btContent::CacheConfigure()
       cfg_cache_size = (GetTotalFilesLength()+1024*1024-1)/1024/1024;
     else CacheEval();
   }else m_cache_size = 0;
+  CacheReserve((dt_mem_t)*cfg_cache_size * 1024 * 1024);
+  if( m_policy )
+    m_policy->Configure(m_npieces, m_piece_length, *cfg_cache_size*1024*1024);
 
   if( m_cache_size < m_cache_used && !m_flush_failed ) CacheClean(0);
 }
 
+/* Switch to the configured cache replacement policy, handing it any cached
+   data.  Each policy that has been used is kept for its statistics. */
+int btContent::SetCachePolicy()
+{
+  btCachePolicy *policy;
+  BTCACHE *p, *pnext;
+  int n = *cfg_cache_policy;
+
+  if( !m_cache ) return 0;  // not started yet
+
+  if( !(policy = m_policies[n]) ){
+    policy = m_policies[n] = NewCachePolicy((dt_cachepolicy_t)n);
+#ifndef WINDOWS
+    if( !policy ){
+      CONSOLE.Warning(1, "error, allocate cache policy failed");
+      return -1;
+    }
+#endif
+  }
+  if( policy == m_policy ) return 0;
+
+  policy->Configure(m_npieces, m_piece_length, *cfg_cache_size*1024*1024);
+  if( m_policy ){
+    for( p = m_policy->First(); p; p = pnext ){
+      pnext = m_policy->Next(p);
+      m_policy->Remove(p, false);
+      policy->Insert(p, false);
+    }
+    if(*cfg_verbose) CONSOLE.Debug("Cache policy changed from %s to %s",
+      m_policy->Name(), policy->Name());
+  }
+  m_policy = policy;
+  return 0;
+}
+
 int btContent::NeedFlush() const
 {
   if( m_flush_failed ){
     return (now >= m_flush_tried + FLUSH_RETRY_INTERVAL) ? 1 : 0;
   }else{
     return (m_flushq ||
-            (m_cache_oldest && m_cache_oldest->bc_f_flush &&
+            (FlushBehind() && m_cache_dirty > m_flush_writing) ||
+            (m_policy && m_policy->First() &&
+             m_policy->First()->bc_f_flush && !m_policy->First()->bc_f_busy &&
              m_cache_used >=
                (*cfg_cache_size)*1024U*1024U - *cfg_req_slice_size + 1)) ?
            1 : 0;
   }
 }
 
+/* Too much data is waiting to be written; downloading should hold off until
+   the flusher catches up. */
+bool btContent::FlushBehind() const
+{
+  return m_cache_dirty >
+    (dt_mem_t)(*cfg_cache_size) * 1024 * 1024 / 100 * DIRTY_SHARE;
+}
+
 void btContent::FlushCache()
 {
+  bt_index_t *pieces, n;
+  dt_mem_t dirty;
+
   if(*cfg_verbose) CONSOLE.Debug("Flushing all cache");
-  for( bt_index_t i=0; i < m_npieces; i++ ){
-    if( m_cache[i] ) FlushPiece(i);
-    if( m_flush_failed ) break;
-  }
+  pieces = new bt_index_t[m_npieces];
+  /* FlushPieces() skips data that is already being written and may stop
+     short if it can't allocate, so repeat until nothing is dirty, a write
+     fails, or a pass makes no progress. */
+  do{
+    dirty = m_cache_dirty;
+#ifndef WINDOWS
+    if( !pieces ){
+      for( bt_index_t i=0; i < m_npieces; i++ ){
+        if( m_cache[i] ) FlushPiece(i);
+        if( m_flush_failed ) break;
+      }
+    }else
+#endif
+    {
+      n = 0;
+      for( bt_index_t i=0; i < m_npieces; i++ )
+        if( m_cache[i] ) pieces[n++] = i;
+      FlushPieces(pieces, n);
+    }
+    FLUSHER.Wait();
+  }while( m_cache_dirty && !m_flush_failed && m_cache_dirty < dirty );
+  if( pieces ) delete []pieces;
   if( !NeedMerge() && !m_flushq && Seeding() ) CloseAllFiles();
 }
 
-// Returns 1 if cache aging changed.
-int btContent::FlushPiece(bt_index_t idx)
+/* Moves the data of cache entries between the cache and the files on a
+   worker thread.  Each entry's position and buffer are copied so that Run()
+   needn't look at the cache. */
+class btCacheJob: public WorkJob
 {
-  BTCACHE *p;
-  int retval = 0;
-  bool logged = false;
+ public:
+  typedef struct{
+    BTCACHE *p;
+    dt_datalen_t off;
+    bool drop;         // the system may drop the data once written
+  }ENTRY;
 
-  p = m_cache[idx];
+  ENTRY *entry;
+  struct iovec *iov;   // buffer of each entry
+  int count;
+  int done;            // entries read or written
+
+  btCacheJob(){
+    entry = (ENTRY *)0;
+    iov = (struct iovec *)0;
+    count = done = 0;
+  }
+  ~btCacheJob(){
+    if( entry ) delete []entry;
+    if( iov ) delete []iov;
+  }
+
+  // Make room for n entries.
+  int Alloc(int n){
+    entry = new ENTRY[n];
+    iov = new struct iovec[n];
+#ifndef WINDOWS
+    if( !entry || !iov ) return -1;
+#endif
+    return 0;
+  }
+};
 
-  for( ; p; p = p->bc_next ){
-    /* Update the age if piece is complete, as this should mean we've just
-       completed the piece and made it available. */
-    if( pBF->IsSet(idx) && m_cache_newest != p ){
-      if( m_cache_oldest == p ) m_cache_oldest = p->age_next;
-      else p->age_prev->age_next = p->age_next;
-      p->age_next->age_prev = p->age_prev;
-      m_cache_newest->age_next = p;
-      p->age_next = (BTCACHE *)0;
-      p->age_prev = m_cache_newest;
-      m_cache_newest = p;
-      retval = 1;
-    }
-    if( p->bc_f_flush ){
-      if( *cfg_verbose && !logged ){
-        if( pBF->IsSet(idx) )
-          CONSOLE.Debug("Writing piece #%d to disk", (int)idx);
-        else CONSOLE.Debug("Flushing piece #%d", (int)idx);
-        logged = true;
+/* Writes a batch of unflushed cache entries, run by the flusher thread.  The
+   entries are in offset order, and each run of adjacent ones is written
+   with a single call.  They are marked busy until Done() reports the
+   result, so meanwhile they are neither freed nor submitted again. */
+class btFlushJob: public btCacheJob
+{
+ public:
+  void Run(){
+    dt_datalen_t len;
+    int n, i, k;
+
+    for( done = 0; done < count; done += n ){
+      for( n = 1; done + n < count &&
+                  entry[done+n].off == entry[done+n-1].off +
+                                       iov[done+n-1].iov_len; n++ );
+      if( BTCONTENT.m_btfiles.WriteV(iov + done, n, entry[done].off) < 0 )
+        break;
+      for( i = done; i < done + n; i = k ){
+        for( k = i, len = 0; k < done + n && entry[k].drop == entry[i].drop;
+             k++ )
+          len += iov[k].iov_len;
+        if( entry[i].drop )
+          BTCONTENT.m_btfiles.Advise(entry[i].off, len, DT_ADVISE_DONTNEED);
       }
-      FlushEntry(p);
     }
   }
+  void Done(){ BTCONTENT.FlushResult(this); }
+};
 
-  return retval;
+static int FlushOrder(const void *a, const void *b)
+{
+  dt_datalen_t x = (*(const BTCACHE * const *)a)->bc_off;
+  dt_datalen_t y = (*(const BTCACHE * const *)b)->bc_off;
+
+  return (x < y) ? -1 : (x > y) ? 1 : 0;
 }
 
-void btContent::FlushEntry(BTCACHE *p)
+/* Submit the unflushed data of some pieces to be written, sorted by offset
+   so that the disk is swept in one direction and adjacent data (also across
+   pieces) is written together.  Without a flusher thread the data is
+   written before this returns.
+   Returns 1 if cache aging changed. */
+int btContent::FlushPieces(const bt_index_t *pieces, bt_index_t npieces)
 {
+  BTCACHE *p, **list;
+  btFlushJob *job;
+  dt_mem_t size;
+  int n = 0, i, j, retval = 0;
+
+  for( bt_index_t k = 0; k < npieces; k++ ){
+    for( p = m_cache[pieces[k]]; p; p = p->bc_next ){
+      /* Update the age if piece is complete, as this should mean we've just
+         completed the piece and made it available. */
+      if( pBF->IsSet(pieces[k]) ){
+        m_policy->Renew(p);
+        retval = 1;
+      }
+      if( p->bc_f_flush && !p->bc_f_busy ) n++;
+    }
+  }
+  if( !n ) return retval;
   if( m_flush_failed && now < m_flush_tried + FLUSH_RETRY_INTERVAL ){
     // Delay until next retry.
-    return;
+    return retval;
   }
-  if( p->bc_f_flush && FileIO(NULL, p->bc_buf, p->bc_off, p->bc_len) == 0 ){
-    p->bc_f_flush = 0;
-    if( m_flush_failed ){
-      m_flush_failed = 0;
-      CONSOLE.Warning(3, "Flushing cache succeeded%s.",
-        Seeding() ? "" : "; resuming download");
-      CacheConfigure();
-      WORLD.CheckInterest();
+
+  list = new BTCACHE *[n];
+#ifndef WINDOWS
+  if( !list ) return retval;
+#endif
+  n = 0;
+  for( bt_index_t k = 0; k < npieces; k++ ){
+    i = n;
+    for( p = m_cache[pieces[k]]; p; p = p->bc_next )
+      if( p->bc_f_flush && !p->bc_f_busy ) list[n++] = p;
+    if( *cfg_verbose && n > i ){
+      if( pBF->IsSet(pieces[k]) )
+        CONSOLE.Debug("Writing piece #%d to disk", (int)pieces[k]);
+      else CONSOLE.Debug("Flushing piece #%d", (int)pieces[k]);
+    }
+  }
+  if( npieces > 1 ) qsort(list, n, sizeof(*list), FlushOrder);
+
+  // Split into batches so that written data can be released along the way.
+  for( i = 0; i < n; i = j ){
+    size = 0;
+    for( j = i; j < n && (j == i || size + list[j]->bc_len <= FLUSH_BATCH);
+         j++ ){
+      size += list[j]->bc_len;
+    }
+    job = new btFlushJob;
+#ifndef WINDOWS
+    if( !job ) break;
+#endif
+    if( job->Alloc(j - i) < 0 ){
+      delete job;
+      break;
+    }
+    for( ; job->count < j - i; job->count++ ){
+      p = list[i + job->count];
+      p->bc_f_busy = 1;
+      job->entry[job->count].p = p;
+      job->entry[job->count].off = p->bc_off;
+      /* A complete piece that no peer needs won't be read back soon.  The
+         flusher thread can wait for it to reach the disk and drop it. */
+      job->entry[job->count].drop = FLUSHER.Threads() &&
+        pBF->IsSet(p->bc_off / m_piece_length) &&
+        !WORLD.PieceNeed(p->bc_off / m_piece_length);
+      job->iov[job->count].iov_base = p->bc_buf;
+      job->iov[job->count].iov_len = p->bc_len;
+      m_flush_writing += p->bc_len;
+    }
+    m_flush_inflight++;
+    FLUSHER.Submit(job);
+    if( m_flush_failed && !FLUSHER.Threads() ) break;
+  }
+  delete []list;
+  return retval;
+}
+
+// Mark the written data clean, on the main thread.
+void btContent::FlushResult(btFlushJob *job)
+{
+  BTCACHE *p;
+
+  m_btfiles.Report();
+  for( int i = 0; i < job->count; i++ ){
+    p = job->entry[i].p;
+    p->bc_f_busy = 0;
+    m_flush_writing -= p->bc_len;
+    if( i < job->done ){
+      p->bc_f_flush = 0;
+      m_cache_dirty -= p->bc_len;
     }
   }
+  m_flush_inflight--;
+
+  if( job->done < job->count ){
+    if( !m_flush_failed || m_flush_tried != now ) WriteFail();
+  }else if( m_flush_failed ){
+    m_flush_failed = 0;
+    CONSOLE.Warning(3, "Flushing cache succeeded%s.",
+      Seeding() ? "" : "; resuming download");
+    CacheConfigure();
+    WORLD.CheckInterest();
+  }
+  delete job;
+
+  if( m_flush_draining && !m_flush_inflight ){
+    m_flush_draining = 0;
+    if( !m_flushq ) FlushFinished();
+  }
+}
+
+// The oldest data that can be flushed now.
+BTCACHE *btContent::FlushFirst() const
+{
+  BTCACHE *p;
+
+  for( p = m_policy->First(); p; p = m_policy->Next(p) ){
+    if( p->bc_f_flush && !p->bc_f_busy ) break;
+  }
+  return p;
+}
+
+// Wait until none of a piece's data is being written.
+void btContent::FlushWait(bt_index_t idx)
+{
+  BTCACHE *p;
+
+  for( p = m_cache[idx]; p; ){
+    if( p->bc_f_busy ){
+      if( !FLUSHER.Pending() ) break;
+      FLUSHER.WaitOne();
+      p = m_cache[idx];
+    }else p = p->bc_next;
+  }
 }
 
 // Returns -1 for convenience (can return this function's value)
@@ -845,7 +1293,7 @@ int btContent::WriteFail()
 
   needbytes = GetNeedBytes();
 
-  for( BTCACHE *p = m_cache_oldest; p; p = p->age_next )
+  for( BTCACHE *p = m_policy->First(); p; p = m_policy->Next(p) )
     if( p->bc_f_flush ) needbytes += p->bc_len;
 
   m_flush_tried = now;
@@ -873,33 +1321,70 @@ void btContent::Uncache(bt_index_t idx)
 {
   BTCACHE *p, *pnext;
 
+  FlushWait(idx);
+  LoadWait(idx);
   p = m_cache[idx];
   for( ; p; p = pnext ){
     pnext = p->bc_next;
-     if( m_cache_oldest == p ) m_cache_oldest = p->age_next;
-     else p->age_prev->age_next = p->age_next;
-     if( m_cache_newest == p ) m_cache_newest = p->age_prev;
-     else p->age_next->age_prev = p->age_prev;
-
-     m_cache_used -= p->bc_len;
-     delete []p->bc_buf;
-     delete p;
+    m_policy->Remove(p, false);
+    m_cache_used -= p->bc_len;
+    if( p->bc_f_flush ) m_cache_dirty -= p->bc_len;
+    CacheFree(p);
   }
   m_cache[idx] = (BTCACHE *)0;
+  if( m_cache_slot && m_cache_slot[idx] ){
+    delete []m_cache_slot[idx];
+    m_cache_slot[idx] = (BTCACHE **)0;
+  }
+  HashReset(idx);
+  PartialReset(idx);
+}
+
+// Number of pieces waiting in the flush queue.
+dt_count_t btContent::FlushQueueLength() const
+{
+  dt_count_t n = 0;
+
+  for( BTFLUSH *p = m_flushq; p; p = p->next ) n++;
+  return n;
 }
 
+/* Submitting is cheap with a flusher thread, so then the whole queue goes at
+   once, letting the writes be ordered and combined. */
 void btContent::FlushQueue()
 {
-  if( m_flushq ){
+  BTCACHE *p;
+  bt_index_t *pieces = (bt_index_t *)0, n = 0;
+  BTFLUSH *goner;
+
+  if( m_flushq && FLUSHER.Threads() &&
+      (pieces = new bt_index_t[FlushQueueLength()]) ){
+    for( BTFLUSH *q = m_flushq; q; q = q->next ) pieces[n++] = q->idx;
+    FlushPieces(pieces, n);
+    delete []pieces;
+    while( m_flushq && !m_flush_failed ){
+      goner = m_flushq;
+      m_flushq = m_flushq->next;
+      delete goner;
+    }
+  }else if( m_flushq ){
     FlushPiece(m_flushq->idx);
     if( !m_flush_failed ){
-      BTFLUSH *goner = m_flushq;
+      goner = m_flushq;
       m_flushq = m_flushq->next;
       delete goner;
     }
-  }else FlushPiece(m_cache_oldest->bc_off / m_piece_length);
+  }else if( (p = FlushFirst()) ) FlushPiece(p->bc_off / m_piece_length);
+
+  if( !m_flushq ){
+    if( m_flush_inflight ) m_flush_draining = 1;  // finish when written
+    else FlushFinished();
+  }
+}
 
-  if( !m_flushq && Seeding() ){
+void btContent::FlushFinished()
+{
+  if( Seeding() ){
     if( !NeedMerge() ){
       CloseAllFiles();
       CONSOLE.Print("Finished flushing data.");
@@ -921,57 +1406,186 @@ bool btContent::CachePrep(bt_index_t idx)
   if( m_cache_size < m_cache_used + need ){
     for( p=m_cache[idx]; p; p=p->bc_next ) need -= p->bc_len;
     if( 0==need ) return false;  // don't need to prefetch
-    for( p=m_cache_oldest; p && m_cache_size < m_cache_used + need; p=pnext ){
-      pnext = p->age_next;
+    for( p = m_policy->First(); p && m_cache_size < m_cache_used + need;
+         p = pnext ){
+      pnext = m_policy->Next(p);
       if( p->bc_off / m_piece_length == idx ) continue;
-      if( p->bc_f_flush && !m_flush_failed &&
-          FlushPiece(p->bc_off / m_piece_length) ){
-        pnext = m_cache_oldest;
-        continue;
+      if( p->bc_f_flush ){
+        if( !m_flush_failed && !p->bc_f_busy &&
+            FlushPiece(p->bc_off / m_piece_length) ){
+          pnext = m_policy->First();
+          continue;
+        }
+        if( p->bc_f_flush ) continue;  // still being written
       }
-      if(*cfg_verbose)
-        CONSOLE.Debug("Expiring %d/%d/%d", (int)(p->bc_off / m_piece_length),
-          (int)(p->bc_off % m_piece_length), (int)p->bc_len);
-      if( m_cache_oldest == p ) m_cache_oldest = p->age_next;
-      else p->age_prev->age_next = p->age_next;
-      if( m_cache_newest == p ) m_cache_newest = p->age_prev;
-      else p->age_next->age_prev = p->age_prev;
+      if( p->bc_f_load ) continue;
+      CacheExpire(p);
+    }
+  }
+  return true;
+}
 
-      if( p->bc_prev ) p->bc_prev->bc_next = p->bc_next;
-      else m_cache[p->bc_off / m_piece_length] = p->bc_next;
-      if( p->bc_next ) p->bc_next->bc_prev = p->bc_prev;
+/* Advance the in-order hash of a piece with newly received data, then catch
+   up using any following data that is already in the cache. */
+void btContent::HashSlice(bt_index_t idx, bt_offset_t off, const char *buf,
+  bt_length_t len)
+{
+  BTHASH *h;
+  BTCACHE *p;
+  dt_datalen_t offset;
+  bt_length_t len2;
 
-      m_cache_used -= p->bc_len;
-      delete []p->bc_buf;
-      delete p;
-    }
+  if( !m_piece_hash ) return;
+  if( !(h = m_piece_hash[idx]) ){
+    if( off ) return;  // wait for the start of the piece
+    h = new BTHASH;
+#ifndef WINDOWS
+    if( !h ) return;
+#endif
+    h->bh_len = 0;
+    Sha1Init(&h->bh_ctx);
+    m_piece_hash[idx] = h;
+  }
+
+  if( off < h->bh_len ){  // hashed data was replaced
+    HashReset(idx);
+    return;
+  }
+  if( off > h->bh_len ) return;  // out of order; catch up later
+  Sha1Update(&h->bh_ctx, buf, len);
+  h->bh_len += len;
+
+  if( h->bh_len >= GetPieceLength(idx) ) return;
+  offset = (dt_datalen_t)idx * m_piece_length + h->bh_len;
+  for( p = CacheFind(idx, offset, 1); p && p->bc_off <= offset;
+       p = p->bc_next ){
+    if( p->bc_off + p->bc_len <= offset ) continue;
+    if( p->bc_f_load ) break;  // not read in yet; catch up later
+    len2 = p->bc_off + p->bc_len - offset;
+    Sha1Update(&h->bh_ctx, p->bc_buf + (offset - p->bc_off), len2);
+    h->bh_len += len2;
+    offset += len2;
+  }
+}
+
+void btContent::HashReset(bt_index_t idx)
+{
+  if( m_piece_hash && m_piece_hash[idx] ){
+    delete m_piece_hash[idx];
+    m_piece_hash[idx] = (BTHASH *)0;
+  }
+}
+
+/* Maps of which parts of incomplete pieces have been received, so that only
+   the missing slices need to be requested (including after a restart).  Each
+   bit represents PARTIAL_UNIT bytes. */
+size_t btContent::PartialSize(bt_index_t idx) const
+{
+  bt_length_t units = (GetPieceLength(idx) + PARTIAL_UNIT - 1) / PARTIAL_UNIT;
+  return (units + 7) / 8;
+}
+
+unsigned char *btContent::PartialMap(bt_index_t idx)
+{
+  if( !m_partial ){
+    m_partial = new unsigned char *[m_npieces];
+#ifndef WINDOWS
+    if( !m_partial ) return (unsigned char *)0;
+#endif
+    memset(m_partial, 0, m_npieces * sizeof(unsigned char *));
   }
+  if( !m_partial[idx] ){
+    m_partial[idx] = new unsigned char[PartialSize(idx)];
+#ifndef WINDOWS
+    if( !m_partial[idx] ) return (unsigned char *)0;
+#endif
+    memset(m_partial[idx], 0, PartialSize(idx));
+  }
+  return m_partial[idx];
+}
+
+void btContent::PartialSet(bt_index_t idx, bt_offset_t off, bt_length_t len)
+{
+  unsigned char *map;
+  bt_length_t unit, end;
+
+  if( !(map = PartialMap(idx)) ) return;
+  unit = (off + PARTIAL_UNIT - 1) / PARTIAL_UNIT;
+  end = (off + len == GetPieceLength(idx)) ?
+    (off + len + PARTIAL_UNIT - 1) / PARTIAL_UNIT : (off + len) / PARTIAL_UNIT;
+  for( ; unit < end; unit++ ) map[unit / 8] |= (0x80 >> (unit % 8));
+}
+
+// Returns true if the given part of the piece has already been received.
+bool btContent::PartialHas(bt_index_t idx, bt_offset_t off, bt_length_t len)
+  const
+{
+  const unsigned char *map;
+  bt_length_t unit, end;
+
+  if( !m_partial || !(map = m_partial[idx]) ) return false;
+  unit = off / PARTIAL_UNIT;
+  end = (off + len + PARTIAL_UNIT - 1) / PARTIAL_UNIT;
+  for( ; unit < end; unit++ )
+    if( !(map[unit / 8] & (0x80 >> (unit % 8))) ) return false;
   return true;
 }
 
+void btContent::PartialClear(bt_index_t idx, bt_offset_t off, bt_length_t len)
+{
+  bt_length_t unit, end;
+
+  if( !m_partial || !m_partial[idx] ) return;
+  unit = off / PARTIAL_UNIT;
+  end = (off + len + PARTIAL_UNIT - 1) / PARTIAL_UNIT;
+  for( ; unit < end; unit++ )
+    m_partial[idx][unit / 8] &= ~(0x80 >> (unit % 8));
+}
+
+void btContent::PartialReset(bt_index_t idx)
+{
+  if( m_partial && m_partial[idx] ){
+    delete []m_partial[idx];
+    m_partial[idx] = (unsigned char *)0;
+  }
+}
+
 int btContent::WriteSlice(const char *buf, bt_index_t idx, bt_offset_t off,
   bt_length_t len)
 {
   dt_datalen_t offset = (dt_datalen_t)idx * (dt_datalen_t)m_piece_length + off;
+  const char *data = buf;
+  bt_length_t datalen = len;
 
   if( !m_cache_size && FileIO(NULL, buf, offset, len) == 0 ){
+    HashSlice(idx, off, data, datalen);
+    PartialSet(idx, off, datalen);
     return 0;
     // save it in cache if write failed
   }else{
     bt_length_t len2;
     BTCACHE *p;
 
-    p = m_cache[idx];
-    while( len && p ){
-      while( p && offset + len > p->bc_off && !CACHE_FIT(p, offset, len) ){
-        p = p->bc_next;
+    p = (BTCACHE *)0;
+    while( len ){
+      if( !p || !CACHE_FIT(p, offset, len) ){
+        if( !(p = CacheFind(idx, offset, len)) ) break;
       }
-      if( !p || !CACHE_FIT(p, offset, len) ) break;
       if( offset < p->bc_off ){
         len2 = p->bc_off - offset;
         if( CacheIO(NULL, buf, offset, len2, 1) < 0 ) return -1;
-        p = m_cache[idx];  // p may not be valid after CacheIO
+        p = (BTCACHE *)0;  // p may not be valid after CacheIO
       }else{
+        if( p->bc_f_load && READER.Pending() ){
+          LoadWait(idx);  // don't let the read overwrite this data
+          p = (BTCACHE *)0;
+          continue;
+        }
+        if( p->bc_f_busy ){
+          FlushWait(idx);  // don't change the data while it's being written
+          p = (BTCACHE *)0;
+          continue;
+        }
         if( offset > p->bc_off ){
           len2 = p->bc_off + p->bc_len - offset;
           if( len2 > len ) len2 = len;
@@ -980,17 +1594,9 @@ int btContent::WriteSlice(const char *buf, bt_index_t idx, bt_offset_t off,
           len2 = (len > p->bc_len) ? p->bc_len : len;
           memcpy(p->bc_buf, buf, len2);
         }
+        if( !p->bc_f_flush ) m_cache_dirty += p->bc_len;
         p->bc_f_flush = 1;
-        // re-received this data, make it new again
-        if( m_cache_newest != p ){
-          if( m_cache_oldest == p ) m_cache_oldest = p->age_next;
-          else p->age_prev->age_next = p->age_next;
-          p->age_next->age_prev = p->age_prev;
-          m_cache_newest->age_next = p;
-          p->age_next = (BTCACHE *)0;
-          p->age_prev = m_cache_newest;
-          m_cache_newest = p;
-        }
+        m_policy->Renew(p);  // re-received this data, make it new again
         p = p->bc_next;
       }
 
@@ -999,19 +1605,41 @@ int btContent::WriteSlice(const char *buf, bt_index_t idx, bt_offset_t off,
       len -= len2;
     }  // end while
 
-    if( len ) return CacheIO(NULL, buf, offset, len, 1);
+    if( len && CacheIO(NULL, buf, offset, len, 1) < 0 ) return -1;
   }
+  HashSlice(idx, off, data, datalen);
+  PartialSet(idx, off, datalen);
   return 0;
 }
 
+/* Reads data into new cache entries ahead of use, run by a reader thread.
+   The entries are adjacent, so they are read with a single call.  They are
+   marked as loading until Done() reports the result; the data must not be
+   used or changed until then. */
+class btLoadJob: public btCacheJob
+{
+ public:
+  void Run(){
+    done = (BTCONTENT.m_btfiles.ReadV(iov, count, entry[0].off) < 0) ?
+      0 : count;
+  }
+  void Done(){ BTCONTENT.LoadResult(this); }
+};
+
 // Put data into the cache (receiving data, or need to read from disk).
 int btContent::CacheIO(char *rbuf, const char *wbuf, dt_datalen_t off,
   bt_length_t len, int method)
 {
   BTCACHE *p;
   BTCACHE *pp = (BTCACHE *)0;
-  BTCACHE *pnew = (BTCACHE *)0;
+  BTCACHE *pnew, *pnext;
+  BTCACHE *list = (BTCACHE *)0, *last = (BTCACHE *)0;
+  BTCACHE **slot;
+  btLoadJob *job = (btLoadJob *)0;
   bt_index_t idx = off / m_piece_length;
+  bt_index_t avoid = (0==method && !pBF->IsSet(idx)) ? idx : m_npieces;
+  bt_length_t chunk, b, got;
+  int n = 0;
 
   if( len >= (*cfg_cache_size)*1024U*768U ){  // 75% of cache limit
     if( rbuf || wbuf ) return FileIO(rbuf, wbuf, off, len);
@@ -1023,167 +1651,723 @@ int btContent::CacheIO(char *rbuf, const char *wbuf, dt_datalen_t off,
       (int)idx, (int)(off % m_piece_length), (int)len);
 
   if( m_cache_size < m_cache_used + len ){
-    if( 0==method && !pBF->IsSet(idx) ) CacheClean(len, idx);
-    else CacheClean(len);
+    CacheClean(len, avoid);
     /* Note, there is no failure code from CacheClean().  If nothing can be
-       done to increase the cache size, we allocate what we need anyway. */
+       done to increase the cache size, we use what the arena still holds. */
   }
 
   if( 0==method && rbuf && FileIO(rbuf, wbuf, off, len) < 0 )
     return -1;
 
-  pnew = new BTCACHE;
+  /* Get entries for the data a block at a time, aligned to blocks within the
+     piece.  This is done first, as making room may expire other data of the
+     piece.  Data that doesn't fit is written directly, or not cached. */
+  for( got = 0; got < len; got += chunk ){
+    chunk = CACHE_BLOCK_SIZE -
+            ((off + got) % m_piece_length) % CACHE_BLOCK_SIZE;
+    if( chunk > len - got ) chunk = len - got;
+    if( !(pnew = CacheAlloc(chunk, avoid)) ) break;
+    pnew->bc_off = off + got;
+    pnew->bc_len = chunk;
+    pnew->bc_next = (BTCACHE *)0;
+    if( last ) last->bc_next = pnew;
+    else list = pnew;
+    last = pnew;
+    n++;
+  }
+
+  if( list && !(slot = m_cache_slot[idx]) ){
+    slot = new BTCACHE *[m_cache_nslots];
 #ifndef WINDOWS
-  if( !pnew )
-    return (method && wbuf) ? FileIO(rbuf, wbuf, off, len) : 0;
+    if( !slot ){
+      for( ; list; list = pnext ){
+        pnext = list->bc_next;
+        CacheFree(list);
+      }
+      got = 0;
+    }else
 #endif
-
-  pnew->bc_buf = new char[len];
-#ifndef WINDOWS
-  if( !(pnew->bc_buf) ){
-    delete pnew;
-    return (method && wbuf) ? FileIO(rbuf, wbuf, off, len) : 0;
+    {
+      memset(slot, 0, m_cache_nslots * sizeof(BTCACHE *));
+      m_cache_slot[idx] = slot;
+    }
   }
-#endif
 
-  if( rbuf || wbuf ) memcpy(pnew->bc_buf, method ? wbuf : rbuf, len);
-  else if( 0==method && FileIO(pnew->bc_buf, wbuf, off, len) < 0 ){
-    delete []pnew->bc_buf;
-    delete pnew;
-    return -1;
+  // Read-ahead goes to a reader thread.
+  if( list && 0==method && !rbuf && (job = new btLoadJob) &&
+      job->Alloc(n) < 0 ){
+    delete job;
+    job = (btLoadJob *)0;
   }
-  pnew->bc_off = off;
-  pnew->bc_len = len;
-  pnew->bc_f_flush = method;
-  m_cache_used += len;
-  pnew->age_next = (BTCACHE *)0;
-  if( m_cache_newest ){
-    pnew->age_prev = m_cache_newest;
-    m_cache_newest->age_next = pnew;
-  }else{
-    pnew->age_prev = (BTCACHE *)0;
-    m_cache_oldest = pnew;
+  if( list && 0==method && !rbuf && !job ){  // it was only read-ahead
+    for( ; list; list = pnext ){
+      pnext = list->bc_next;
+      CacheFree(list);
+    }
   }
-  m_cache_newest = pnew;
 
-  // find insert point: after pp, before p.
-  p = m_cache[idx];
-  if( p ) pp = p->bc_prev;
-  for( ; p && off > p->bc_off; pp = p, p = pp->bc_next );
+  if( list ){
+    /* Find the insert point: after pp, before p.  Start from the entries in
+       this block, or else from the last entry in the nearest earlier block. */
+    b = CACHE_SLOT(off);
+    if( (p = slot[b]) ) pp = p->bc_prev;
+    else{
+      while( b > 0 && !slot[b-1] ) b--;
+      if( b > 0 ){
+        b--;
+        for( pp = slot[b];
+             pp->bc_next && CACHE_SLOT(pp->bc_next->bc_off) == b;
+             pp = pp->bc_next );
+        p = pp->bc_next;
+      }else p = m_cache[idx];
+    }
+    for( ; p && off > p->bc_off; pp = p, p = pp->bc_next );
+  }
 
-  pnew->bc_next = p;
-  pnew->bc_prev = pp;
-  if( pp ) pp->bc_next = pnew;
-  if( p ) p->bc_prev = pnew;
-  if( !m_cache[idx] || off < m_cache[idx]->bc_off )
-    m_cache[idx] = pnew;
+  for( pnew = list; pnew; pnew = pnext ){
+    pnext = pnew->bc_next;
+    chunk = pnew->bc_len;
 
+    if( rbuf || wbuf ){
+      memcpy(pnew->bc_buf, method ? wbuf : rbuf, chunk);
+      if( method ) wbuf += chunk;
+      else rbuf += chunk;
+    }else{
+      job->entry[job->count].p = pnew;
+      job->entry[job->count].off = pnew->bc_off;
+      job->iov[job->count].iov_base = pnew->bc_buf;
+      job->iov[job->count].iov_len = chunk;
+      job->count++;
+    }
+    pnew->bc_f_flush = method;
+    pnew->bc_f_busy = 0;
+    pnew->bc_f_load = job ? 1 : 0;
+    m_cache_used += chunk;
+    if( method ) m_cache_dirty += chunk;
+    m_policy->Insert(pnew, (0==method && rbuf) ? true : false);
+
+    pnew->bc_next = p;
+    pnew->bc_prev = pp;
+    if( pp ) pp->bc_next = pnew;
+    else m_cache[idx] = pnew;
+    if( p ) p->bc_prev = pnew;
+    pp = pnew;
+    b = CACHE_SLOT(pnew->bc_off);
+    if( !slot[b] || slot[b]->bc_off > pnew->bc_off ) slot[b] = pnew;
+  }
+
+  if( job ) READER.Submit(job);
+  if( got < len && method && wbuf )
+    return FileIO(NULL, wbuf, off + got, len - got);
   return 0;
 }
 
-/* Perform file I/O, handling failures.
-   Method (read/write) is determined by which buffer is given. */
-inline int btContent::FileIO(char *rbuf, const char *wbuf, dt_datalen_t off,
-  bt_length_t len)
+// Make read-ahead data available, or drop it if it couldn't be read.
+void btContent::LoadResult(btLoadJob *job)
 {
-  return ( m_btfiles.IO(rbuf, wbuf, off, len) < 0 ) ?
-             (wbuf ? WriteFail() : -1) : 0;
+  BTCACHE *p;
+
+  m_btfiles.Report();
+  if( job->done < job->count ){
+    bt_length_t len = 0;
+    for( int i = job->done; i < job->count; i++ ) len += job->iov[i].iov_len;
+    CONSOLE.Warning(2, "warn, failed to read ahead %d/%d/%d",
+      (int)(job->entry[job->done].off / m_piece_length),
+      (int)(job->entry[job->done].off % m_piece_length), (int)len);
+  }
+  for( int i = 0; i < job->count; i++ ){
+    p = job->entry[i].p;
+    p->bc_f_load = 0;
+    if( i >= job->done ) CacheExpire(p);
+  }
+  delete job;
 }
 
-inline int btContent::ReadPiece(char *buf, bt_index_t idx)
+// Wait until none of a piece's data is being read in.
+void btContent::LoadWait(bt_index_t idx)
 {
-  return ReadSlice(buf, idx, 0, GetPieceLength(idx));
+  BTCACHE *p;
+
+  for( p = m_cache[idx]; p; ){
+    if( p->bc_f_load ){
+      if( !READER.Pending() ) break;
+      READER.WaitOne();
+      p = m_cache[idx];
+    }else p = p->bc_next;
+  }
 }
 
-bt_length_t btContent::GetPieceLength(bt_index_t idx) const
+/* Tell the system how a slice of data will be used.  Data that is (even
+   partly) in the cache won't be read from the files soon. */
+void btContent::AdviseSlice(bt_index_t idx, bt_offset_t off, bt_length_t len,
+  dt_advice_t advice)
 {
-  /* Slight optimization to avoid division in every call.  The second test is
-     still needed in case the torrent size is exactly n pieces. */
+  dt_datalen_t offset = idx * (dt_datalen_t)m_piece_length + off;
+
+  if( DT_ADVISE_DONTNEED != advice && CacheFind(idx, offset, len, false) )
+    return;
+  m_btfiles.Advise(offset, len, advice);
+}
+
+// Arena memory is aligned for direct file I/O.
+static char *ArenaAlloc(size_t size)
+{
+#ifdef USE_DIRECT_IO
+  void *buf;
+  return (0 == posix_memalign(&buf, DIRECT_ALIGN, size)) ? (char *)buf :
+    (char *)0;
+#else
+  return new char[size];
+#endif
+}
+
+static void ArenaFree(char *buf)
+{
+#ifdef USE_DIRECT_IO
+  free(buf);
+#else
+  delete []buf;
+#endif
+}
+
+/* Make sure the arena has room for size bytes of cache data.  The arena
+   only grows while entries are in use; it is rebuilt when the cache is empty.
+   If it can't be allocated, the cache holds only what fits. */
+void btContent::CacheReserve(dt_mem_t size)
+{
+  BTARENA *a;
+  BTCACHE *p;
+  dt_count_t want = (dt_count_t)((size + CACHE_BLOCK_SIZE - 1) /
+                                 CACHE_BLOCK_SIZE) * CACHE_BLOCK_UNITS;
+
+  if( want < m_arena_units && !m_cache_used ) CacheRelease();
+  if( want <= m_arena_units ) return;
+
+  a = new BTARENA;
+#ifndef WINDOWS
+  if( !a ) return;
+#endif
+  a->ba_units = want - m_arena_units;
+  a->ba_buf = ArenaAlloc((size_t)a->ba_units * CACHE_UNIT);
+  a->ba_hdr = new BTCACHE[a->ba_units];
+#ifndef WINDOWS
+  if( !a->ba_buf || !a->ba_hdr ){
+    if( a->ba_buf ) ArenaFree(a->ba_buf);
+    if( a->ba_hdr ) delete []a->ba_hdr;
+    delete a;
+    CONSOLE.Warning(2, "warn, unable to reserve %lluKB of cache memory",
+      (unsigned long long)(size / 1024));
+    return;
+  }
+#endif
+  for( dt_count_t i = 0; i < a->ba_units; i++ ){
+    p = &a->ba_hdr[i];
+    p->bc_buf = a->ba_buf + (size_t)i * CACHE_UNIT;
+    p->bc_f_free = 0;
+  }
+  for( dt_count_t i = 0; i < a->ba_units; i += CACHE_BLOCK_UNITS )
+    ArenaLink(&a->ba_hdr[i], CACHE_ORDERS - 1);
+  a->ba_next = m_arena;
+  m_arena = a;
+  m_arena_units += a->ba_units;
+  m_arena_avail += a->ba_units;
+  if(*cfg_verbose) CONSOLE.Debug("Cache arena: %dK in units of %dK",
+    (int)(m_arena_units * (CACHE_UNIT / 1024)), (int)(CACHE_UNIT / 1024));
+}
+
+// Free all cache memory.  Any cache entries are discarded!
+void btContent::CacheRelease()
+{
+  BTCACHE *p, *pnext;
+  BTARENA *a;
+
+  for( p = m_policy ? m_policy->First() : (BTCACHE *)0; p; p = pnext ){
+    pnext = m_policy->Next(p);
+    m_policy->Remove(p, false);
+  }
+  if( m_cache ) memset(m_cache, 0, m_npieces * sizeof(BTCACHE *));
+  if( m_cache_slot ){
+    for( bt_index_t i = 0; i < m_npieces; i++ ){
+      if( m_cache_slot[i] ){
+        delete []m_cache_slot[i];
+        m_cache_slot[i] = (BTCACHE **)0;
+      }
+    }
+  }
+  m_cache_used = 0;
+
+  while( (a = m_arena) ){
+    m_arena = a->ba_next;
+    ArenaFree(a->ba_buf);
+    delete []a->ba_hdr;
+    delete a;
+  }
+  for( int k = 0; k < CACHE_ORDERS; k++ ) m_arena_free[k] = (BTCACHE *)0;
+  m_arena_units = m_arena_avail = 0;
+}
+
+/* The arena is divided by halves (a buddy system): each free area of
+   CACHE_UNIT << order bytes is on the free list for its order, and when
+   both halves of an area are free they are joined again. */
+void btContent::ArenaLink(BTCACHE *p, int order)
+{
+  p->bc_order = order;
+  p->bc_f_free = 1;
+  p->bc_prev = (BTCACHE *)0;
+  if( (p->bc_next = m_arena_free[order]) ) p->bc_next->bc_prev = p;
+  m_arena_free[order] = p;
+}
+
+void btContent::ArenaUnlink(BTCACHE *p)
+{
+  if( p->bc_prev ) p->bc_prev->bc_next = p->bc_next;
+  else m_arena_free[p->bc_order] = p->bc_next;
+  if( p->bc_next ) p->bc_next->bc_prev = p->bc_prev;
+  p->bc_f_free = 0;
+}
+
+/* Get a cache entry with a buffer of at least len bytes (at most
+   CACHE_BLOCK_SIZE) from the arena.  If there is no room, data that can be
+   discarded is expired, avoiding piece idx.  Returns NULL if that fails. */
+BTCACHE *btContent::CacheAlloc(bt_length_t len, bt_index_t idx)
+{
+  BTCACHE *p;
+  int order, k;
+
+  for( order = 0; order < CACHE_ORDERS - 1 &&
+                  ((bt_length_t)CACHE_UNIT << order) < len; order++ );
+  for(;;){
+    for( k = order; k < CACHE_ORDERS && !m_arena_free[k]; k++ );
+    if( k < CACHE_ORDERS ) break;
+    for( p = m_policy->First(); p; p = m_policy->Next(p) ){
+      if( !p->bc_f_flush && !p->bc_f_load &&
+          p->bc_off / m_piece_length != idx )
+        break;
+    }
+    if( !p ) return (BTCACHE *)0;
+    CacheExpire(p);
+  }
+
+  p = m_arena_free[k];
+  ArenaUnlink(p);
+  while( k > order ){  // keep the first half, free the second
+    k--;
+    ArenaLink(p + (1 << k), k);
+  }
+  p->bc_order = order;
+  m_arena_avail -= 1 << order;
+  return p;
+}
+
+void btContent::CacheFree(BTCACHE *p)
+{
+  BTARENA *a;
+  BTCACHE *q;
+  dt_count_t i;
+  int k = p->bc_order;
+
+  for( a = m_arena; p < a->ba_hdr || p >= a->ba_hdr + a->ba_units;
+       a = a->ba_next );
+  m_arena_avail += 1 << k;
+  for( i = p - a->ba_hdr; k < CACHE_ORDERS - 1; k++ ){
+    q = a->ba_hdr + (i ^ (1 << k));
+    if( !q->bc_f_free || q->bc_order != k ) break;
+    ArenaUnlink(q);
+    i &= ~(dt_count_t)(1 << k);
+  }
+  ArenaLink(a->ba_hdr + i, k);
+}
+
+/* Perform file I/O, handling failures.
+   Method (read/write) is determined by which buffer is given. */
+inline int btContent::FileIO(char *rbuf, const char *wbuf, dt_datalen_t off,
+  bt_length_t len)
+{
+  return ( m_btfiles.IO(rbuf, wbuf, off, len) < 0 ) ?
+             (wbuf ? WriteFail() : -1) : 0;
+}
+
+inline int btContent::ReadPiece(char *buf, bt_index_t idx)
+{
+  return ReadSlice(buf, idx, 0, GetPieceLength(idx));
+}
+
+bt_length_t btContent::GetPieceLength(bt_index_t idx) const
+{
+  /* Slight optimization to avoid division in every call.  The second test is
+     still needed in case the torrent size is exactly n pieces. */
   return (idx == m_npieces - 1 &&
           idx == m_btfiles.GetTotalLength() / m_piece_length) ?
     (bt_length_t)(m_btfiles.GetTotalLength() % m_piece_length) :
     m_piece_length;
 }
 
-int btContent::CheckExist()
+/* A hash check of one or more pieces, run by a worker thread.  Each job has
+   its own buffer, so several can run at once; idle jobs are kept for reuse.
+   Pieces are hashed as a batch when a multi-buffer SHA-1 is available. */
+class btCheckJob: public WorkJob
 {
-  bt_index_t idx = 0;
-  bt_index_t percent = GetNPieces() / 100;
-  unsigned char md[20];
+ public:
+  bt_index_t idx[MAX_HASH_BATCH];
+  int count;
+  bool running;          // checking while up and running (not CheckExist)
+  bool scrub;            // re-verifying pieces already had
+  int result;
+  char *buf;
+  unsigned char md[MAX_HASH_BATCH * 20];
+  btCheckJob *next;      // idle list
+
+  btCheckJob(){ buf = (char *)0; next = (btCheckJob *)0; }
+  ~btCheckJob(){ if( buf ) delete []buf; }
+
+  void Run(){ result = BTCONTENT.HashPieces(idx, count, buf, md); }
+  void Done(){ BTCONTENT.CheckResult(this); }
+};
+
+// Number of pieces to hash together, limited by buffer memory.
+int btContent::HashBatchSize() const
+{
+  int n = Sha1BatchSize();
 
-  if( !percent ) percent = 1;
+  if( n > MAX_HASH_BATCH ) n = MAX_HASH_BATCH;
+  while( n > 1 && (dt_mem_t)n * m_piece_length > HASH_BATCH_MEM ) n--;
+  return n;
+}
 
-  CONSOLE.Interact_n();
-  for( ; idx < m_npieces; idx++ ){
-    if( m_btfiles.pBFPieces->IsSet(idx) ){
-      if( GetHashValue(idx, md) < 0 ){
-        CONSOLE.Warning(1, "Error while checking piece %d of %d",
-          (int)idx+1, (int)m_npieces);
-        return -1;
-      }
-      if( memcmp(md, m_hash_table + idx * 20, 20) == 0 ){
-         m_left_bytes -= GetPieceLength(idx);
-         pBF->Set(idx);
-      }
+/* Read pieces directly from the files (bypassing the cache) into consecutive
+   piece-length areas of buf, and hash them into md.
+   This may be called from a worker thread. */
+int btContent::HashPieces(const bt_index_t *idx, int n, char *buf,
+  unsigned char *md)
+{
+  const char *data[MAX_HASH_BATCH];
+  size_t len[MAX_HASH_BATCH];
+
+  for( int i=0; i < n; i++ ){
+    data[i] = buf + (size_t)i * m_piece_length;
+    len[i] = GetPieceLength(idx[i]);
+    if( m_btfiles.IO(buf + (size_t)i * m_piece_length, NULL,
+                     (dt_datalen_t)idx[i] * m_piece_length, len[i]) < 0 )
+      return -1;
+  }
+  Sha1Batch(n, data, len, md);
+  return 0;
+}
+
+int btContent::CheckSubmit(const bt_index_t *idx, int n, bool running,
+  bool scrub)
+{
+  btCheckJob *job;
+
+  if( (job = m_check_jobs) ) m_check_jobs = job->next;
+  else{
+    job = new btCheckJob;
+#ifndef WINDOWS
+    if( !job ) return -1;
+#endif
+    job->buf = new char[(size_t)m_check_batch * m_piece_length];
+#ifndef WINDOWS
+    if( !job->buf ){
+      delete job;
+      return -1;
     }
-    if( idx % percent == 0 || idx == m_npieces-1 )
-      CONSOLE.InteractU("Check exist: %d/%d", idx+1, m_npieces);
+#endif
   }
-  m_check_piece = m_npieces;
-  pBChecked->SetAll();
+  memcpy(job->idx, idx, n * sizeof(bt_index_t));
+  job->count = n;
+  job->running = running;
+  job->scrub = scrub;
+  if( scrub ) m_scrub_inflight++;
+  else m_check_inflight++;
+  WORKERS.Submit(job);
   return 0;
 }
 
-int btContent::CheckNextPiece()
+void btContent::CheckResult(btCheckJob *job)
 {
-  bt_index_t idx = m_check_piece;
-  unsigned char md[20];
-  int f_checkint = 0;
-
-  if( idx >= m_npieces ) return 0;
-  if( pBChecked->IsSet(idx) ){
-    while( idx < m_npieces && pBChecked->IsSet(idx) ){
-      if(*cfg_verbose) CONSOLE.Debug("Check: %u skipped", idx);
-      pBChecked->Set(idx);
-      ++idx;
-    }
-    f_checkint = 1;
-    m_check_piece = idx;
-  }
-  if( idx < m_npieces ){
-    // Don't use the cache for this (looks a bit ugly but helps performance).
-    dt_mem_t tmp_cache_size = m_cache_size;
-    m_cache_size = 0;
-    int r = GetHashValue(idx, md);
-    m_cache_size = tmp_cache_size;
-    if( r < 0 ) return -1;
+  bt_index_t idx;
 
+  m_btfiles.Report();
+  if( job->scrub ){
+    ScrubResult(job);
+    return;
+  }
+  m_check_inflight--;
+  if( m_creating ){
+    if( job->result < 0 ) m_check_failed = 1;
+    else memcpy(m_hash_table + job->idx[0] * 20, job->md, job->count * 20);
+  }else if( job->result < 0 ){
+    // Leave them unchecked so that they will be tried again.
+    if( !job->running ){
+      CONSOLE.Warning(1, "Error while checking piece %d of %d",
+        (int)job->idx[0]+1, (int)m_npieces);
+    }
+    m_check_failed = 1;
+    if( job->idx[0] < m_check_next ) m_check_next = job->idx[0];
+  }else for( int i=0; i < job->count; i++ ){
+    idx = job->idx[i];
     pBChecked->Set(idx);  // need to set before CheckInterest below
-    if( memcmp(md, m_hash_table + idx * 20, 20) == 0 ){
-      if(*cfg_verbose) CONSOLE.Debug("Check: %u ok", idx);
+    if( memcmp(job->md + i * 20, m_hash_table + idx * 20, 20) == 0 ){
+      if( job->running && *cfg_verbose ) CONSOLE.Debug("Check: %u ok", idx);
       m_left_bytes -= GetPieceLength(idx);
       pBF->Set(idx);
-      WORLD.Tell_World_I_Have(idx);
-      CheckFilter();
-    }else{
+      pBLost->UnSet(idx);
+      PartialReset(idx);
+      if( job->running ){
+        WORLD.Tell_World_I_Have(idx);
+        CheckFilter();
+      }
+    }else if( job->running ){
       if(*cfg_verbose) CONSOLE.Debug("Check: %u failed", idx);
-      f_checkint = 1;
+      WORLD.CheckInterest();
     }
-    m_check_piece = idx + 1;
   }
-  if( f_checkint ) WORLD.CheckInterest();
+
+  job->next = m_check_jobs;
+  m_check_jobs = job;
+  if( job->running ) CheckAdvance();
+}
+
+// Free the idle check jobs.
+void btContent::CheckRelease()
+{
+  btCheckJob *job;
+
+  while( (job = m_check_jobs) ){
+    m_check_jobs = job->next;
+    delete job;
+  }
+}
+
+// Move past the pieces that have been checked, and finish up if done.
+void btContent::CheckAdvance()
+{
+  bt_index_t idx = m_check_piece;
+
+  while( idx < m_npieces && pBChecked->IsSet(idx) ) ++idx;
+  if( idx == m_check_piece ) return;
+  m_check_piece = idx;
 
   if( m_check_piece >= m_npieces ){
+    CheckRelease();
     CONSOLE.Print("Checking completed.");
     if( !pBF->IsEmpty() )
       m_btfiles.PrintOut(true);  // show file completion
     if( pBF->IsFull() ){
       WORLD.CloseAllConnectionToSeed();
+      if( !NeedMerge() ) CloseAllFiles();
+    }
+  }
+}
+
+bool btContent::Scrubbing() const
+{
+  return *cfg_scrub_rate && m_hash_table && m_check_piece >= m_npieces &&
+    Seeding() && !m_flush_failed;
+}
+
+/* Re-verify the pieces already on disk, cycling through them in the
+   background to catch data that has gone bad since it was checked.  Reading
+   is limited to the configured scrub rate.  Pieces in the cache are passed
+   over, since they are being served from memory (and may not be flushed yet);
+   they will be covered on a later pass.
+   Returns the number of jobs started, or -1 on error. */
+int btContent::ScrubNext()
+{
+  bt_index_t idx, i, batch[MAX_HASH_BATCH];
+  dt_datalen_t bytes;
+  double rightnow = PreciseTime();
+  int n, jobs = 0;
+
+  if( rightnow >= m_scrub_mark + 5 || rightnow < m_scrub_mark ){
+    if( m_scrub_mark > 0 && rightnow > m_scrub_mark ){
+      m_scrub_rate = (dt_rate_t)((m_scrub_bytes - m_scrub_mark_bytes) /
+                                 (rightnow - m_scrub_mark));
+    }
+    m_scrub_mark = rightnow;
+    m_scrub_mark_bytes = m_scrub_bytes;
+  }
+  if( !Scrubbing() ){
+    m_scrub_rate = 0;
+    return 0;
+  }
+
+  if( !m_check_batch ) m_check_batch = HashBatchSize();
+  // Don't save up more than a second of budget while idle.
+  if( m_scrub_due < rightnow - 1 ) m_scrub_due = rightnow - 1;
+  while( m_scrub_due <= rightnow && m_scrub_inflight < CHECK_WINDOW ){
+    n = 0;
+    bytes = 0;
+    for( i = 0; i < m_npieces && n < m_check_batch; i++ ){
+      idx = m_scrub_next++;
+      if( m_scrub_next >= m_npieces ){
+        m_scrub_next = 0;
+        m_scrub_passes++;
+      }
+      if( pBF->IsSet(idx) && !m_cache[idx] ){
+        batch[n++] = idx;
+        bytes += GetPieceLength(idx);
+      }
     }
+    if( !n ){  // everything is cached; try again later
+      m_scrub_due = rightnow + 1;
+      break;
+    }
+    if( CheckSubmit(batch, n, true, true) < 0 ){
+      errno = ENOMEM;
+      return -1;
+    }
+    jobs++;
+    m_scrub_due += (double)bytes / ((double)*cfg_scrub_rate * 1024 * 1024);
   }
+  return jobs;
+}
+
+void btContent::ScrubResult(btCheckJob *job)
+{
+  bt_index_t idx;
+  bt_length_t len;
+  bool wasfull = IsFull();
+
+  m_scrub_inflight--;
+  if( job->result < 0 ){
+    CONSOLE.Warning(2, "warn, error reading piece %d for scrubbing.",
+      (int)job->idx[0]);
+  }else for( int i=0; i < job->count; i++ ){
+    idx = job->idx[i];
+    len = GetPieceLength(idx);
+    m_scrub_pieces++;
+    m_scrub_bytes += len;
+    // It may have been cached meanwhile, but the disk copy is what was read.
+    if( !pBF->IsSet(idx) ||
+        memcmp(job->md + i * 20, m_hash_table + idx * 20, 20) == 0 )
+      continue;
+    CONSOLE.Warning(2, "warn, scrub check of piece %d failed.",
+      (int)idx);
+    m_scrub_failures++;
+    pBF->UnSet(idx);
+    pBLost->Set(idx);
+    Uncache(idx);
+    m_left_bytes += len;
+    WORLD.CheckInterest();
+  }
+  // Connections to seeds were closed when we became one; find them again.
+  if( wasfull && !IsFull() ) TRACKER.Update();
+
+  job->next = m_check_jobs;
+  m_check_jobs = job;
+}
+
+/* Pieces that lie entirely within holes in sparse files contain only zeros,
+   so unless that is their expected content they are known to be missing and
+   need not be read. */
+void btContent::SkipHoles()
+{
+  Bitfield holes(m_npieces);
+  unsigned char zero[2][20];
+  bt_length_t len, zerolen[2] = { 0, 0 };
+  bt_index_t idx, n = 0;
+  int i;
+
+  if( !m_btfiles.FindHoles(&holes, m_piece_length) ) return;
+
+  for( idx = 0; idx < m_npieces; idx++ ){
+    if( !holes.IsSet(idx) || !m_btfiles.pBFPieces->IsSet(idx) ) continue;
+    len = GetPieceLength(idx);
+    i = (len == m_piece_length) ? 0 : 1;
+    if( zerolen[i] != len ){  // hash of a piece of zeros
+      dt_sha1_t ctx;
+      bt_length_t remain, chunk;
+      memset(global_piece_buffer, 0, global_buffer_size);
+      Sha1Init(&ctx);
+      for( remain = len; remain; remain -= chunk ){
+        chunk = (remain < global_buffer_size) ? remain : global_buffer_size;
+        Sha1Update(&ctx, global_piece_buffer, chunk);
+      }
+      Sha1Final(&ctx, zero[i]);
+      zerolen[i] = len;
+    }
+    if( memcmp(zero[i], m_hash_table + idx * 20, 20) != 0 ){
+      m_btfiles.pBFPieces->UnSet(idx);
+      n++;
+    }
+  }
+  if(*cfg_verbose) CONSOLE.Debug("Skipping %d pieces in file holes", (int)n);
+}
+
+int btContent::CheckExist()
+{
+  bt_index_t idx = 0, batch[MAX_HASH_BATCH];
+  bt_index_t percent = GetNPieces() / 100;
+  int n = 0;
+
+  if( !percent ) percent = 1;
+  m_check_batch = HashBatchSize();
+
+  CONSOLE.Interact_n();
+  for( ; idx < m_npieces && !m_check_failed; idx++ ){
+    if( m_btfiles.pBFPieces->IsSet(idx) ) batch[n++] = idx;
+    if( n && (n == m_check_batch || idx == m_npieces-1) ){
+      while( m_check_inflight >= CHECK_WINDOW ) WORKERS.WaitOne();
+      if( CheckSubmit(batch, n, false) < 0 ){
+        CONSOLE.Warning(1, "error, failed to allocate memory for checking");
+        m_check_failed = 1;
+        break;
+      }
+      n = 0;
+    }
+    if( idx % percent == 0 || idx == m_npieces-1 )
+      CONSOLE.InteractU("Check exist: %d/%d", idx+1, m_npieces);
+  }
+  while( m_check_inflight ) WORKERS.WaitOne();
+  CheckRelease();
+  if( m_check_failed ) return -1;
+
+  m_check_piece = m_npieces;
+  pBChecked->SetAll();
   return 0;
 }
 
+/* Keep hash checks going in the background.  Results are applied as they
+   arrive, via CheckResult.
+   Returns the number of check jobs started, or -1 on error. */
+int btContent::CheckNextPiece()
+{
+  bt_index_t idx, batch[MAX_HASH_BATCH], jobs = 0;
+  int n, f_checkint = 0;
+
+  if( m_check_piece >= m_npieces && !m_check_failed ) return 0;
+
+  if( !m_check_batch ) m_check_batch = HashBatchSize();
+  if( m_check_next < m_check_piece ) m_check_next = m_check_piece;
+  while( m_check_next < m_npieces && m_check_inflight < CHECK_WINDOW &&
+         jobs < CHECK_WINDOW ){
+    for( n = 0; n < m_check_batch && m_check_next < m_npieces; ){
+      idx = m_check_next++;  // a failed check may move this back
+      if( pBChecked->IsSet(idx) ){
+        if(*cfg_verbose) CONSOLE.Debug("Check: %u skipped", idx);
+        f_checkint = 1;
+      }else batch[n++] = idx;
+    }
+    if( n ){
+      if( CheckSubmit(batch, n, true) < 0 ){
+        errno = ENOMEM;
+        return -1;
+      }
+      jobs++;
+    }
+  }
+
+  if( f_checkint ) WORLD.CheckInterest();
+  CheckAdvance();
+
+  if( m_check_failed ){
+    m_check_failed = 0;
+    return -1;
+  }
+  return (int)jobs;
+}
+
 char *btContent::_file2mem(const char *fname, size_t *psiz)
 {
   char *b = (char *)0;
@@ -1231,43 +2415,188 @@ char *btContent::_file2mem(const char *fname, size_t *psiz)
   return b;
 }
 
-int btContent::APieceComplete(bt_index_t idx)
+typedef struct _btgap{
+  bt_offset_t off;
+  bt_length_t len;
+}BTGAP;
+
+class btVerifyJob: public WorkJob
 {
+ public:
+  bt_index_t idx;
+  btPeer *peer;          // peer that reported the piece complete
+  dt_count_t serial;     // its serial number, in case it goes away
+  bool single;           // the entire piece came from that peer
+  BTHASH *hash;          // in-order hash so far
+  char *buf;             // the rest of the piece, from the cache
+  BTGAP *gaps;           // parts of the rest that must be read from disk
+  int ngaps;
+  int result;
   unsigned char md[20];
-  if( pBF->IsSet(idx) ) return 1;
-  if( GetHashValue(idx, md) < 0 ){
-    // error reading data
-    Uncache(idx);
-    return -1;
-  }
 
-  if( memcmp(md, (m_hash_table + idx * 20), 20) != 0 ){
-    CONSOLE.Warning(3, "warn, piece %d hash check failed.", idx);
-    Uncache(idx);
-    CountHashFailure();
-    return 0;
+  btVerifyJob(){
+    hash = (BTHASH *)0;
+    buf = (char *)0;
+    gaps = (BTGAP *)0;
+  }
+  ~btVerifyJob(){
+    if( hash ) delete hash;
+    if( buf ) delete []buf;
+    if( gaps ) delete []gaps;
   }
 
-  pBF->Set(idx);
-  m_left_bytes -= GetPieceLength(idx);
-  TRACKER.CountDL(GetPieceLength(idx));
+  void Run(){ result = BTCONTENT.VerifyPiece(this); }
+  void Done(){ BTCONTENT.VerifyResult(this); }
+};
 
-  // Add the completed piece to the flush queue.
-  if( *cfg_cache_size ){
-    BTFLUSH *last = m_flushq;
-    BTFLUSH *node = new BTFLUSH;
-    if( !node ) FlushPiece(idx);
-    else{
-      node->idx = idx;
-      node->next = (BTFLUSH *)0;
-      if( last ){
-        for( ; last->next; last = last->next);
-        last->next = node;
-      }else m_flushq = node;
+/* Verify a piece that has been completely received.  The hash is finished on
+   a worker thread; the data not yet hashed is copied from the cache here, and
+   anything that has already been flushed is read by the worker.  Until the
+   result is reported, the piece is marked in pBVerify and will not be written
+   or requested again.
+   Returns 1 if the piece is complete or being verified, -1 on error. */
+int btContent::APieceComplete(bt_index_t idx, btPeer *peer)
+{
+  btVerifyJob *job;
+  BTHASH *h;
+  BTCACHE *p;
+  dt_datalen_t base = (dt_datalen_t)idx * m_piece_length;
+  bt_offset_t off, start, end;
+  bt_length_t piecelen = GetPieceLength(idx);
+  int n = 0;
+
+  if( pBF->IsSet(idx) || pBVerify->IsSet(idx) ) return 1;
+
+  job = new btVerifyJob;
+#ifndef WINDOWS
+  if( !job ) goto err;
+#endif
+  job->idx = idx;
+  job->peer = peer;
+  job->serial = peer ? peer->GetSerial() : 0;
+  job->single = !pBMultPeer->IsSet(idx);
+
+  if( m_piece_hash && (h = m_piece_hash[idx]) ) m_piece_hash[idx] = (BTHASH *)0;
+  else{
+    h = new BTHASH;
+#ifndef WINDOWS
+    if( !h ) goto err;
+#endif
+    h->bh_len = 0;
+    Sha1Init(&h->bh_ctx);
+  }
+  job->hash = h;
+
+  if( h->bh_len < piecelen ){
+    LoadWait(idx);
+    for( p = m_cache[idx]; p; p = p->bc_next ) n++;
+    job->buf = new char[piecelen - h->bh_len];
+    job->gaps = new BTGAP[n + 1];
+#ifndef WINDOWS
+    if( !job->buf || !job->gaps ) goto err;
+#endif
+    n = 0;
+    off = h->bh_len;
+    for( p = m_cache[idx]; p; p = p->bc_next ){
+      start = p->bc_off - base;
+      end = start + p->bc_len;
+      if( end <= off ) continue;
+      if( start > off ){
+        job->gaps[n].off = off;
+        job->gaps[n++].len = start - off;
+        off = start;
+      }
+      memcpy(job->buf + (off - h->bh_len), p->bc_buf + (off - start),
+        end - off);
+      off = end;
+    }
+    if( off < piecelen ){
+      job->gaps[n].off = off;
+      job->gaps[n++].len = piecelen - off;
     }
   }
+  job->ngaps = n;
 
+  pBVerify->Set(idx);
+  WORKERS.Submit(job);
   return 1;
+
+ err:
+  CONSOLE.Warning(1, "error, failed to allocate memory for verification");
+  if( job ) delete job;
+  Uncache(idx);
+  return -1;
+}
+
+// Finish the hash of a completed piece.  Called from a worker thread.
+int btContent::VerifyPiece(btVerifyJob *job)
+{
+  BTHASH *h = job->hash;
+  dt_datalen_t base = (dt_datalen_t)job->idx * m_piece_length;
+
+  for( int i=0; i < job->ngaps; i++ ){
+    if( m_btfiles.IO(job->buf + (job->gaps[i].off - h->bh_len), NULL,
+                     base + job->gaps[i].off, job->gaps[i].len) < 0 )
+      return -1;
+  }
+  if( job->buf )
+    Sha1Update(&h->bh_ctx, job->buf, GetPieceLength(job->idx) - h->bh_len);
+  Sha1Final(&h->bh_ctx, job->md);
+  return 0;
+}
+
+void btContent::VerifyResult(btVerifyJob *job)
+{
+  bt_index_t idx = job->idx;
+  btPeer *peer = job->peer;
+
+  m_btfiles.Report();
+  pBVerify->UnSet(idx);
+  // The peer may have gone away while the piece was being verified.
+  if( peer && !WORLD.IsPeer(peer, job->serial) ) peer = (btPeer *)0;
+
+  if( job->result < 0 ){
+    CONSOLE.Warning(2, "warn, error reading piece %d for verification.", idx);
+    Uncache(idx);
+    WORLD.CheckInterest();
+  }else if( memcmp(job->md, (m_hash_table + idx * 20), 20) != 0 ){
+    CONSOLE.Warning(3, "warn, piece %d hash check failed.", idx);
+    Uncache(idx);
+    CountHashFailure();
+    /* Don't count an error against the peer in initial or endgame mode, since
+       some slices may have come from other peers. */
+    if( peer && job->single ) peer->PieceVerified(idx, false);
+    WORLD.CheckInterest();
+  }else{
+    pBF->Set(idx);
+    pBLost->UnSet(idx);  // good again; requests for it are valid
+    PartialReset(idx);
+    m_left_bytes -= GetPieceLength(idx);
+    TRACKER.CountDL(GetPieceLength(idx));
+
+    // Add the completed piece to the flush queue.
+    if( *cfg_cache_size ){
+      BTFLUSH *last = m_flushq;
+      BTFLUSH *node = new BTFLUSH;
+      if( !node ) FlushPiece(idx);
+      else{
+        node->idx = idx;
+        node->next = (BTFLUSH *)0;
+        if( last ){
+          for( ; last->next; last = last->next);
+          last->next = node;
+        }else m_flushq = node;
+      }
+    }
+
+    if(*cfg_verbose) CONSOLE.Debug("Piece #%d completed", (int)idx);
+    if( peer ) peer->PieceVerified(idx, true);
+    WORLD.Tell_World_I_Have(idx);
+    CheckFilter();
+    if( IsFull() )
+      WORLD.CloseAllConnectionToSeed();
+  }
+  delete job;
 }
 
 int btContent::GetHashValue(bt_index_t idx, unsigned char *md)
@@ -1292,7 +2621,10 @@ int btContent::SeedTimeout()
       (!*cfg_completion_exit || (!m_flushq && !NeedMerge())) ){
     if( !m_seed_timestamp ){
       if( IsFull() ){
-        ReleaseHashTable();
+        if( !*cfg_scrub_rate ){  // still needed for scrubbing
+          ReleaseHashTable();
+          cfg_scrub_rate.Hide();
+        }
         cfg_file_to_download.Hide();
       }
       Self.ResetDLTimer();  // set/report dl rate = 0
@@ -1445,14 +2777,7 @@ void btContent::CompletionCommand()
       strerror(errno));
   }else if( r==0 ){
     g_secondary_process = true;
-    if( m_cache_used ){  // free the cache in the child process
-      BTCACHE *p, *pnext;
-      for( p=m_cache_oldest; p; p=pnext ){
-        pnext = p->age_next;
-        delete []p->bc_buf;
-        delete p;
-      }
-    }
+    CacheRelease();  // free the cache in the child process
     WORLD.CloseAll();  // deallocate peers
 #endif
     if( system(cmdstr) < 0 )
@@ -1667,19 +2992,172 @@ int btContent::Seeding() const
 // Note, this function assumes the program is exiting.
 void btContent::SaveBitfield()
 {
-  if( *cfg_bitfield_file ){
-    if( m_check_piece < m_npieces ){  // still checking
-      // Anything unchecked needs to be checked next time.
-      pBChecked->Invert();
-      pBF->Or(*pBChecked);
+  if( *cfg_bitfield_file && SaveResume(*cfg_bitfield_file) < 0 ){
+    CONSOLE.Warning(1, "error writing bitfield file %s:  %s",
+      *cfg_bitfield_file, strerror(errno));
+  }
+}
+
+/* The resume file records the verified pieces along with the state of each
+   file, so that only pieces in files that have changed since need to be
+   checked on restart.  Pieces that were not yet checked, or were being
+   verified, are saved separately and will be checked. */
+int btContent::SaveResume(const char *fname)
+{
+  FILE *fp;
+  char *bitbuf;
+  Bitfield unchecked(m_npieces), have(m_npieces);
+
+  if( !pBF ) return 0;
+  if( m_check_piece < m_npieces ){  // still checking
+    unchecked = *pBChecked;
+    unchecked.Invert();
+  }
+  unchecked.Or(pBVerify);
+
+  // Pieces with data still in the cache (unwritten, or the write failed) are
+  // not on disk, so they aren't claimed.
+  have = *pBF;
+  for( bt_index_t idx = 0; m_cache && idx < m_npieces; idx++ ){
+    if( !pBF->IsSet(idx) ) continue;
+    for( BTCACHE *p = m_cache[idx]; p; p = p->bc_next ){
+      if( p->bc_f_flush ){
+        have.UnSet(idx);
+        break;
+      }
     }
-    if( !pBF->IsFull() ){
-      if( pBF->WriteToFile(*cfg_bitfield_file) < 0 ){
-        CONSOLE.Warning(1, "error writing bitfield file %s:  %s",
-          *cfg_bitfield_file, strerror(errno));
+  }
+
+  if( !(bitbuf = new char[pBF->NBytes()]) ){
+    errno = ENOMEM;
+    return -1;
+  }
+  if( !(fp = fopen(fname, "w")) ){
+    delete []bitbuf;
+    return -1;
+  }
+
+  // Entries in dictionary must be sorted by key!
+  if( bencode_begin_dict(fp) != 1 ) goto err;
+
+  have.WriteToBuffer(bitbuf);
+  if( bencode_str("bitfield", fp) != 1 ) goto err;
+  if( bencode_buf(bitbuf, pBF->NBytes(), fp) != 1 ) goto err;
+
+  if( m_btfiles.FillResume(fp) != 1 ) goto err;
+
+  if( bencode_str("info hash", fp) != 1 ) goto err;
+  if( bencode_buf((const char *)GetInfoHash(), 20, fp) != 1 ) goto err;
+
+  if( bencode_str("partial", fp) != 1 ) goto err;
+  if( bencode_begin_list(fp) != 1 ) goto err;
+  for( bt_index_t idx = 0; m_partial && idx < m_npieces; idx++ ){
+    if( !m_partial[idx] || pBF->IsSet(idx) || unchecked.IsSet(idx) ) continue;
+    // Data that is still in the cache did not reach the disk.
+    for( BTCACHE *p = m_cache ? m_cache[idx] : (BTCACHE *)0; p;
+         p = p->bc_next ){
+      if( p->bc_f_flush ) PartialClear(idx, p->bc_off -
+        (dt_datalen_t)idx * m_piece_length, p->bc_len);
+    }
+    if( bencode_int(idx, fp) != 1 ) goto err;
+    if( bencode_buf((const char *)m_partial[idx], PartialSize(idx), fp) != 1 )
+      goto err;
+  }
+  if( bencode_end_dict_list(fp) != 1 ) goto err;
+  if( bencode_str("partial unit", fp) != 1 ) goto err;
+  if( bencode_int(PARTIAL_UNIT, fp) != 1 ) goto err;
+
+  unchecked.WriteToBuffer(bitbuf);
+  if( bencode_str("unchecked", fp) != 1 ) goto err;
+  if( bencode_buf(bitbuf, pBF->NBytes(), fp) != 1 ) goto err;
+
+  if( bencode_end_dict_list(fp) != 1 ) goto err;
+
+  delete []bitbuf;
+  DiskAccess();
+  return fclose(fp) ? -1 : 0;
+ err:
+  delete []bitbuf;
+  fclose(fp);
+  DiskAccess();
+  return -1;
+}
+
+/* Read a resume file saved by SaveResume.  Verified pieces in unchanged files
+   are set in pBF; pieces to be checked are set in pBRefer.  When forcing seed
+   mode, the unchecked pieces of unchanged files are taken as verified too,
+   leaving only the pieces of changed files to be checked.
+   Returns -1 if the file is missing, in the old format, or doesn't match. */
+int btContent::LoadResume(const char *fname, bool force_seed)
+{
+  char *b;
+  const char *s;
+  size_t flen, bsiz, q;
+  int64_t bint;
+  bt_index_t idx;
+  int changed, partial = 0, result = -1;
+  struct stat sb;
+  Bitfield bfchanged(m_npieces), bftmp(m_npieces);
+
+  // A plain bitfield file is handled by the caller.
+  if( stat(fname, &sb) < 0 || sb.st_size == (off_t)bftmp.NBytes() ) return -1;
+  if( !(b = _file2mem(fname, &flen)) ) return -1;
+
+  if( !meta_str("info hash", &s, &bsiz) || 20 != bsiz ||
+      memcmp(s, GetInfoHash(), 20) != 0 ){
+    goto done;
+  }
+  if( !(bsiz = meta_pos("files")) ||
+      !(q = decode_list(b + bsiz, flen - bsiz, (const char *)0)) ||
+      (changed = m_btfiles.CheckResume(b + bsiz, q, &bfchanged,
+                                       m_piece_length)) < 0 ){
+    goto done;
+  }
+
+  if( !meta_str("bitfield", &s, &bsiz) || bsiz != bftmp.NBytes() ) goto done;
+  bftmp.SetReferBuffer(s);
+  if( !meta_str("unchecked", &s, &bsiz) || bsiz != bftmp.NBytes() ) goto done;
+  pBRefer->SetReferBuffer(s);
+  if( force_seed ){
+    bftmp.Or(*pBRefer);
+    *pBRefer = bfchanged;
+  }else pBRefer->Or(bfchanged);
+  bftmp.Except(bfchanged);
+  bftmp.And(m_btfiles.pBFPieces);
+  *pBF = bftmp;
+  result = 0;
+
+  // Maps of data received for incomplete pieces
+  if( (bsiz = meta_pos("partial")) && meta_int("partial unit", &bint) &&
+      PARTIAL_UNIT == bint ){
+    const char *p = b + bsiz + 1;
+    size_t dl, slen;
+    q = flen - bsiz - 1;
+    for( ; q && 'e' != *p; p += dl, q -= dl ){
+      if( !(dl = buf_int(p, q, 'i', 'e', &bint)) ) break;
+      p += dl;
+      q -= dl;
+      if( !(dl = buf_str(p, q, &s, &slen)) ) break;
+      if( bint < 0 || (bt_index_t)bint >= m_npieces ) continue;
+      idx = (bt_index_t)bint;
+      if( pBF->IsSet(idx) || bfchanged.IsSet(idx) || slen != PartialSize(idx) ||
+          !PartialMap(idx) ){
+        continue;
       }
+      memcpy(m_partial[idx], s, slen);
+      partial++;
     }
   }
+
+  CONSOLE.Interact("Found resume file; %d file%s changed, %d pieces to check.",
+    changed, (changed == 1) ? "" : "s", (int)pBRefer->Count());
+  if( partial )
+    CONSOLE.Interact("Resuming %d partially downloaded piece%s.", partial,
+      (partial == 1) ? "" : "s");
+
+ done:
+  delete []b;
+  return result;
 }
 
 
@@ -1692,6 +3170,7 @@ void btContent::CountDupBlock(bt_length_t len)
 
 void btContent::CloseAllFiles()
 {
+  m_btfiles.SetWritable(false);
   for( dt_count_t n=1; n <= m_btfiles.GetNFiles(); n++ )
     m_btfiles.CloseFile(n);  // files will reopen read-only
 }
@@ -1721,21 +3200,21 @@ bt_index_t btContent::ChoosePiece(const Bitfield &choices,
 
 void btContent::DumpCache() const
 {
-  BTCACHE *p = m_cache_oldest;
+  BTCACHE *p = m_policy ? m_policy->First() : (BTCACHE *)0;
   int count;
 
-  CONSOLE.Debug("CACHE CONTENTS:");
+  CONSOLE.Debug("CACHE CONTENTS (%s order):",
+    m_policy ? m_policy->Name() : "no");
   count = 0;
-  for( ; p; p = p->age_next ){
-    CONSOLE.Debug("  %p prev=%p %d/%d/%d %sflushed",
+  for( ; p; p = m_policy->Next(p) ){
+    CONSOLE.Debug("  %p prev=%p %d/%d/%d %sflushed%s",
       p, p->age_prev,
       (int)(p->bc_off / m_piece_length), (int)(p->bc_off % m_piece_length),
       (int)p->bc_len,
-      p->bc_f_flush ? "un" : "");
+      p->bc_f_flush ? "un" : "", p->bc_f_hot ? " hot" : "");
     count++;
   }
   CONSOLE.Debug("  count=%d", count);
-  CONSOLE.Debug("  newest=%p", m_cache_newest);
 
   CONSOLE.Debug("BY PIECE:");
   count = 0;
@@ -10,21 +10,24 @@
 #include "bitfield.h"
 #include "btfiles.h"
 #include "tracker.h"
+#include "sha1.h"
+#include "cachepolicy.h"
 
-typedef struct _btcache{
-  dt_datalen_t bc_off;
-  bt_length_t bc_len;
+#define CACHE_ORDERS 3  // sizes of cache arena allocations, by halves
 
-  unsigned char bc_f_flush:1;
-  unsigned char bc_f_reserved:7;
+/* A chunk of cache memory: units of the smallest allocation size, each with
+   its own BTCACHE header.  An allocation uses the header of its first unit. */
+typedef struct _btarena{
+  char *ba_buf;
+  BTCACHE *ba_hdr;
+  dt_count_t ba_units;
+  struct _btarena *ba_next;
+}BTARENA;
 
-  char *bc_buf;
-
-  struct _btcache *bc_next;
-  struct _btcache *bc_prev;
-  struct _btcache *age_next;
-  struct _btcache *age_prev;
-}BTCACHE;
+typedef struct _bthash{
+  bt_length_t bh_len;  // length hashed so far, from the start of the piece
+  dt_sha1_t bh_ctx;
+}BTHASH;
 
 typedef struct _btflush{
   bt_index_t idx;
@@ -45,8 +48,19 @@ typedef struct _bfnode{
   }
 }BFNODE;
 
+class btCheckJob;
+class btVerifyJob;
+class btFlushJob;
+class btLoadJob;
+class btPeer;
+
 class btContent
 {
+  friend class btCheckJob;
+  friend class btVerifyJob;
+  friend class btFlushJob;
+  friend class btLoadJob;
+
  private:
   const char *m_metainfo_file;
   // torrent metainfo data
@@ -60,21 +74,45 @@ class btContent
   bt_index_t m_hashtable_length;
   bt_length_t m_piece_length;
   bt_index_t m_npieces, m_check_piece;
+  bt_index_t m_check_next, m_check_inflight;  // background hash checks
+  btCheckJob *m_check_jobs;                   // idle check jobs (with buffers)
+  int m_check_batch;                          // pieces per check job
+  bt_index_t m_scrub_next, m_scrub_inflight;  // background re-verification
+  dt_count_t m_scrub_pieces, m_scrub_failures, m_scrub_passes;
+  dt_datalen_t m_scrub_bytes, m_scrub_mark_bytes;
+  double m_scrub_due, m_scrub_mark;          // rate budget and measurement
+  dt_rate_t m_scrub_rate;
   time_t m_seed_timestamp, m_start_timestamp;
   dt_datalen_t m_left_bytes;
 
   btFiles m_btfiles;
 
   unsigned char m_flush_failed:1;
-  unsigned char m_reserved:7;
+  unsigned char m_check_failed:1;
+  unsigned char m_creating:1;  // hashing for a new torrent
+  unsigned char m_flush_draining:1;  // flush queue empty, writes pending
+  unsigned char m_reserved:4;
 
   time_t m_flush_tried;
 
-  BTCACHE **m_cache, *m_cache_oldest, *m_cache_newest;
+  BTCACHE **m_cache;
+  btCachePolicy *m_policy;  // decides what to expire
+  btCachePolicy *m_policies[DT_CACHE_NPOLICIES];  // each one used so far
+  BTCACHE ***m_cache_slot;  // per piece, first entry in each block
+  bt_length_t m_cache_nslots;
+  BTARENA *m_arena;
+  BTCACHE *m_arena_free[CACHE_ORDERS];  // free areas by size
+  dt_count_t m_arena_units, m_arena_avail;
   dt_mem_t m_cache_size, m_cache_used;
+  dt_mem_t m_cache_dirty, m_flush_writing;  // not on disk; being written
+  dt_count_t m_flush_inflight;              // flush jobs submitted
   dt_count_t m_cache_hit, m_cache_miss, m_cache_pre;
+  dt_count_t m_cache_lookups, m_cache_probes, m_cache_walks;
+  dt_count_t m_map_sent;  // slices sent from file mappings
   time_t m_cache_eval_time;
   BTFLUSH *m_flushq;
+  BTHASH **m_piece_hash;  // in-order hashes of pieces being received
+  unsigned char **m_partial;  // maps of data received for incomplete pieces
 
   BFNODE *m_filters, *m_current_filter;
 
@@ -84,6 +122,9 @@ class btContent
   time_t m_updated_remain;
 
   char *_file2mem(const char *fname, size_t *psiz);
+  int SaveResume(const char *fname);
+  void SkipHoles();
+  int LoadResume(const char *fname, bool force_seed);
 
   void ReleaseHashTable(){
     if( m_hash_table ){
@@ -93,9 +134,25 @@ class btContent
   }
 
   int CheckExist();
+  int CheckSubmit(const bt_index_t *idx, int n, bool running,
+    bool scrub=false);
+  void CheckResult(btCheckJob *job);
+  void ScrubResult(btCheckJob *job);
+  int VerifyPiece(btVerifyJob *job);
+  void VerifyResult(btVerifyJob *job);
+  void CheckAdvance();
+  void CheckRelease();
+  int HashBatchSize() const;
+  int HashPieces(const bt_index_t *idx, int n, char *buf, unsigned char *md);
   void CacheClean(bt_length_t need);
   void CacheClean(bt_length_t need, bt_index_t idx);
   void CacheEval();
+  void CountHit(bt_length_t len);
+  bool Mappable(bt_index_t idx) const;
+  void CountMiss(bt_length_t len);
+  BTCACHE *CacheFind(bt_index_t idx, dt_datalen_t off, bt_length_t len,
+    bool count=true);
+  void CacheExpire(BTCACHE *p);
   dt_datalen_t max_datalen(dt_datalen_t a, dt_datalen_t b){
     return (a > b) ? a : b;
   }
@@ -106,7 +163,25 @@ class btContent
   int CacheIO(char *rbuf, const char *wbuf, dt_datalen_t off, bt_length_t len,
     int method);
   int FileIO(char *rbuf, const char *wbuf, dt_datalen_t off, bt_length_t len);
-  void FlushEntry(BTCACHE *p);
+  void FlushResult(btFlushJob *job);
+  void FlushFinished();
+  BTCACHE *FlushFirst() const;
+  void FlushWait(bt_index_t idx);
+  void LoadResult(btLoadJob *job);
+  void LoadWait(bt_index_t idx);
+  void CacheReserve(dt_mem_t size);
+  void CacheRelease();
+  void ArenaLink(BTCACHE *p, int order);
+  void ArenaUnlink(BTCACHE *p);
+  BTCACHE *CacheAlloc(bt_length_t len, bt_index_t idx);
+  void CacheFree(BTCACHE *p);
+  void HashSlice(bt_index_t idx, bt_offset_t off, const char *buf,
+    bt_length_t len);
+  void HashReset(bt_index_t idx);
+  size_t PartialSize(bt_index_t idx) const;
+  unsigned char *PartialMap(bt_index_t idx);
+  void PartialSet(bt_index_t idx, bt_offset_t off, bt_length_t len);
+  void PartialClear(bt_index_t idx, bt_offset_t off, bt_length_t len);
   int WriteFail();
 
  public:
@@ -115,6 +190,8 @@ class btContent
   Bitfield *pBRefer;
   Bitfield *pBChecked;
   Bitfield *pBMultPeer;
+  Bitfield *pBVerify;
+  Bitfield *pBLost;  // announced, then found bad by scrubbing
   char *global_piece_buffer;
   bt_length_t global_buffer_size;
 
@@ -122,13 +199,18 @@ class btContent
   ~btContent();
 
   void CacheConfigure();
+  int SetCachePolicy();
   void FlushCache();
-  int FlushPiece(bt_index_t idx);
+  int FlushPiece(bt_index_t idx){ return FlushPieces(&idx, 1); }
+  int FlushPieces(const bt_index_t *pieces, bt_index_t npieces);
   void Uncache(bt_index_t idx);
   void FlushQueue();
+  dt_count_t FlushQueueLength() const;
   int NeedFlush() const;
   int FlushFailed() const { return m_flush_failed ? 1 : 0; }
+  bool FlushBehind() const;
   int NeedMerge() const { return m_btfiles.NeedMerge(); }
+  bool Merging() const { return m_btfiles.Merging(); }
   void MergeNext();
   void MergeAll(){ m_btfiles.MergeAll(); }
   bt_index_t ChoosePiece(const Bitfield &choices, const Bitfield &available,
@@ -142,6 +224,14 @@ class btContent
   int CheckNextPiece();
   bt_index_t CheckedPieces() const { return m_check_piece; }
 
+  int ScrubNext();
+  bool Scrubbing() const;
+  int ScrubProgress() const { return (int)(100 * m_scrub_next / m_npieces); }
+  dt_rate_t ScrubRate() const { return m_scrub_rate; }
+  dt_count_t ScrubbedPieces() const { return m_scrub_pieces; }
+  dt_count_t ScrubFailures() const { return m_scrub_failures; }
+  dt_count_t ScrubPasses() const { return m_scrub_passes; }
+
   const char *GetMetainfoFile() const { return m_metainfo_file; }
 
   const unsigned char *GetShakeBuffer() const { return m_shake_buffer; }
@@ -157,11 +247,14 @@ class btContent
   dt_datalen_t GetLeftBytes() const { return m_left_bytes; }
   dt_datalen_t GetNeedBytes() const;
 
-  int APieceComplete(bt_index_t idx);
+  int APieceComplete(bt_index_t idx, btPeer *peer);
+  bool PartialHas(bt_index_t idx, bt_offset_t off, bt_length_t len) const;
+  void PartialReset(bt_index_t idx);
   int GetHashValue(bt_index_t idx, unsigned char *md);
 
   bool CachePrep(bt_index_t idx);
   int ReadSlice(char *buf, bt_index_t idx, bt_offset_t off, bt_length_t len);
+  const char *MapSlice(bt_index_t idx, bt_offset_t off, bt_length_t len);
   int WriteSlice(const char *buf, bt_index_t idx, bt_offset_t off,
     bt_length_t len);
 
@@ -207,14 +300,39 @@ class btContent
   int Seeding() const;
 
   dt_count_t CacheHits() const { return m_cache_hit; }
+  dt_count_t CacheHits(int policy) const {
+    return m_policies[policy] ? m_policies[policy]->Hits() : 0;
+  }
   // "miss" does not count prefetch reads from disk
   dt_count_t CacheMiss() const { return m_cache_miss; }
+  dt_count_t CacheMiss(int policy) const {
+    return m_policies[policy] ? m_policies[policy]->Misses() : 0;
+  }
   // instead, "pre" does
   dt_count_t CachePre() const { return m_cache_pre; }
   dt_mem_t CacheSize() const { return m_cache_size; }
   dt_mem_t CacheUsed() const { return m_cache_used; }
+  dt_count_t CacheUnits() const { return m_arena_units; }
+  dt_count_t CacheUnitsFree() const { return m_arena_avail; }
+  // cache entries examined per lookup
+  double CacheProbes() const {
+    return m_cache_lookups ? (double)m_cache_probes / m_cache_lookups : 0;
+  }
+  // entries a walk of the piece's list would examine (counted when verbose)
+  double CacheWalks() const {
+    return m_cache_lookups ? (double)m_cache_walks / m_cache_lookups : 0;
+  }
+
+  dt_count_t MapSent() const { return m_map_sent; }
+  void UnmapAll(){ m_btfiles.UnmapAll(); }
+  void SetDirectIO(){ m_btfiles.SetDirect(*cfg_direct_io); }
+  void AdviseSlice(bt_index_t idx, bt_offset_t off, bt_length_t len,
+    dt_advice_t advice);
 
   void CloseAllFiles();
+  void CloseExcessFiles(){ m_btfiles.CloseExcess(); }
+  dt_count_t FileOpens() const { return m_btfiles.Opens(); }
+  dt_count_t FileCloses() const { return m_btfiles.Closes(); }
 
   void DumpCache() const;
 };
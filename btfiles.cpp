@@ -17,30 +17,329 @@
 #include <errno.h>
 #include <ctype.h>  // isprint
 
+#ifdef USE_MMAP
+#include <sys/mman.h>
+#endif
+
+#ifdef HAVE_LINUX_FS_H
+#include <sys/ioctl.h>
+#include <linux/fs.h>   // FICLONERANGE
+#endif
+
 #include "btconfig.h"
 #include "bencode.h"
 #include "btcontent.h"
 #include "console.h"
 #include "bttime.h"
 
-#if !defined(HAVE_SNPRINTF) || !defined(HAVE_FSEEKO)
+#if !defined(HAVE_SNPRINTF) || !defined(HAVE_VSNPRINTF) || \
+    !defined(HAVE_FSEEKO)
 #include "compat.h"
 #endif
 
-#define MAX_OPEN_FILES 20                // max simultaneous open data files
 #define OPT_IO_SIZE (256*1024)           // optimal I/O size for large ops
 #define MAX_STAGEFILE_SIZE (2*1024*1024) // [soft] size limit of a staging file
 #define MAX_STAGEDIR_FILES 200           // max staging files per directory
 #define WRITE_RETRY_INTERVAL 300     // seconds to retry after disk write error
+#define MAP_WINDOW (16*1024*1024)        // max size of one file mapping
+#define MAX_MAPPED_FILES 20              // max simultaneous file mappings
+#define MAX_WRITEV 64                    // buffers per vectored write
+#define MERGE_CHUNK (16*1024*1024)       // max data copied by one merge job
+
+#if defined(IOV_MAX) && IOV_MAX < MAX_WRITEV
+#undef MAX_WRITEV
+#define MAX_WRITEV IOV_MAX
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+// Without positional calls, the lock keeps each seek with its read or write.
+#if defined(HAVE_PREAD) && (defined(HAVE_PWRITEV) || defined(HAVE_PWRITE))
+#define UNLOCKED_IO
+#endif
+
+
+/* Positional read.  Without pread() the file lock keeps the seek and the
+   read together.  Returns the number of bytes read, short only at the end
+   of the file. */
+static ssize_t ReadAt(int fd, char *buf, size_t len, off_t pos)
+{
+  size_t done = 0;
+  ssize_t r;
+
+  while( done < len ){
+#ifdef HAVE_PREAD
+    r = pread(fd, buf + done, len - done, pos + done);
+#else
+    if( lseek(fd, pos + done, SEEK_SET) < 0 ) return -1;
+    r = read(fd, buf + done, len - done);
+#endif
+    if( r < 0 ){
+      if( EINTR == errno ) continue;
+      return -1;
+    }
+    if( r == 0 ) break;
+    done += r;
+  }
+  return done;
+}
+
+/* Positional scattering read; the vector is used up.  Returns the number of
+   bytes read, short only at the end of the file. */
+static ssize_t ReadVAt(int fd, struct iovec *iov, int iovcnt, off_t pos)
+{
+  size_t done = 0;
+  ssize_t r;
+
+  while( iovcnt ){
+    if( !iov->iov_len ){
+      iov++;
+      iovcnt--;
+      continue;
+    }
+#ifdef HAVE_PREADV
+    r = preadv(fd, iov, iovcnt, pos + done);
+#else
+    r = ReadAt(fd, (char *)iov->iov_base, iov->iov_len, pos + done);
+#endif
+    if( r < 0 ){
+      if( EINTR == errno ) continue;
+      return -1;
+    }
+    if( r == 0 ) break;
+    done += r;
+    for( ; iovcnt && (size_t)r >= iov->iov_len; iov++, iovcnt-- )
+      r -= iov->iov_len;
+    if( r ){
+      iov->iov_base = (char *)iov->iov_base + r;
+      iov->iov_len -= r;
+    }
+  }
+  return done;
+}
+
+// Positional gathering write of all the data; the vector is used up.
+static int WriteAt(int fd, struct iovec *iov, int iovcnt, off_t pos)
+{
+  ssize_t r;
+
+  while( iovcnt ){
+    if( !iov->iov_len ){
+      iov++;
+      iovcnt--;
+      continue;
+    }
+#if defined(HAVE_PWRITEV)
+    r = pwritev(fd, iov, iovcnt, pos);
+#elif defined(HAVE_PWRITE)
+    r = pwrite(fd, iov->iov_base, iov->iov_len, pos);
+#else
+    if( lseek(fd, pos, SEEK_SET) < 0 ) return -1;
+    r = write(fd, iov->iov_base, iov->iov_len);
+#endif
+    if( r < 0 ){
+      if( EINTR == errno ) continue;
+      return -1;
+    }
+    if( r == 0 ){
+      errno = ENOSPC;
+      return -1;
+    }
+    pos += r;
+    for( ; iovcnt && (size_t)r >= iov->iov_len; iov++, iovcnt-- )
+      r -= iov->iov_len;
+    if( r ){
+      iov->iov_base = (char *)iov->iov_base + r;
+      iov->iov_len -= r;
+    }
+  }
+  return 0;
+}
+
+/* Allocates disk space for the region of a file starting at pos, extending
+   the file.  The filesystem's allocation call is used where it has one,
+   otherwise zeros are written. */
+static int Preallocate(int fd, dt_datalen_t pos, dt_datalen_t length)
+{
+  struct iovec iov;
+  char *zero;
+  dt_datalen_t done;
+  int r = 0;
+
+  if( length == 0 ) return 0;
+
+#ifdef HAVE_FALLOCATE
+  if( 0 == fallocate(fd, 0, (off_t)pos, (off_t)length) ) return 0;
+  if( EOPNOTSUPP != errno && ENOSYS != errno ) return -1;
+#endif
+#ifdef HAVE_POSIX_FALLOCATE
+  if( 0 == (r = posix_fallocate(fd, (off_t)pos, (off_t)length)) ) return 0;
+  if( EINVAL != r && EOPNOTSUPP != r ){
+    errno = r;
+    return -1;
+  }
+  r = 0;
+#endif
+
+  if( !(zero = new char[OPT_IO_SIZE]) ){
+    errno = ENOMEM;
+    return -1;
+  }
+  memset(zero, 0, OPT_IO_SIZE);
+  for( done = 0; done < length; done += iov.iov_len ){
+    iov.iov_base = zero;
+    iov.iov_len = (length - done < OPT_IO_SIZE) ?
+      (size_t)(length - done) : OPT_IO_SIZE;
+    if( (r = WriteAt(fd, &iov, 1, (off_t)(pos + done))) < 0 ) break;
+  }
+  delete []zero;
+  return r;
+}
+
+/* Works on files on a worker thread.  The job holds its own descriptors and
+   positions, so the files may be closed or changed meanwhile. */
+class btFileJob: public WorkJob
+{
+ public:
+  btFiles *files;
+  int result, error;   // of the operation, and errno if it failed
+
+  btFileJob(btFiles *f){
+    files = f;
+    result = error = 0;
+  }
+};
+
+// Preallocates one file.
+class btAllocJob: public btFileJob
+{
+ public:
+  BTFILE *pbf;
+  int fd;
+  dt_datalen_t pos, newsize;
+
+  btAllocJob(btFiles *f, BTFILE *p, int d, dt_datalen_t n): btFileJob(f){
+    pbf = p;
+    fd = d;
+    pos = p->bf_size;
+    newsize = n;
+  }
+
+  void Run(){
+    if( (result = Preallocate(fd, pos, newsize - pos)) < 0 ) error = errno;
+    close(fd);
+  }
+  void Done(){ files->AllocResult(this); }
+};
+
+/* Copies data from one file to another.  Where the filesystem allows, the
+   blocks are shared (a reflink) or copied within the kernel; otherwise the
+   data is read and written through buf, of OPT_IO_SIZE. */
+static int CopyRange(int dstfd, off_t dstpos, int srcfd, off_t srcpos,
+  dt_datalen_t len, char *buf)
+{
+  struct iovec iov;
+  size_t nio;
+
+#ifdef FICLONERANGE
+  struct file_clone_range fcr;
+  fcr.src_fd = srcfd;
+  fcr.src_offset = srcpos;
+  fcr.src_length = len;
+  fcr.dest_offset = dstpos;
+  // Fails unless the range is block-aligned in both files.
+  if( len && 0 == ioctl(dstfd, FICLONERANGE, &fcr) ) return 0;
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+  while( len ){
+    loff_t in = srcpos, out = dstpos;
+    ssize_t r = copy_file_range(srcfd, &in, dstfd, &out, (size_t)len, 0);
+    if( r < 0 ){
+      if( EINTR == errno ) continue;
+      if( EXDEV == errno || ENOSYS == errno || EOPNOTSUPP == errno ||
+          EINVAL == errno )
+        break;  // copy it ourselves
+      return -1;
+    }
+    if( r == 0 ){
+      errno = EIO;  // file is shorter than expected
+      return -1;
+    }
+    srcpos += r;
+    dstpos += r;
+    len -= r;
+  }
+#endif
+
+  while( len ){
+    nio = (len < OPT_IO_SIZE) ? (size_t)len : OPT_IO_SIZE;
+    errno = 0;
+    if( ReadAt(srcfd, buf, nio, srcpos) < (ssize_t)nio ){
+      if( !errno ) errno = EIO;  // file is shorter than expected
+      return -1;
+    }
+    iov.iov_base = buf;
+    iov.iov_len = nio;
+    if( WriteAt(dstfd, &iov, 1, dstpos) < 0 ) return -1;
+    srcpos += nio;
+    dstpos += nio;
+    len -= nio;
+  }
+  return 0;
+}
+
+/* Copies part of a staging file into the real file.  The copy is discarded
+   if src up to the end of the range, or dst past its current end, is
+   written meanwhile (see _btf_io()). */
+class btMergeJob: public btFileJob
+{
+ public:
+  BTFILE *dst, *src;
+  int dstfd, srcfd;
+  off_t dstpos, srcpos;
+  dt_datalen_t len;
+  bool dirty;          // the copy may have missed a write
+  char buf[OPT_IO_SIZE];
+
+  btMergeJob(btFiles *f): btFileJob(f){
+    dstfd = srcfd = -1;
+    dirty = false;
+  }
+  ~btMergeJob(){
+    if( dstfd >= 0 ) close(dstfd);
+    if( srcfd >= 0 ) close(srcfd);
+  }
+
+  void Run(){
+    if( (result = CopyRange(dstfd, dstpos, srcfd, srcpos, len, buf)) < 0 )
+      error = errno;
+  }
+  void Done(){ files->MergeResult(this); }
+};
 
 btFiles::btFiles()
 {
   m_btfhead = (BTFILE *)0;
   m_nfiles = 0;
   m_file = (BTFILE **)0;
+  m_extent = (BTFILE **)0;
+  m_nextents = m_extent_max = 0;
   m_total_files_length = 0;
   m_total_opened = 0;
+  m_total_mapped = 0;
+  m_lru_head = m_lru_tail = (BTFILE *)0;
+  m_opens = m_closes = 0;
   m_flag_automanage = 1;
+  m_flag_writable = 0;
+  m_alloc_failed = 0;
+  m_merge_job = (btMergeJob *)0;
+  m_nbounce = 0;
+  m_held = m_held_last = (BTFMSG *)0;
+  m_nheld = m_held_dropped = 0;
+  m_flag_direct = 0;
   m_need_merge = 0;
   m_directory = (char *)0;
   m_staging_path = m_stagedir = (char *)0;
@@ -77,69 +376,342 @@ btFiles::~btFiles()
   }
   if( m_directory ) delete []m_directory;
   if( m_file ) delete []m_file;
+  if( m_extent ) delete []m_extent;
+  while( m_nbounce ) free(m_bounce[--m_nbounce]);
+  while( m_held ){
+    BTFMSG *msg = m_held;
+    m_held = msg->next;
+    delete []msg->text;
+    delete msg;
+  }
   if( m_staging_path ) delete []m_staging_path;
   if( m_stagedir ) delete []m_stagedir;
 }
 
+/* Messages from file operations.  The console is only used by the main
+   thread, so a worker thread's messages are held until Report() is called
+   by the job's result handler. */
+void btFiles::_btf_warning(int sev, const char *message, ...)
+{
+  va_list ap;
+
+  va_start(ap, message);
+  _btf_message(sev, message, ap);
+  va_end(ap);
+}
+
+void btFiles::_btf_debug(const char *message, ...)
+{
+  va_list ap;
+
+  if( !*cfg_verbose ) return;
+  va_start(ap, message);
+  _btf_message(-1, message, ap);
+  va_end(ap);
+}
+
+void btFiles::_btf_message(int sev, const char *message, va_list ap)
+{
+  char text[MAXPATHLEN + 128];
+  BTFMSG *msg;
+
+  vsnprintf(text, sizeof(text), message, ap);
+  if( MainThread() ){
+    if( sev < 0 ) CONSOLE.Debug("%s", text);
+    else CONSOLE.Warning(sev, "%s", text);
+    return;
+  }
+
+  btLock lock(m_lock);
+  if( m_nheld >= MAX_HELD_MSGS || !(msg = new BTFMSG) ){
+    m_held_dropped++;
+    return;
+  }
+  if( !(msg->text = new char[strlen(text) + 1]) ){
+    delete msg;
+    m_held_dropped++;
+    return;
+  }
+  strcpy(msg->text, text);
+  msg->sev = sev;
+  msg->next = (BTFMSG *)0;
+  if( m_held_last ) m_held_last->next = msg;
+  else m_held = msg;
+  m_held_last = msg;
+  m_nheld++;
+}
+
+// Print the messages held from worker threads.
+void btFiles::Report()
+{
+  BTFMSG *list, *msg;
+  int dropped;
+
+  if( !m_held && !m_held_dropped ) return;  // racy peek; checked again later
+  m_lock.Lock();
+  list = m_held;
+  m_held = m_held_last = (BTFMSG *)0;
+  m_nheld = 0;
+  dropped = m_held_dropped;
+  m_held_dropped = 0;
+  m_lock.Unlock();
+
+  while( (msg = list) ){
+    list = msg->next;
+    if( msg->sev < 0 ) CONSOLE.Debug("%s", msg->text);
+    else CONSOLE.Warning(msg->sev, "%s", msg->text);
+    delete []msg->text;
+    delete msg;
+  }
+  if( dropped )
+    CONSOLE.Warning(2, "warn, %d more file messages were dropped", dropped);
+}
+
 void btFiles::CloseFile(dt_count_t nfile)
 {
+  btLock lock(m_lock);
+
   if( nfile && nfile <= m_nfiles )
     _btf_close(m_file[nfile-1]);
 }
 
-int btFiles::_btf_close_oldest()
+/* Pass an access pattern hint for a range of data on to the system.  Files
+   are opened for a read hint, but otherwise only open files are told.  Files
+   using direct I/O don't go through the system cache, so they aren't told.
+   Only written-out data can be dropped, so a drop hint first waits for the
+   range to be written. */
+void btFiles::Advise(dt_datalen_t off, dt_datalen_t len, dt_advice_t advice)
 {
-  BTFILE *pbf_n, *pbf_close;
-  pbf_close = (BTFILE *)0;
-  for( pbf_n = m_btfhead; pbf_n; pbf_n = pbf_n->bf_next ){
-    if( !pbf_n->bf_flag_opened ) continue;
-    if( !pbf_close || pbf_n->bf_last_timestamp < pbf_close->bf_last_timestamp )
-      pbf_close = pbf_n;
+#ifdef HAVE_POSIX_FADVISE
+  BTFILE *pbf;
+  BTFIO fio;
+  dt_datalen_t pos, n;
+  btLock lock(m_lock);
+
+  for( pbf = _btf_find(off); pbf && len; pbf = pbf->bf_next ){
+    if( off < pbf->bf_offset ) break;  // data not present
+    if( off >= pbf->bf_offset + pbf->bf_size ) continue;
+    pos = off - pbf->bf_offset;
+    n = (len < pbf->bf_size - pos) ? len : (pbf->bf_size - pos);
+    off += n;
+    len -= n;
+
+    if( !pbf->bf_flag_opened &&
+        (DT_ADVISE_DONTNEED == advice || _btf_open(pbf, 0) < 0) )
+      continue;
+    if( pbf->bf_dfd >= 0 ) continue;
+    switch( advice ){
+    case DT_ADVISE_SEQUENTIAL:
+      posix_fadvise(pbf->bf_fd, (off_t)pos, (off_t)n, POSIX_FADV_SEQUENTIAL);
+      // fall through
+    case DT_ADVISE_WILLNEED:
+      posix_fadvise(pbf->bf_fd, (off_t)pos, (off_t)n, POSIX_FADV_WILLNEED);
+      break;
+    case DT_ADVISE_DONTNEED:
+      // Waiting for the writes mustn't hold up other I/O.
+      if( _btf_pin(pbf, &fio) < 0 ) break;
+      m_lock.Unlock();
+#ifdef SYNC_FILE_RANGE_WRITE
+      sync_file_range(fio.fd, (off_t)pos, (off_t)n,
+        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+        SYNC_FILE_RANGE_WAIT_AFTER);
+#endif
+      posix_fadvise(fio.fd, (off_t)pos, (off_t)n, POSIX_FADV_DONTNEED);
+      m_lock.Lock();
+      _btf_unpin(pbf, &fio);
+      break;
+    }
   }
-  if( !pbf_close ){
+#endif
+}
+
+// Files will be reopened for the new mode as they are used.
+void btFiles::SetDirect(bool direct)
+{
+  btLock lock(m_lock);
+
+#ifdef USE_DIRECT_IO
+  if( (direct ? 1 : 0) == m_flag_direct ) return;
+  m_flag_direct = direct ? 1 : 0;
+  while( m_lru_head ) _btf_close(m_lru_head);
+#endif
+}
+
+// Close files beyond the configured limit.
+void btFiles::CloseExcess()
+{
+  btLock lock(m_lock);
+
+  while( m_total_opened > *cfg_open_files && m_lru_head )
+    _btf_close(m_lru_head);
+}
+
+int btFiles::_btf_close_oldest()
+{
+  if( !m_lru_head ){
     errno = ENOENT;
     return -1;
   }
-  return _btf_close(pbf_close);
+  return _btf_close(m_lru_head);
+}
+
+// Open files are kept on a list, least recently used first.
+void btFiles::_btf_lru_add(BTFILE *pbf)
+{
+  pbf->bf_lru_next = (BTFILE *)0;
+  pbf->bf_lru_prev = m_lru_tail;
+  if( m_lru_tail ) m_lru_tail->bf_lru_next = pbf;
+  else m_lru_head = pbf;
+  m_lru_tail = pbf;
+}
+
+void btFiles::_btf_lru_remove(BTFILE *pbf)
+{
+  if( pbf->bf_lru_prev ) pbf->bf_lru_prev->bf_lru_next = pbf->bf_lru_next;
+  else m_lru_head = pbf->bf_lru_next;
+  if( pbf->bf_lru_next ) pbf->bf_lru_next->bf_lru_prev = pbf->bf_lru_prev;
+  else m_lru_tail = pbf->bf_lru_prev;
+  pbf->bf_lru_prev = pbf->bf_lru_next = (BTFILE *)0;
+}
+
+// The file was just used; it will be closed last.
+void btFiles::_btf_touch(BTFILE *pbf)
+{
+  if( pbf->bf_flag_opened && m_lru_tail != pbf ){
+    _btf_lru_remove(pbf);
+    _btf_lru_add(pbf);
+  }
 }
 
 int btFiles::_btf_close(BTFILE *pbf)
 {
   if( !pbf->bf_flag_opened ) return 0;
 
-  if(*cfg_verbose) CONSOLE.Debug("Close file \"%s\"", pbf->bf_filename);
+  if(*cfg_verbose) _btf_debug("Close file \"%s\"", pbf->bf_filename);
 
-  if( fclose(pbf->bf_fp) == EOF )
-    CONSOLE.Warning(2, "warn, error closing file \"%s\":  %s",
+  if( close(pbf->bf_fd) < 0 )
+    _btf_warning(2, "warn, error closing file \"%s\":  %s",
       pbf->bf_filename, strerror(errno));
+  if( pbf->bf_dfd >= 0 ) close(pbf->bf_dfd);
   pbf->bf_flag_opened = 0;
-  pbf->bf_fp = (FILE *)0;
-  if( pbf->bf_buffer ){
-    delete []pbf->bf_buffer;
-    pbf->bf_buffer = (char *)0;
-  }
+  pbf->bf_fd = pbf->bf_dfd = -1;
+  _btf_lru_remove(pbf);
   m_total_opened--;
+  m_closes++;
   return 0;
 }
 
-int btFiles::_btf_open(BTFILE *pbf, const int iotype)
+/* Build the extent index of all files, real and staging, for finding the
+   file that holds an offset by binary search.  Without the index, lookups
+   walk the file list. */
+int btFiles::_btf_index()
 {
-  char fn[MAXPATHLEN];
-  const char *mode = iotype ? (pbf->bf_size ? "r+b" : "w+b") : "rb";
-  struct stat sb;
+  BTFILE *pbf;
+  dt_count_t n = 0;
 
-  if( pbf->bf_flag_opened ){
-    if( pbf->bf_flag_readonly && iotype ) _btf_close(pbf);
-    else return 0;  // already open in a usable mode
+  for( pbf = m_btfhead; pbf; pbf = pbf->bf_next ) n++;
+  if( m_extent ) delete []m_extent;
+  m_nextents = m_extent_max = 0;
+  if( !(m_extent = new BTFILE *[n + MAX_STAGEDIR_FILES]) ){
+    errno = ENOMEM;
+    return -1;
   }
+  m_extent_max = n + MAX_STAGEDIR_FILES;
+  for( pbf = m_btfhead; pbf; pbf = pbf->bf_next ) m_extent[m_nextents++] = pbf;
+  return 0;
+}
 
-  if( m_flag_automanage && m_total_opened >= MAX_OPEN_FILES ){  // close a file
-    if( _btf_close_oldest() < 0 ) return -1;
+// Index of the last file that starts at or before off.
+dt_count_t btFiles::_btf_search(dt_datalen_t off) const
+{
+  dt_count_t lo = 0, hi = m_nextents, mid;
+
+  while( hi - lo > 1 ){
+    mid = lo + (hi - lo) / 2;
+    if( m_extent[mid]->bf_offset <= off ) lo = mid;
+    else hi = mid;
   }
+  return lo;
+}
 
-  if(*cfg_verbose) CONSOLE.Debug("Open mode=%s %sfile \"%s\"", mode,
-    pbf->bf_flag_staging ? "staging " : "", pbf->bf_filename);
+/* The last file (real or staging) that starts at or before off.  Files
+   before it can't hold the data, so searches may begin here. */
+BTFILE *btFiles::_btf_locate(dt_datalen_t off) const
+{
+  BTFILE *pbf;
+
+  if( m_nextents ) return m_extent[_btf_search(off)];
+  for( pbf = m_btfhead; pbf && pbf->bf_next; pbf = pbf->bf_next )
+    if( off < pbf->bf_next->bf_offset ) break;
+  return pbf;
+}
+
+/* The last real file that starts at or before off, or NULL if there is no
+   list of real files (when making a torrent). */
+BTFILE *btFiles::_btf_real(dt_datalen_t off) const
+{
+  dt_count_t lo = 0, hi = m_nfiles, mid;
+
+  if( !m_file || !m_nfiles ) return (BTFILE *)0;
+  while( hi - lo > 1 ){
+    mid = lo + (hi - lo) / 2;
+    if( m_file[mid]->bf_offset <= off ) lo = mid;
+    else hi = mid;
+  }
+  return m_file[lo];
+}
+
+/* Where to start looking for the data at off.  Data already in the real file
+   is used even if a staging file holding it hasn't been removed yet. */
+BTFILE *btFiles::_btf_find(dt_datalen_t off) const
+{
+  BTFILE *pbf = _btf_real(off);
+
+  if( pbf && off < pbf->bf_offset + pbf->bf_size ) return pbf;
+  return _btf_locate(off);
+}
+
+// Add a new staging file to the index; it's already on the list.
+void btFiles::_btf_index_add(BTFILE *pbf)
+{
+  BTFILE **extent;
+  dt_count_t pos;
+
+  if( !m_nextents ) return;
+  if( m_nextents == m_extent_max ){
+    if( !(extent = new BTFILE *[m_extent_max * 2]) ){
+      delete []m_extent;  // lookups will walk the list instead
+      m_extent = (BTFILE **)0;
+      m_nextents = m_extent_max = 0;
+      return;
+    }
+    memcpy(extent, m_extent, m_nextents * sizeof(BTFILE *));
+    delete []m_extent;
+    m_extent = extent;
+    m_extent_max *= 2;
+  }
+  pos = _btf_search(pbf->bf_offset) + 1;
+  memmove(m_extent + pos + 1, m_extent + pos,
+    (m_nextents - pos) * sizeof(BTFILE *));
+  m_extent[pos] = pbf;
+  m_nextents++;
+}
 
+void btFiles::_btf_index_remove(BTFILE *pbf)
+{
+  dt_count_t pos;
+
+  if( !m_nextents ) return;
+  for( pos = _btf_search(pbf->bf_offset); m_extent[pos] != pbf; pos-- )
+    if( pos == 0 ) return;
+  m_nextents--;
+  memmove(m_extent + pos, m_extent + pos + 1,
+    (m_nextents - pos) * sizeof(BTFILE *));
+}
+
+// Get the full pathname of a file (fn must hold MAXPATHLEN).
+int btFiles::_btf_path(const BTFILE *pbf, char *fn) const
+{
   if( pbf->bf_flag_staging ){
     if( MAXPATHLEN <= snprintf(fn, MAXPATHLEN, "%s%c%s", m_staging_path,
                       PATH_SP, pbf->bf_filename) ){
@@ -155,80 +727,405 @@ int btFiles::_btf_open(BTFILE *pbf, const int iotype)
   }else{
     strcpy(fn, pbf->bf_filename);
   }
+  return 0;
+}
+
+int btFiles::_btf_open(BTFILE *pbf, const int iotype)
+{
+  char fn[MAXPATHLEN];
+  // While downloading, existing files are opened for writing even to read
+  // them, so they needn't be reopened when data arrives.
+  int rw = (iotype || (m_flag_writable && pbf->bf_size)) ? 1 : 0;
+  const char *mode = rw ? (pbf->bf_size ? "r+b" : "w+b") : "rb";
+  int flags = O_BINARY | (rw ?
+    (O_RDWR | (pbf->bf_size ? 0 : O_CREAT | O_TRUNC)) : O_RDONLY);
+  struct stat sb;
+
+  if( pbf->bf_flag_opened ){
+    if( pbf->bf_flag_readonly && iotype ) _btf_close(pbf);
+    else return 0;  // already open in a usable mode
+  }
+
+  if( m_flag_automanage && m_total_opened >= *cfg_open_files ){
+    if( _btf_close_oldest() < 0 ) return -1;  // close a file
+  }
+
+  if(*cfg_verbose) _btf_debug("Open mode=%s %sfile \"%s\"", mode,
+    pbf->bf_flag_staging ? "staging " : "", pbf->bf_filename);
+
+  if( _btf_path(pbf, fn) < 0 ) return -1;
 
   if( iotype && stat(fn, &sb) < 0 && MkPath(fn) < 0 ){
-    CONSOLE.Warning(1,
+    _btf_warning(1,
       "error, create directory path for file \"%s\" failed:  %s",
-      strerror(errno));
+      pbf->bf_filename, strerror(errno));
+    return -1;
+  }
+
+  if( (pbf->bf_fd = open(fn, flags, 0666)) < 0 ){
+    switch( errno ){
+    case EMFILE:
+    case ENFILE:
+      _btf_close_oldest();
+      break;
+    case ENOSPC:
+      if( !FindAndMerge(0) ) MergeAny();  // directory could be full
+      break;
+    case EACCES:
+    case EROFS:
+      if( rw && !iotype ){  // reading is enough for now
+        rw = 0;
+        flags = O_BINARY | O_RDONLY;
+        break;
+      }
+      return -1;
+    default:
+      return -1;
+    }
+    if( (pbf->bf_fd = open(fn, flags, 0666)) < 0 )
+      return -1;  // caller prints error
+  }
+
+#ifdef USE_DIRECT_IO
+  // A second descriptor for whole blocks, which bypass the system cache.
+  if( m_flag_direct && !pbf->bf_flag_nodirect &&
+      (pbf->bf_dfd = open(fn, (flags & ~(O_CREAT | O_TRUNC)) | O_DIRECT)) < 0 &&
+      *cfg_verbose ){
+    _btf_debug("Direct I/O not available for \"%s\":  %s",
+      pbf->bf_filename, strerror(errno));
+  }
+#endif
+
+  pbf->bf_flag_opened = 1;
+  pbf->bf_flag_readonly = rw ? 0 : 1;
+  m_total_opened++;
+  m_opens++;
+  _btf_lru_add(pbf);
+  return 0;
+}
+
+int btFiles::IO(char *rbuf, const char *wbuf, dt_datalen_t off, bt_length_t len)
+{
+  struct iovec iov;
+
+  // Break up the I/O if necessary due to system limitation.
+  if( len > (size_t)len ){
+    bt_length_t iosize;
+    int r, result = 0;
+
+    for( iosize = len; iosize > (size_t)iosize; iosize /= 2 );
+    while( len ){
+      if( len < iosize ) iosize = len;
+      r = IO(rbuf, wbuf, off, iosize);
+      if( r != 0 ) result = r;
+      if( wbuf ) wbuf += iosize;
+      else rbuf += iosize;
+      off += iosize;
+      len -= iosize;
+    }
+    return result;
+  }
+
+  iov.iov_base = wbuf ? (char *)wbuf : rbuf;
+  iov.iov_len = len;
+  return _btf_io(&iov, 1, wbuf ? 1 : 0, off, len);
+}
+
+/* Read one contiguous range into several buffers, or write data gathered
+   from several buffers, with a single vectored call per file instead of one
+   call per buffer. */
+int btFiles::ReadV(const struct iovec *iov, int iovcnt, dt_datalen_t off)
+{
+  dt_datalen_t len = 0;
+
+  for( int i = 0; i < iovcnt; i++ ) len += iov[i].iov_len;
+  if( len > (bt_length_t)len ){
+    errno = EINVAL;
+    return -1;
+  }
+  return _btf_io(iov, iovcnt, 0, off, (bt_length_t)len);
+}
+
+int btFiles::WriteV(const struct iovec *iov, int iovcnt, dt_datalen_t off)
+{
+  dt_datalen_t len = 0;
+
+  for( int i = 0; i < iovcnt; i++ ) len += iov[i].iov_len;
+  if( len > (bt_length_t)len ){
+    errno = EINVAL;
     return -1;
   }
+  return _btf_io(iov, iovcnt, 1, off, (bt_length_t)len);
+}
+
+// Block boundaries for direct I/O.
+#define DIRECT_FLOOR(x) ((x) / DIRECT_ALIGN * DIRECT_ALIGN)
+#define DIRECT_CEIL(x) DIRECT_FLOOR((x) + DIRECT_ALIGN - 1)
+
+/* Positional read of a data file.  In direct mode the whole blocks are read
+   with the direct descriptor, through the bounce buffer if buf is not
+   aligned; the partial blocks at either end are read normally. */
+ssize_t btFiles::_btf_pread(BTFIO *fio, char *buf, size_t len, off_t pos)
+{
+  off_t head = DIRECT_CEIL(pos), tail = DIRECT_FLOOR(pos + (off_t)len);
+  size_t done, n;
+  ssize_t r;
+
+  if( fio->dfd < 0 || head >= tail ) return ReadAt(fio->fd, buf, len, pos);
+
+  if( (done = head - pos) &&
+      (r = ReadAt(fio->fd, buf, done, pos)) < (ssize_t)done )
+    return r;
+  while( pos + (off_t)done < tail ){
+    n = tail - pos - done;
+    if( 0 == (size_t)(buf + done) % DIRECT_ALIGN ){
+      r = ReadAt(fio->dfd, buf + done, n, pos + done);
+    }else{
+      if( n > OPT_IO_SIZE ) n = OPT_IO_SIZE;
+      if( (r = ReadAt(fio->dfd, fio->bounce, n, pos + done)) > 0 )
+        memcpy(buf + done, fio->bounce, r);
+    }
+    if( r < 0 ){
+      if( EINVAL != errno ) return r;
+      _btf_nodirect(fio);  // read the rest normally
+      break;
+    }
+    done += r;
+    if( (size_t)r < n ) return done;  // end of file
+  }
+  if( done < len ){
+    if( (r = ReadAt(fio->fd, buf + done, len - done, pos + done)) < 0 )
+      return r;
+    done += r;
+  }
+  return done;
+}
+
+/* Positional scattering read of a data file.  In direct mode, a vector that
+   is entirely aligned is read with the direct descriptor; otherwise each
+   buffer is read by _btf_pread(). */
+ssize_t btFiles::_btf_preadv(BTFIO *fio, struct iovec *iov, int iovcnt,
+  off_t pos)
+{
+  struct iovec vec[MAX_WRITEV];
+  size_t done = 0;
+  ssize_t r;
+  int i;
+
+  if( fio->dfd < 0 ) return ReadVAt(fio->fd, iov, iovcnt, pos);
+
+  if( 0 == pos % DIRECT_ALIGN ){
+    for( i = 0; i < iovcnt; i++ ){
+      if( (size_t)iov[i].iov_base % DIRECT_ALIGN ||
+          iov[i].iov_len % DIRECT_ALIGN )
+        break;
+    }
+    if( i == iovcnt ){
+      memcpy(vec, iov, iovcnt * sizeof(*iov));  // kept to read again
+      if( (r = ReadVAt(fio->dfd, vec, iovcnt, pos)) >= 0 || EINVAL != errno )
+        return r;
+      _btf_nodirect(fio);
+      return ReadVAt(fio->fd, iov, iovcnt, pos);
+    }
+  }
+
+  for( i = 0; i < iovcnt; i++ ){
+    r = _btf_pread(fio, (char *)iov[i].iov_base, iov[i].iov_len, pos + done);
+    if( r < 0 ) return r;
+    done += r;
+    if( (size_t)r < iov[i].iov_len ) break;  // end of file
+  }
+  return done;
+}
+
+// Copy len bytes from an iovec cursor, advancing it.
+static void Gather(char *buf, struct iovec **iov, size_t len)
+{
+  size_t n;
+
+  while( len ){
+    n = ((*iov)->iov_len < len) ? (*iov)->iov_len : len;
+    memcpy(buf, (*iov)->iov_base, n);
+    buf += n;
+    len -= n;
+    (*iov)->iov_base = (char *)(*iov)->iov_base + n;
+    if( !((*iov)->iov_len -= n) ) (*iov)++;
+  }
+}
+
+/* Positional gathering write of a data file; the vector is used up.  In
+   direct mode, aligned data goes straight to the direct descriptor.  Other
+   whole blocks are copied through the bounce buffer, and partial blocks at
+   either end are written normally. */
+int btFiles::_btf_pwritev(BTFIO *fio, struct iovec *iov, int iovcnt,
+  off_t pos)
+{
+  struct iovec vec[MAX_WRITEV];
+  off_t head, tail, end = pos;
+  size_t n;
+  int i;
+
+  for( i = 0; i < iovcnt; i++ ) end += iov[i].iov_len;
+  head = DIRECT_CEIL(pos);
+  tail = DIRECT_FLOOR(end);
+  if( fio->dfd < 0 || head >= tail ) return WriteAt(fio->fd, iov, iovcnt, pos);
+
+  if( head == pos && tail == end ){
+    for( i = 0; i < iovcnt; i++ ){
+      if( (size_t)iov[i].iov_base % DIRECT_ALIGN ||
+          iov[i].iov_len % DIRECT_ALIGN )
+        break;
+    }
+    if( i == iovcnt ){
+      memcpy(vec, iov, iovcnt * sizeof(*iov));  // kept to write again
+      if( WriteAt(fio->dfd, vec, iovcnt, pos) == 0 ) return 0;
+      if( EINVAL != errno ) return -1;
+      _btf_nodirect(fio);
+      return WriteAt(fio->fd, iov, iovcnt, pos);
+    }
+  }
+
+  while( pos < end ){
+    if( pos < head ) n = head - pos;
+    else if( pos >= tail ) n = end - pos;
+    else n = (tail - pos < OPT_IO_SIZE) ? tail - pos : OPT_IO_SIZE;
+    Gather(fio->bounce, &iov, n);
+    vec[0].iov_base = fio->bounce;
+    vec[0].iov_len = n;
+    if( pos >= head && pos < tail && fio->dfd >= 0 ){
+      if( WriteAt(fio->dfd, vec, 1, pos) == 0 ){
+        pos += n;
+        continue;
+      }
+      if( EINVAL != errno ) return -1;
+      _btf_nodirect(fio);
+      vec[0].iov_base = fio->bounce;
+      vec[0].iov_len = n;
+    }
+    if( WriteAt(fio->fd, vec, 1, pos) < 0 ) return -1;
+    pos += n;
+  }
+  return 0;
+}
+
+/* A direct I/O call failed with EINVAL, so the file system doesn't allow it
+   for this file after all.  The call continues with the normal descriptor,
+   and the file stops using direct I/O when it's unpinned. */
+void btFiles::_btf_nodirect(BTFIO *fio)
+{
+  close(fio->dfd);
+  fio->dfd = -1;
+  fio->direct_failed = true;
+}
+
+/* Get a file's descriptors for I/O without the lock.  The file is marked
+   busy so it won't be merged or removed meanwhile.  Direct I/O also gets a
+   bounce buffer of its own, and falls back to buffered I/O without one. */
+int btFiles::_btf_pin(BTFILE *pbf, BTFIO *fio)
+{
+  fio->dfd = -1;
+  fio->bounce = (char *)0;
+  fio->direct_failed = false;
+  if( (fio->fd = dup(pbf->bf_fd)) < 0 ) return -1;
+#ifdef USE_DIRECT_IO
+  if( pbf->bf_dfd >= 0 ){
+    void *buf;
+
+    if( m_nbounce ) fio->bounce = m_bounce[--m_nbounce];
+    else if( 0 == posix_memalign(&buf, DIRECT_ALIGN, OPT_IO_SIZE) )
+      fio->bounce = (char *)buf;
+    if( fio->bounce ) fio->dfd = dup(pbf->bf_dfd);
+  }
+#endif
+  pbf->bf_busy++;
+  return 0;
+}
+
+void btFiles::_btf_unpin(BTFILE *pbf, BTFIO *fio)
+{
+  int error = errno;
+
+  close(fio->fd);
+  if( fio->dfd >= 0 ) close(fio->dfd);
+  if( fio->bounce ){
+    if( m_nbounce < MAX_BOUNCE ) m_bounce[m_nbounce++] = fio->bounce;
+    else free(fio->bounce);
+  }
+  if( fio->direct_failed && pbf->bf_dfd >= 0 ){
+    _btf_warning(2, "warn, direct I/O failed on file \"%s\"; not using it",
+      pbf->bf_filename);
+    close(pbf->bf_dfd);
+    pbf->bf_dfd = -1;
+    pbf->bf_flag_nodirect = 1;
+  }
+  pbf->bf_busy--;
+  errno = error;
+}
 
-  pbf->bf_last_timestamp = now + 1;
-  if( !(pbf->bf_fp = fopen(fn, mode)) ){
-    switch( errno ){
-    case EMFILE:
-    case ENFILE:
-      _btf_close_oldest();
-      break;
-    case ENOSPC:
-      if( !MergeNext() ) MergeAny();  // directory could be full
-      break;
-    default:
-      return -1;
+/* Read or write len bytes at pos, using the buffers of the vector and
+   advancing it. */
+int btFiles::_btf_rw(BTFIO *fio, const int iotype, off_t pos,
+  const struct iovec **iov, int *iovcnt, size_t *skip, size_t len)
+{
+  struct iovec vec[MAX_WRITEV];
+  size_t size;
+  int n;
+
+  while( len ){
+    for( n = 0, size = 0; n < MAX_WRITEV && size < len; n++ ){
+      vec[n].iov_base = (char *)(*iov)->iov_base + *skip;
+      vec[n].iov_len = (*iov)->iov_len - *skip;
+      if( vec[n].iov_len > len - size ){
+        vec[n].iov_len = len - size;
+        *skip += vec[n].iov_len;
+      }else{
+        (*iov)++;
+        (*iovcnt)--;
+        *skip = 0;
+      }
+      size += vec[n].iov_len;
     }
-    if( !(pbf->bf_fp = fopen(fn, mode)) ) return -1;  // caller prints error
+    if( iotype ){
+      if( _btf_pwritev(fio, vec, n, pos) < 0 ) return -1;
+    }else if( _btf_preadv(fio, vec, n, pos) < 0 ) return -1;
+    pos += size;
+    len -= size;
   }
-  pbf->bf_buffer = new char[DEFAULT_SLICE_SIZE];
-  if( pbf->bf_buffer )
-    setvbuf(pbf->bf_fp, pbf->bf_buffer, _IOFBF, DEFAULT_SLICE_SIZE);
-
-  pbf->bf_flag_opened = 1;
-  pbf->bf_flag_readonly = iotype ? 0 : 1;
-  m_total_opened++;
   return 0;
 }
 
-int btFiles::IO(char *rbuf, const char *wbuf, dt_datalen_t off, bt_length_t len)
+/* Finding, creating and opening files is done under the lock, but the data
+   is read or written without it where positional I/O keeps concurrent calls
+   on the same file apart. */
+int btFiles::_btf_io(const struct iovec *iov, int iovcnt, const int iotype,
+  dt_datalen_t off, bt_length_t len)
 {
-  int result = -1;
-  const int iotype = wbuf ? 1 : 0;
+  int result = -1, r;
   off_t pos;
-  size_t nio;
-  BTFILE *pbf = m_btfhead, *pbfref = (BTFILE *)0, *pbfnext = (BTFILE *)0;
+  size_t nio, skip = 0;
+  BTFILE *pbf, *pbfref = (BTFILE *)0, *pbfnext = (BTFILE *)0;
+  BTFIO fio;
   bool diskaccess = false;
 
   if( off + (dt_datalen_t)len > m_total_files_length ){
-    CONSOLE.Warning(1, "error, data offset %llu length %lu out of range",
+    _btf_warning(1, "error, data offset %llu length %lu out of range",
       (unsigned long long)off, (unsigned long)len);
     errno = EINVAL;
     return -1;
   }
 
-  // Break up the I/O if necessary due to system limitation.
-  if( len > (size_t)len ){
-    bt_length_t iosize;
-    int r;
-
-    result = 0;
-    for( iosize = len; iosize > (size_t)iosize; iosize /= 2 );
-    while( len ){
-      if( len < iosize ) iosize = len;
-      r = IO(rbuf, wbuf, off, iosize);
-      if( r != 0 ) result = r;
-      if( iotype ) wbuf += iosize;
-      else rbuf += iosize;
-      len -= iosize;
-    }
-    return result;
-  }
+  m_lock.Lock();
 
-  // Find the first file to read/write
+  /* Find the first file to read/write.  During a merge, data beyond the end
+     of dst goes to the staging file. */
+  pbf = _btf_find(off);
   while( pbf ){
     pbfnext = pbf->bf_next;
     if( off >= pbf->bf_offset &&
         (off < pbf->bf_offset + pbf->bf_size ||
           (iotype && off == pbf->bf_offset + pbf->bf_size &&
-            (!pbf->bf_flag_staging || pbf->bf_size < MAX_STAGEFILE_SIZE))) ){
+            (pbf->bf_flag_staging ? pbf->bf_size < MAX_STAGEFILE_SIZE :
+              !(m_merge_job && pbf == m_merge_job->dst)))) ){
       break;
     }
     if( off < pbf->bf_offset ){
@@ -255,9 +1152,9 @@ int btFiles::IO(char *rbuf, const char *wbuf, dt_datalen_t off, bt_length_t len)
           char fn[MAXPATHLEN], tmpdir[m_fsizelen+1];
           sprintf(tmpdir, "%.*llu", (int)m_fsizelen, (unsigned long long)off);
           snprintf(fn, MAXPATHLEN, "%s%c%s", m_staging_path, PATH_SP, tmpdir);
-          if(*cfg_verbose) CONSOLE.Debug("Create dir \"%s\"", fn);
+          if(*cfg_verbose) _btf_debug("Create dir \"%s\"", fn);
           if( mkdir(fn, 0755) < 0 ){
-            CONSOLE.Warning(1, "error, create directory \"%s\" failed:  %s",
+            _btf_warning(1, "error, create directory \"%s\" failed:  %s",
               fn, strerror(errno));
           }else{
             strcpy(m_stagedir, tmpdir);
@@ -268,7 +1165,7 @@ int btFiles::IO(char *rbuf, const char *wbuf, dt_datalen_t off, bt_length_t len)
         if( !(pbf = new BTFILE) ||
             !(pbf->bf_filename = new char[strlen(m_stagedir) +
               strlen(m_torrent_id) + m_fsizelen + 3]) ){
-          CONSOLE.Warning(1,
+          _btf_warning(1,
             "error, failed to allocate memory for staging file");
           if( pbf ) delete pbf;
           errno = ENOMEM;
@@ -281,9 +1178,10 @@ int btFiles::IO(char *rbuf, const char *wbuf, dt_datalen_t off, bt_length_t len)
         pbf->bf_next = pbfref->bf_next;
         pbf->bf_nextreal = pbfref->bf_nextreal;
         pbfref->bf_next = pbf;
+        _btf_index_add(pbf);
         m_stagecount++;
       }else{  // read
-        CONSOLE.Warning(1, "error, failed to find file for offset %llu",
+        _btf_warning(1, "error, failed to find file for offset %llu",
           (unsigned long long)off);
         errno = EINVAL;
         goto done;
@@ -294,52 +1192,67 @@ int btFiles::IO(char *rbuf, const char *wbuf, dt_datalen_t off, bt_length_t len)
 
     if( (!pbf->bf_flag_opened || (iotype && pbf->bf_flag_readonly)) &&
         _btf_open(pbf, iotype) < 0 ){
-      CONSOLE.Warning(1, "error, failed to open file \"%s\":  %s",
+      _btf_warning(1, "error, failed to open file \"%s\":  %s",
         pbf->bf_filename, strerror(errno));
       diskaccess = true;
       goto done;
     }
 
-    pbf->bf_last_timestamp = now;
+    _btf_touch(pbf);
 
     diskaccess = true;
-    if( fseeko(pbf->bf_fp, pos, SEEK_SET) < 0 ){
-      CONSOLE.Warning(1, "error, failed to seek to %llu on file \"%s\":  %s",
-        (unsigned long long)pos, pbf->bf_filename, strerror(errno));
-      goto done;
-    }
 
     // Read or write current file
     if( 0 == iotype ){
       nio = (len <= pbf->bf_size - pos) ? len : (pbf->bf_size - pos);
-      errno = 0;
-      if( nio && 1 != fread(rbuf, nio, 1, pbf->bf_fp) && ferror(pbf->bf_fp) ){
-        CONSOLE.Warning(1, "error, read failed at %llu on file \"%s\":  %s",
-          (unsigned long long)pos, pbf->bf_filename, strerror(errno));
-        goto done;
-      }
+    }else if( pbf->bf_flag_staging ){
+      if( !pbf->bf_next ||
+          len <= pbf->bf_next->bf_offset - pbf->bf_offset - pos ){
+        nio = len;
+      }else nio = pbf->bf_next->bf_offset - pbf->bf_offset - pos;
     }else{
-      if( pbf->bf_flag_staging ){
-        if( !pbf->bf_next ||
-            len <= pbf->bf_next->bf_offset - pbf->bf_offset - pos ){
-          nio = len;
-        }else nio = pbf->bf_next->bf_offset - pbf->bf_offset - pos;
-      }else{
-        nio = (len <= pbf->bf_length - pos) ? len : (pbf->bf_length - pos);
+      nio = (len <= pbf->bf_length - pos) ? len : (pbf->bf_length - pos);
+      if( m_merge_job && pbf == m_merge_job->dst &&
+          (dt_datalen_t)pos + nio > pbf->bf_size )
+        nio = pbf->bf_size - pos;
+    }
+    if( nio ){
+      /* The copy may have missed this.  Staged data before the range is
+         already in dst, and data within it may already have been copied. */
+      if( iotype && m_merge_job &&
+          ((pbf == m_merge_job->src &&
+            pos < m_merge_job->srcpos + (off_t)m_merge_job->len) ||
+           (pbf == m_merge_job->dst &&
+            pos + (off_t)nio > m_merge_job->dstpos)) )
+        m_merge_job->dirty = true;
+      if( _btf_pin(pbf, &fio) < 0 ){
+        _btf_warning(1, "error, %s failed at %llu on file \"%s\":  %s",
+          iotype ? "write" : "read", (unsigned long long)pos,
+          pbf->bf_filename, strerror(errno));
+        goto done;
       }
+#ifdef UNLOCKED_IO
+      m_lock.Unlock();
+#endif
       errno = 0;
-      if( nio ){
-        if( 1 != fwrite(wbuf, nio, 1, pbf->bf_fp) ||
-            fflush(pbf->bf_fp) == EOF ){
-          CONSOLE.Warning(1,
-            "error, write or flush failed at %llu on file \"%s\":  %s",
-            (unsigned long long)pos, pbf->bf_filename, strerror(errno));
+      r = _btf_rw(&fio, iotype, pos, &iov, &iovcnt, &skip, nio);
+#ifdef UNLOCKED_IO
+      m_lock.Lock();
+#endif
+      _btf_unpin(pbf, &fio);
+      if( r < 0 ){
+        _btf_warning(1, "error, %s failed at %llu on file \"%s\":  %s",
+          iotype ? "write" : "read", (unsigned long long)pos,
+          pbf->bf_filename, strerror(errno));
+        if( iotype ){
           m_write_failed = true;
           m_write_tried = now;
-          goto done;
         }
-        m_write_failed = false;
+        goto done;
       }
+      if( iotype ) m_write_failed = false;
+    }
+    if( iotype ){
       if( (dt_datalen_t)pos + nio > pbf->bf_size )
         pbf->bf_size = pos + nio;
       if( !pbf->bf_flag_staging && pbf->bf_size < pbf->bf_length &&
@@ -354,8 +1267,6 @@ int btFiles::IO(char *rbuf, const char *wbuf, dt_datalen_t off, bt_length_t len)
     len -= nio;
     if( len ){
       off += nio;
-      if( iotype ) wbuf += nio;
-      else rbuf += nio;
       pbfref = pbf;
       pbf = pbf->bf_next;
       if( off < pbf->bf_offset ){
@@ -366,10 +1277,134 @@ int btFiles::IO(char *rbuf, const char *wbuf, dt_datalen_t off, bt_length_t len)
   }
   result = 0;
  done:
+  m_lock.Unlock();
   if( diskaccess ) DiskAccess();
   return result;
 }
 
+/* Return a pointer to the data if it lies within one complete data file,
+   mapping a window of the file as needed.  Mappings are only used and
+   replaced by the main thread; a worker closing the file doesn't affect
+   them.  With prefetch, the system is asked to read the data in ahead of
+   use.  Returns NULL if the data can't be mapped (use IO() instead). */
+const char *btFiles::Map(dt_datalen_t off, bt_length_t len, bool prefetch)
+{
+#ifdef USE_MMAP
+  static long pagesize = 0;
+  BTFILE *pbf;
+  dt_datalen_t pos, start;
+  size_t maplen;
+  char *addr;
+  struct stat sb;
+  btLock lock(m_lock);
+
+  if( !len || off + (dt_datalen_t)len > m_total_files_length )
+    return (char *)0;
+
+  pbf = _btf_real(off);
+  if( !pbf || off + len > pbf->bf_offset + pbf->bf_length ||
+      pbf->bf_size < pbf->bf_length ){
+    return (char *)0;
+  }
+  pos = off - pbf->bf_offset;
+
+  if( !pagesize && (pagesize = sysconf(_SC_PAGESIZE)) <= 0 ) pagesize = 4096;
+
+  if( !pbf->bf_map || pos < pbf->bf_map_pos ||
+      pos + len > pbf->bf_map_pos + pbf->bf_map_len ){
+    _btf_unmap(pbf);
+    start = pos - pos % MAP_WINDOW;
+    if( pos + len > start + MAP_WINDOW ) start = pos - pos % pagesize;
+    maplen = (pbf->bf_length - start < MAP_WINDOW) ?
+             (size_t)(pbf->bf_length - start) : MAP_WINDOW;
+    if( pos + len > start + maplen ) return (char *)0;  // too big to map
+
+    if( m_total_mapped >= MAX_MAPPED_FILES ) _btf_unmap_oldest();
+    if( !pbf->bf_flag_opened && _btf_open(pbf, 0) < 0 ){
+      CONSOLE.Warning(1, "error, failed to open file \"%s\":  %s",
+        pbf->bf_filename, strerror(errno));
+      return (char *)0;
+    }
+    _btf_touch(pbf);
+    // Touching a mapped page past the end of the file raises SIGBUS.
+    if( fstat(pbf->bf_fd, &sb) < 0 ||
+        sb.st_size < (off_t)(start + maplen) ){
+      if(*cfg_verbose) CONSOLE.Debug("File \"%s\" is short; not mapping it",
+        pbf->bf_filename);
+      return (char *)0;
+    }
+    addr = (char *)mmap((void *)0, maplen, PROT_READ, MAP_SHARED,
+      pbf->bf_fd, (off_t)start);
+    if( (char *)MAP_FAILED == addr ){
+      CONSOLE.Warning(2, "warn, failed to map file \"%s\":  %s",
+        pbf->bf_filename, strerror(errno));
+      return (char *)0;
+    }
+#ifdef HAVE_MADVISE
+    madvise(addr, maplen, MADV_SEQUENTIAL);
+#endif
+    if(*cfg_verbose) CONSOLE.Debug("Map file \"%s\" at %llu length %llu",
+      pbf->bf_filename, (unsigned long long)start,
+      (unsigned long long)maplen);
+    pbf->bf_map = addr;
+    pbf->bf_map_pos = start;
+    pbf->bf_map_len = maplen;
+    m_total_mapped++;
+  }
+
+  pbf->bf_map_timestamp = now;
+  addr = pbf->bf_map + (pos - pbf->bf_map_pos);
+#ifdef HAVE_MADVISE
+  if( prefetch ){
+    size_t skew = (size_t)((pos - pbf->bf_map_pos) % pagesize);
+    madvise(addr - skew, len + skew, MADV_WILLNEED);
+  }
+#endif
+  return addr;
+#else
+  return (char *)0;
+#endif
+}
+
+void btFiles::_btf_unmap(BTFILE *pbf)
+{
+#ifdef USE_MMAP
+  if( !pbf->bf_map ) return;
+
+  if(*cfg_verbose) CONSOLE.Debug("Unmap file \"%s\"", pbf->bf_filename);
+
+  if( munmap(pbf->bf_map, pbf->bf_map_len) < 0 )
+    CONSOLE.Warning(2, "warn, error unmapping file \"%s\":  %s",
+      pbf->bf_filename, strerror(errno));
+  pbf->bf_map = (char *)0;
+  pbf->bf_map_pos = 0;
+  pbf->bf_map_len = 0;
+  m_total_mapped--;
+#endif
+}
+
+int btFiles::_btf_unmap_oldest()
+{
+  BTFILE *pbf_n, *pbf_unmap;
+  pbf_unmap = (BTFILE *)0;
+  for( pbf_n = m_btfhead; pbf_n; pbf_n = pbf_n->bf_nextreal ){
+    if( !pbf_n->bf_map ) continue;
+    if( !pbf_unmap || pbf_n->bf_map_timestamp < pbf_unmap->bf_map_timestamp )
+      pbf_unmap = pbf_n;
+  }
+  if( !pbf_unmap ) return -1;
+  _btf_unmap(pbf_unmap);
+  return 0;
+}
+
+void btFiles::UnmapAll()
+{
+  btLock lock(m_lock);
+
+  for( BTFILE *pbf = m_btfhead; pbf && m_total_mapped; pbf = pbf->bf_nextreal )
+    _btf_unmap(pbf);
+}
+
 int btFiles::NeedMerge() const
 {
   if( !m_need_merge ) return 0;
@@ -377,94 +1412,160 @@ int btFiles::NeedMerge() const
     0 : 1;
 }
 
-int btFiles::MergeStaging(BTFILE *dst)
+/* Open the files to merge the staging file following dst, and find the range
+   of it to be copied.  Returns 1 if the range is already present in dst. */
+int btFiles::_btf_merge_open(BTFILE *dst, off_t *srcpos, dt_datalen_t *len)
 {
-  int result = -1;
   BTFILE *src = dst->bf_next;
-  char buf[OPT_IO_SIZE];
-  size_t nio = OPT_IO_SIZE;
-  off_t pos;
-  dt_datalen_t remain;
-  int f_remove = 0;
-  bool diskaccess = false;
 
   if( src->bf_offset + src->bf_size <= dst->bf_offset + dst->bf_size ){
     if(*cfg_verbose)
-      CONSOLE.Debug("Staging file %s range already present in \"%s\"",
+      _btf_debug("Staging file %s range already present in \"%s\"",
         src->bf_filename, dst->bf_filename);
-    goto delsrc;
+    return 1;
   }
-  if(*cfg_verbose) CONSOLE.Debug("Merge file %s to \"%s\"", src->bf_filename,
+  if(*cfg_verbose) _btf_debug("Merge file %s to \"%s\"", src->bf_filename,
     dst->bf_filename);
 
   if( !src->bf_flag_opened && _btf_open(src, 0) < 0 ){
-    CONSOLE.Warning(1, "error, failed to open file \"%s\":  %s",
+    _btf_warning(1, "error, failed to open file \"%s\":  %s",
       src->bf_filename, strerror(errno));
-    diskaccess = true;
-    goto done;
-  }
-  pos = dst->bf_offset + dst->bf_size - src->bf_offset;
-  remain = src->bf_size - pos;
-  diskaccess = true;
-  if( fseeko(src->bf_fp, pos, SEEK_SET) < 0 ){
-    CONSOLE.Warning(1, "error, failed to seek to %llu on file \"%s\":  %s",
-      (unsigned long long)pos, src->bf_filename, strerror(errno));
-    goto done;
+    return -1;
   }
 
   // Prevent src from being closed during open of dst.
-  src->bf_last_timestamp = now + 1;
+  _btf_touch(src);
 
   if( (!dst->bf_flag_opened || dst->bf_flag_readonly) &&
       _btf_open(dst, 1) < 0 ){
-    CONSOLE.Warning(1, "error, failed to open file \"%s\":  %s",
+    _btf_warning(1, "error, failed to open file \"%s\":  %s",
       dst->bf_filename, strerror(errno));
-    goto done;
-  }
-  pos = dst->bf_size;
-  if( fseeko(dst->bf_fp, pos, SEEK_SET) < 0 ){
-    CONSOLE.Warning(1, "error, failed to seek to %llu on file \"%s\":  %s",
-      (unsigned long long)pos, dst->bf_filename, strerror(errno));
-    goto done;
+    return -1;
   }
+  *srcpos = dst->bf_offset + dst->bf_size - src->bf_offset;
+  *len = src->bf_size - *srcpos;
+  if( *len > dst->bf_length - dst->bf_size )
+    *len = dst->bf_length - dst->bf_size;
+  return 0;
+}
 
-  while( remain && dst->bf_size < dst->bf_length ){
-    if( remain < nio ) nio = remain;
-    errno = 0;
-    if( 1 != fread(buf, nio, 1, src->bf_fp) && ferror(src->bf_fp) ){
-      CONSOLE.Warning(1, "error, read failed at %llu on file \"%s\":  %s",
-        (unsigned long long)(src->bf_size - remain), src->bf_filename,
-        strerror(errno));
-      goto done;
-    }
-    if( 1 != fwrite(buf, nio, 1, dst->bf_fp) || fflush(dst->bf_fp) == EOF ){
-      CONSOLE.Warning(1,
-        "error, write or flush failed at %llu on file \"%s\":  %s",
-        (unsigned long long)dst->bf_size, dst->bf_filename, strerror(errno));
-      CONSOLE.Warning(1,
-        "Error merging data; more available disk space may be needed--"
-        "will retry in %d seconds.", WRITE_RETRY_INTERVAL);
-      m_write_failed = true;
-      m_write_tried = now;
-      goto done;
+void btFiles::_btf_merge_failed(BTFILE *dst)
+{
+  _btf_warning(1, "error, merge of file %s to \"%s\" failed:  %s",
+    dst->bf_next->bf_filename, dst->bf_filename, strerror(errno));
+  _btf_warning(1,
+    "Error merging data; more available disk space may be needed--"
+    "will retry in %d seconds.", WRITE_RETRY_INTERVAL);
+  m_write_failed = true;
+  m_write_tried = now;
+}
+
+int btFiles::MergeStaging(BTFILE *dst)
+{
+  BTFILE *src = dst->bf_next;
+  char buf[OPT_IO_SIZE];
+  off_t srcpos;
+  dt_datalen_t len;
+  int r;
+
+  if( (r = _btf_merge_open(dst, &srcpos, &len)) < 0 ){
+    DiskAccess();
+    return -1;
+  }
+  if( 0 == r && len ){
+    if( CopyRange(dst->bf_fd, (off_t)dst->bf_size, src->bf_fd, srcpos, len,
+                  buf) < 0 ){
+      _btf_merge_failed(dst);
+      DiskAccess();
+      return -1;
     }
     m_write_failed = false;
-    remain -= nio;
-    pos += nio;
-    if( (dt_datalen_t)pos > dst->bf_size )
-      dst->bf_size = pos;
+    dst->bf_size += len;
+  }
+  return _btf_merge_finish(dst);
+}
+
+// Start copying staged data into dst on a worker thread.
+int btFiles::_btf_merge_start(BTFILE *dst)
+{
+  btMergeJob *job;
+  off_t srcpos;
+  dt_datalen_t len;
+  int r;
+
+  if( (r = _btf_merge_open(dst, &srcpos, &len)) < 0 ){
+    DiskAccess();
+    return -1;
+  }
+  if( r || !len ) return _btf_merge_finish(dst);
+
+  job = new btMergeJob(this);
+#ifndef WINDOWS
+  if( !job ){
+    errno = ENOMEM;
+    return -1;
+  }
+#endif
+  job->dst = dst;
+  job->src = dst->bf_next;
+  job->dstpos = dst->bf_size;
+  job->srcpos = srcpos;
+  job->len = (len > MERGE_CHUNK) ? MERGE_CHUNK : len;
+  if( (job->dstfd = dup(dst->bf_fd)) < 0 ||
+      (job->srcfd = dup(job->src->bf_fd)) < 0 ){
+    _btf_warning(1, "error, merge of file %s to \"%s\" failed:  %s",
+      job->src->bf_filename, dst->bf_filename, strerror(errno));
+    delete job;
+    return -1;
+  }
+  m_merge_job = job;
+  WORKERS.Submit(job);
+  return 0;
+}
+
+void btFiles::MergeResult(btMergeJob *job)
+{
+  btLock lock(m_lock);
+  BTFILE *dst = job->dst;
+
+  Report();
+  m_merge_job = (btMergeJob *)0;
+  m_need_merge = 1;  // continue, or find that all is merged
+  if( job->result < 0 ){
+    errno = job->error;
+    _btf_merge_failed(dst);
+  }else if( job->dirty ){
+    if(*cfg_verbose) _btf_debug("Staging file %s changed during merge",
+      job->src->bf_filename);
+  }else{
+    m_write_failed = false;
+    dst->bf_size = job->dstpos + job->len;
+    if( (job->srcpos + (dt_datalen_t)job->len >= job->src->bf_size ||
+         dst->bf_size >= dst->bf_length) &&
+        !dst->bf_busy && !job->src->bf_busy )  // else finish it later
+      _btf_merge_finish(dst);
   }
+  DiskAccess();
+  delete job;
+}
+
+// The staged data has been copied into dst; remove the staging file.
+int btFiles::_btf_merge_finish(BTFILE *dst)
+{
+  BTFILE *src = dst->bf_next;
+  char fn[MAXPATHLEN];
+  int f_remove = 0;
 
   if( dst->bf_size == dst->bf_length ) _btf_close(dst);  // will reopen RO
- delsrc:
   _btf_close(src);
-  sprintf(buf, "%s%c%s", m_staging_path, PATH_SP, src->bf_filename);
-  if(*cfg_verbose) CONSOLE.Debug("Delete file \"%s\"", buf);
-  diskaccess = true;
-  if( remove(buf) < 0 ){
-    CONSOLE.Warning(2, "error deleting file \"%s\":  %s", buf, strerror(errno));
+  snprintf(fn, MAXPATHLEN, "%s%c%s", m_staging_path, PATH_SP,
+    src->bf_filename);
+  if(*cfg_verbose) _btf_debug("Delete file \"%s\"", fn);
+  if( remove(fn) < 0 ){
+    _btf_warning(2, "error deleting file \"%s\":  %s", fn, strerror(errno));
   }
   dst->bf_next = src->bf_next;
+  _btf_index_remove(src);
 
   if( m_stagecount > 0 &&
       0==strncmp(m_stagedir, src->bf_filename, strlen(m_stagedir)) ){
@@ -478,9 +1579,9 @@ int btFiles::MergeStaging(BTFILE *dst)
     struct stat sb;
     DIR *dp;
     struct dirent *dirp;
-    sprintf(buf, "%s%c", m_staging_path, PATH_SP);
-    strncat(buf, src->bf_filename, m_fsizelen);
-    if( 0==stat(buf, &sb) && S_ISDIR(sb.st_mode) && (dp = opendir(buf)) ){
+    snprintf(fn, MAXPATHLEN, "%s%c", m_staging_path, PATH_SP);
+    strncat(fn, src->bf_filename, m_fsizelen);
+    if( 0==stat(fn, &sb) && S_ISDIR(sb.st_mode) && (dp = opendir(fn)) ){
       while( (dirp = readdir(dp)) ){
         if( 0!=strcmp(dirp->d_name, ".") && 0!=strcmp(dirp->d_name, "..") ){
           f_remove = 0;
@@ -489,9 +1590,9 @@ int btFiles::MergeStaging(BTFILE *dst)
       }
       closedir(dp);
       if( f_remove ){
-        if(*cfg_verbose) CONSOLE.Debug("Remove dir \"%s\"", buf);
-        if( remove(buf) < 0 ){
-          CONSOLE.Warning(2, "warn, remove directory \"%s\" failed:  %s", buf,
+        if(*cfg_verbose) _btf_debug("Remove dir \"%s\"", fn);
+        if( remove(fn) < 0 ){
+          _btf_warning(2, "warn, remove directory \"%s\" failed:  %s", fn,
             strerror(errno));
         }
       }
@@ -499,29 +1600,36 @@ int btFiles::MergeStaging(BTFILE *dst)
   }
 
   delete src;
-  result = 0;
- done:
-  if( diskaccess ) DiskAccess();
-  return result;
+  DiskAccess();
+  return 0;
 }
 
 // Identify a file that can be merged, and do it
-int btFiles::FindAndMerge(int findall, int dostaging)
+int btFiles::FindAndMerge(int findall, int dostaging, int background)
 {
   BTFILE *pbf = m_btfhead;
-  int merged = 0;
+  int merged = 0, busy = 0;
+  btLock lock(m_lock);
+
+  if( m_merge_job ) return 0;  // wait for it to finish
 
   for( ; pbf; pbf = dostaging ? pbf->bf_next : pbf->bf_nextreal ){
+    // A complete file may still have a staging file left to remove.
     while( !pbf->bf_flag_staging && pbf->bf_next &&
-        pbf->bf_next->bf_flag_staging && pbf->bf_size < pbf->bf_length &&
+        pbf->bf_next->bf_flag_staging &&
         pbf->bf_offset + pbf->bf_size >= pbf->bf_next->bf_offset ){
+      if( pbf->bf_busy || pbf->bf_next->bf_busy ){
+        busy = 1;  // being read or written; try again later
+        break;
+      }
       if( findall ) CONSOLE.Interact_n(".");
-      if( MergeStaging(pbf) < 0 ) goto done;
+      if( (background ? _btf_merge_start(pbf) : MergeStaging(pbf)) < 0 )
+        goto done;
       merged = 1;
       if( !findall ) goto done;
     }
   }
-  m_need_merge = 0;
+  m_need_merge = busy;
 
  done:
   return merged;
@@ -537,11 +1645,12 @@ bt_index_t btFiles::ChoosePiece(const Bitfield &choices,
   const Bitfield &available, bt_index_t preference) const
 {
   Bitfield needs(BTCONTENT.GetNPieces()), needsnext(BTCONTENT.GetNPieces());
-  BTFILE *pbf = m_btfhead, *pbt;
+  BTFILE *pbf, *pbt;
   bt_index_t idx;
   int found;
+  btLock lock(m_lock);  // a merge may be changing the file list
 
-  for( ; pbf; pbf = pbf->bf_nextreal ){
+  for( pbf = m_btfhead; pbf; pbf = pbf->bf_nextreal ){
     if( pbf->bf_next && pbf->bf_next->bf_flag_staging ){
       // next piece of this file helps fill a merge gap
       idx = (pbf->bf_offset + pbf->bf_size) / BTCONTENT.GetPieceLength();
@@ -597,17 +1706,21 @@ int btFiles::_btf_destroy()
   BTFILE *pbf, *pbf_next;
   for( pbf = m_btfhead; pbf; pbf = pbf_next ){
     pbf_next = pbf->bf_next;
+    _btf_unmap(pbf);
     delete pbf;
   }
   m_btfhead = (BTFILE *)0;
+  m_lru_head = m_lru_tail = (BTFILE *)0;
+  m_nextents = 0;
   m_total_files_length = 0;
   m_total_opened = 0;
+  m_total_mapped = 0;
   return 0;
 }
 
 int btFiles::ExtendFile(BTFILE *pbf)
 {
-  dt_datalen_t newsize, length;
+  dt_datalen_t newsize;
   int retval;
 
   if( pbf->bf_next )
@@ -625,17 +1738,13 @@ int btFiles::ExtendFile(BTFILE *pbf)
     return 0;
   }
 
-  if( *cfg_allocate == DT_ALLOC_FULL ){
-    off_t pos = pbf->bf_size;
-    if( fseeko(pbf->bf_fp, pos, SEEK_SET) < 0 ){
-      CONSOLE.Warning(1, "error, failed to seek to %llu on file \"%s\":  %s",
-        (unsigned long long)pos, pbf->bf_filename, strerror(errno));
-      return -1;
-    }
-    length = newsize - pbf->bf_size;
-  }else length = newsize;
+  if( *cfg_allocate == DT_ALLOC_FULL ){  // preallocate to disk (-a)
+    retval = (newsize > pbf->bf_size) ? _btf_allocate(pbf, newsize) : 0;
+    _btf_close(pbf);
+    return retval;
+  }
 
-  retval = length ? _btf_ftruncate(fileno(pbf->bf_fp), length) : 0;
+  retval = _btf_ftruncate(pbf->bf_fd, newsize);
   if( retval < 0 ){
     CONSOLE.Warning(1, "error, allocate file \"%s\" failed:  %s",
       pbf->bf_filename, strerror(errno));
@@ -645,33 +1754,52 @@ int btFiles::ExtendFile(BTFILE *pbf)
   return retval;
 }
 
+// Start preallocation of the rest of a file; ExtendAll() waits for it.
+int btFiles::_btf_allocate(BTFILE *pbf, dt_datalen_t newsize)
+{
+  btAllocJob *job;
+  int fd;
+
+  if( (fd = dup(pbf->bf_fd)) < 0 ){
+    CONSOLE.Warning(1, "error, allocate file \"%s\" failed:  %s",
+      pbf->bf_filename, strerror(errno));
+    return -1;
+  }
+  job = new btAllocJob(this, pbf, fd, newsize);
+#ifndef WINDOWS
+  if( !job ){
+    close(fd);
+    errno = ENOMEM;
+    return -1;
+  }
+#endif
+  WORKERS.Submit(job);
+
+  // Bound the number of descriptors held by waiting jobs.
+  while( WORKERS.Pending() > (dt_count_t)WORKERS.Threads() )
+    WORKERS.WaitOne();
+  return 0;
+}
+
+void btFiles::AllocResult(btAllocJob *job)
+{
+  Report();
+  if( job->result < 0 ){
+    CONSOLE.Warning(1, "error, allocate file \"%s\" failed:  %s",
+      job->pbf->bf_filename, strerror(job->error));
+    m_alloc_failed = 1;
+  }else job->pbf->bf_size = job->newsize;
+  CONSOLE.Interact_n(".");
+  delete job;
+}
+
+// Set the size of a (sparse) file.
 int btFiles::_btf_ftruncate(int fd, dt_datalen_t length)
 {
   off_t offset = length;
 
   if( length == 0 ) return 0;
 
-  if( *cfg_allocate == DT_ALLOC_FULL ){  // preallocate to disk (-a)
-    char *c = new char[OPT_IO_SIZE];
-    if( !c ){
-      errno = ENOMEM;
-      return -1;
-    }
-    memset(c, 0, OPT_IO_SIZE);
-    int r = 0, wlen;
-    dt_datalen_t len = 0;
-    for( int i=0; len < length; i++ ){
-      if( len + OPT_IO_SIZE > length ) wlen = (int)(length - len);
-      else wlen = OPT_IO_SIZE;
-      if( 0 == i % 100 ) CONSOLE.Interact_n(".");
-      if( (r = write(fd, c, wlen)) < 0 ) return r;
-      len += wlen;
-    }
-    delete []c;
-    return r;
-  }
-
-  // create sparse file
 #ifdef WINDOWS
   char c = (char)0;
   if( lseek(fd, offset - 1, SEEK_SET) < 0 ) return -1;
@@ -864,6 +1992,8 @@ int btFiles::BuildFromFS(const char *pathname)
     errno = EINVAL;
     goto done;
   }
+  if( _btf_index() < 0 )
+    CONSOLE.Warning(2, "warn, failed to allocate memory for files index");
   result = 0;
  done:
   DiskAccess();
@@ -1105,6 +2235,8 @@ int btFiles::BuildFromMI(const char *metabuf, const size_t metabuf_len,
   for( i=0, pbt = m_btfhead; pbt; pbt = pbt->bf_nextreal ){
     m_file[i++] = pbt;
   }
+  if( _btf_index() < 0 )
+    CONSOLE.Warning(2, "warn, failed to allocate memory for files index");
   return 0;
 }
 
@@ -1186,12 +2318,11 @@ int btFiles::SetupFiles(const char *torrentid, bool check_only)
           m_stagecount++;
           if( pbf->bf_size > 0 ) files_exist = true;
 
-          for( pbt = m_btfhead; pbt->bf_next; pbt = pbt->bf_next ){
-            if( pbf->bf_offset < pbt->bf_next->bf_offset ) break;
-          }
+          pbt = _btf_locate(pbf->bf_offset);
           pbf->bf_next = pbt->bf_next;
           pbt->bf_next = pbf;
           pbf->bf_nextreal = pbt->bf_nextreal;
+          _btf_index_add(pbf);
         }
       }
       closedir(subdp);
@@ -1311,7 +2442,9 @@ int btFiles::ExtendAll()
   BTFILE *pbf = m_btfhead;
   int i;
   Bitfield tmpFilter;
+  int retval = 0;
 
+  m_alloc_failed = 0;
   for( i = 1; pbf; pbf = pbf->bf_nextreal, i++ ){
     if( pbf->bf_size > 0 && pbf->bf_size >= pbf->bf_length ) continue;
     if( *cfg_file_to_download ){
@@ -1322,9 +2455,13 @@ int btFiles::ExtendAll()
         continue;
     }
     if( *cfg_allocate != DT_ALLOC_FULL ) CONSOLE.Interact_n(".");
-    if( ExtendFile(pbf) < 0 ) return -1;
+    if( ExtendFile(pbf) < 0 ){
+      retval = -1;
+      break;
+    }
   }
-  return 0;
+  if( *cfg_allocate == DT_ALLOC_FULL ) WORKERS.Wait();
+  return (retval < 0 || m_alloc_failed) ? -1 : 0;
 }
 
 void btFiles::PrintOut(bool show_completion) const
@@ -1416,48 +2553,187 @@ int btFiles::FillMetaInfo(FILE *fp)
 }
 
 
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+// Set the pieces that lie entirely within the given range.
+static int mark_pieces(Bitfield *pBF, dt_datalen_t start, dt_datalen_t end,
+  bt_length_t pieceLength, dt_datalen_t total)
+{
+  bt_index_t idx, stop;
+  int count = 0;
+
+  if( end <= start ) return 0;
+  idx = (start + pieceLength - 1) / pieceLength;
+  stop = (end >= total) ? (end + pieceLength - 1) / pieceLength :
+                          end / pieceLength;
+  for( ; idx < stop; idx++, count++ ) pBF->Set(idx);
+  return count;
+}
+#endif
+
+/* Find the pieces that lie entirely within holes in (sparse) files, which
+   have never been written.  Returns the number of pieces found. */
+int btFiles::FindHoles(Bitfield *pHoles, bt_length_t pieceLength)
+{
+  int count = 0;
+
+  pHoles->Clear();
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+  BTFILE *p;
+  char fn[MAXPATHLEN];
+  int fd;
+  off_t pos, data, size;
+  dt_datalen_t start = 0, end = 0;  // current hole, in torrent offsets
+
+  btLock lock(m_lock);
+  for( p = m_btfhead; p; p = p->bf_next ){
+    if( !p->bf_size || _btf_path(p, fn) < 0 ) continue;
+    if( (fd = open(fn, O_RDONLY)) < 0 ) continue;
+    size = (off_t)p->bf_size;
+    for( pos = 0; pos < size; ){
+      if( (data = lseek(fd, pos, SEEK_DATA)) < 0 || data > size ) data = size;
+      if( data > pos ){
+        if( p->bf_offset + pos == end ) end = p->bf_offset + data;
+        else{
+          count += mark_pieces(pHoles, start, end, pieceLength,
+                               m_total_files_length);
+          start = p->bf_offset + pos;
+          end = p->bf_offset + data;
+        }
+      }
+      if( data >= size || (pos = lseek(fd, data, SEEK_HOLE)) < 0 ) break;
+    }
+    close(fd);
+  }
+  count += mark_pieces(pHoles, start, end, pieceLength, m_total_files_length);
+  DiskAccess();
+#endif
+  return count;
+}
+
+/* Record the current state of each file (including staging files) for the
+   resume file, so that a later run can tell whether it has been changed.
+   Files are closed first so that all writes are reflected. */
+int btFiles::FillResume(FILE *fp)
+{
+  BTFILE *p;
+  struct stat sb;
+  char fn[MAXPATHLEN];
+  btLock lock(m_lock);
+
+  if( bencode_str("files", fp) != 1 ) return 0;
+  if( bencode_begin_list(fp) != 1 ) return 0;
+  for( p = m_btfhead; p; p = p->bf_next ){
+    _btf_close(p);
+    if( _btf_path(p, fn) < 0 || stat(fn, &sb) < 0 ){
+      sb.st_size = -1;
+      sb.st_mtime = 0;
+      sb.st_ino = 0;
+    }
+    if( bencode_begin_dict(fp) != 1 ) return 0;
+    if( bencode_str("inode", fp) != 1 ) return 0;
+    if( bencode_int(sb.st_ino, fp) != 1 ) return 0;
+    if( bencode_str("mtime", fp) != 1 ) return 0;
+    if( bencode_int(sb.st_mtime, fp) != 1 ) return 0;
+    if( bencode_str("path", fp) != 1 ) return 0;
+    if( bencode_str(fn, fp) != 1 ) return 0;
+    if( bencode_str("size", fp) != 1 ) return 0;
+    if( bencode_int(sb.st_size, fp) != 1 ) return 0;
+    if( bencode_end_dict_list(fp) != 1 ) return 0;
+  }
+  DiskAccess();
+  return bencode_end_dict_list(fp);
+}
+
+/* Compare the files with the list saved by FillResume, and set the pieces
+   that touch any changed file in pChanged.
+   Returns the number of changed files, or -1 if the list does not match. */
+int btFiles::CheckResume(const char *b, size_t len, Bitfield *pChanged,
+  bt_length_t pieceLength)
+{
+  BTFILE *p;
+  struct stat sb;
+  char fn[MAXPATHLEN];
+  const char *s;
+  size_t dl, q;
+  int64_t size, mtime, inode;
+  bt_index_t idx, stop;
+  int changed = 0;
+
+  if( !len || 'l' != *b ) return -1;
+  b++;
+  len--;
+  for( p = m_btfhead; p; p = p->bf_next, b += dl, len -= dl ){
+    if( !len || 'e' == *b ) return -1;
+    if( !(dl = decode_dict(b, len, (const char *)0)) ||
+        !decode_query(b, dl, "path", &s, &q, (int64_t *)0, DT_QUERY_STR) ||
+        !decode_query(b, dl, "size", (const char **)0, (size_t *)0, &size,
+                      DT_QUERY_INT) ||
+        !decode_query(b, dl, "mtime", (const char **)0, (size_t *)0, &mtime,
+                      DT_QUERY_INT) ||
+        !decode_query(b, dl, "inode", (const char **)0, (size_t *)0, &inode,
+                      DT_QUERY_INT) ){
+      return -1;
+    }
+    if( _btf_path(p, fn) < 0 || strlen(fn) != q || memcmp(fn, s, q) )
+      return -1;
+    if( !p->bf_length ) continue;  // contains no pieces
+
+    if( stat(fn, &sb) < 0 ){
+      sb.st_size = -1;
+      sb.st_mtime = 0;
+      sb.st_ino = 0;
+    }
+    if( size == (int64_t)sb.st_size && mtime == (int64_t)sb.st_mtime &&
+        inode == (int64_t)sb.st_ino ){
+      continue;
+    }
+    if(*cfg_verbose) CONSOLE.Debug("File changed:  %s", fn);
+    changed++;
+    idx = p->bf_offset / pieceLength;
+    stop = (p->bf_offset + p->bf_length - 1) / pieceLength;
+    for( ; idx <= stop; idx++ ) pChanged->Set(idx);
+  }
+  if( !len || 'e' != *b ) return -1;
+  DiskAccess();
+  return changed;
+}
+
 void btFiles::SetFilter(dt_count_t nfile, Bitfield *pFilter,
   bt_length_t pieceLength)
 {
   BTFILE *p;
-  dt_count_t id = 0;
-  bt_index_t index;
+  bt_index_t index, start, stop;
 
   if( nfile == 0 || nfile > m_nfiles ){
     pFilter->Clear();
     return;
   }
 
-  for( p = m_btfhead; p; p = p->bf_nextreal ){
-    if( ++id == nfile ){
-      if( 0 == p->bf_length ){
-        p->bf_npieces = 0;
-        pFilter->SetAll();
-        return;
-      }
-      bt_index_t start, stop;
-      start = p->bf_offset / pieceLength;
-      stop  = (p->bf_offset + p->bf_length) / pieceLength;
-      // calculation is off if file ends on a piece boundary
-      if( stop > start && 0 == (p->bf_offset + p->bf_length) % pieceLength )
-        --stop;
-      p->bf_npieces = stop - start + 1;
-
-      if( p->bf_npieces <= pFilter->NBits() / 2 ){
-        pFilter->SetAll();
-        for( index = start; index <= stop; index++ ){
-          pFilter->UnSet(index);
-        }
-      }else{
-        pFilter->Clear();
-        for( index = 0; index < start; index++ ){
-          pFilter->Set(index);
-        }
-        for( index = stop + 1; index < pFilter->NBits(); index++ ){
-          pFilter->Set(index);
-        }
-      }
-      break;
+  p = m_file[nfile-1];
+  if( 0 == p->bf_length ){
+    p->bf_npieces = 0;
+    pFilter->SetAll();
+    return;
+  }
+  start = p->bf_offset / pieceLength;
+  stop  = (p->bf_offset + p->bf_length) / pieceLength;
+  // calculation is off if file ends on a piece boundary
+  if( stop > start && 0 == (p->bf_offset + p->bf_length) % pieceLength )
+    --stop;
+  p->bf_npieces = stop - start + 1;
+
+  if( p->bf_npieces <= pFilter->NBits() / 2 ){
+    pFilter->SetAll();
+    for( index = start; index <= stop; index++ ){
+      pFilter->UnSet(index);
+    }
+  }else{
+    pFilter->Clear();
+    for( index = 0; index < start; index++ ){
+      pFilter->Set(index);
+    }
+    for( index = stop + 1; index < pFilter->NBits(); index++ ){
+      pFilter->Set(index);
     }
   }
 }
@@ -7,9 +7,38 @@
 #include <stdio.h>
 #include <time.h>
 
+#ifdef WINDOWS
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#include <fcntl.h>
+#include <stdarg.h>
+
 #include "bttypes.h"
 #include "bitfield.h"
 #include "btconfig.h"
+#include "workpool.h"
+
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#else
+struct iovec{
+  void *iov_base;
+  size_t iov_len;
+};
+#endif
+
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+#define USE_MMAP
+#endif
+
+#if defined(O_DIRECT) && defined(HAVE_POSIX_MEMALIGN)
+#define USE_DIRECT_IO
+#endif
+#define DIRECT_ALIGN 4096  // buffer/offset/length alignment for direct I/O
+#define MAX_BOUNCE 4       // spare direct I/O buffers kept for reuse
+#define MAX_HELD_MSGS 32   // worker thread messages held for the main thread
 
 enum dt_alloc_t{
   DT_ALLOC_SPARSE = 0,
@@ -17,78 +46,165 @@ enum dt_alloc_t{
   DT_ALLOC_NONE   = 2
 };
 
+// Access pattern hints; see btFiles::Advise().
+enum dt_advice_t{
+  DT_ADVISE_WILLNEED   = 0,  // will be read soon
+  DT_ADVISE_SEQUENTIAL = 1,  // will be read soon, following earlier reads
+  DT_ADVISE_DONTNEED   = 2   // won't be read again soon
+};
+
 typedef struct _btfile{
   char *bf_filename;         // full path of file
-  FILE *bf_fp;
-  char *bf_buffer;           // IO buffer
+  int bf_fd;
+  int bf_dfd;                // same file opened for direct I/O, or -1
   dt_datalen_t bf_length;    // final size of file
   dt_datalen_t bf_offset;    // torrent offset of file start
   dt_datalen_t bf_size;      // current size of file
-  time_t bf_last_timestamp;  // last IO timestamp
   bt_index_t bf_npieces;     // number of pieces contained
+  char *bf_map;              // read-only mapping of part of the file
+  dt_datalen_t bf_map_pos;   // file position of the mapping
+  size_t bf_map_len;
+  time_t bf_map_timestamp;   // last use of the mapping
+
+  int bf_busy;                // I/O in progress without the lock
 
   unsigned char bf_flag_opened:1;
   unsigned char bf_flag_readonly:1;
   unsigned char bf_flag_staging:1;
-  unsigned char bf_reserved:5;
+  unsigned char bf_flag_nodirect:1;  // direct I/O failed; don't use it
+  unsigned char bf_reserved:4;
 
   struct _btfile *bf_next;
   struct _btfile *bf_nextreal;  // next non-staging file
+  struct _btfile *bf_lru_prev;  // open files, least recently used first
+  struct _btfile *bf_lru_next;
 
   _btfile(){
     bf_flag_opened = bf_flag_readonly = bf_flag_staging = 0;
+    bf_flag_nodirect = 0;
     bf_filename = (char *)0;
-    bf_fp = (FILE *)0;
+    bf_fd = bf_dfd = -1;
     bf_length = bf_offset = bf_size = 0;
-    bf_buffer = (char *)0;
-    bf_last_timestamp = (time_t)0;
     bf_npieces = 0;
+    bf_map = (char *)0;
+    bf_map_pos = 0;
+    bf_map_len = 0;
+    bf_map_timestamp = (time_t)0;
+    bf_busy = 0;
     bf_next = bf_nextreal = (struct _btfile *)0;
+    bf_lru_prev = bf_lru_next = (struct _btfile *)0;
   }
 
   ~_btfile(){
-    if( bf_fp && bf_flag_opened ) fclose( bf_fp );
+    if( bf_fd >= 0 && bf_flag_opened ) close(bf_fd);
+    if( bf_dfd >= 0 ) close(bf_dfd);
     if( bf_filename ) delete []bf_filename;
-    if( bf_buffer ) delete []bf_buffer;
     bf_filename = (char *)0;
-    bf_buffer = (char *)0;
     bf_next = bf_nextreal = (struct _btfile *)0;
   }
 }BTFILE;
 
+/* Descriptors of a file for I/O done without holding the lock.  They are
+   duplicates, so the file may be closed meanwhile. */
+typedef struct _btfio{
+  int fd;
+  int dfd;                   // for direct I/O, or -1
+  char *bounce;              // aligned buffer for direct I/O
+  bool direct_failed;        // dfd was dropped; see _btf_nodirect()
+}BTFIO;
+
+// A message from a worker thread, held until the main thread prints it.
+typedef struct _btfmsg{
+  int sev;                   // warning severity, or -1 for debug output
+  char *text;
+  struct _btfmsg *next;
+}BTFMSG;
+
+class btAllocJob;
+class btMergeJob;
 
 class btFiles
 {
+  friend class btAllocJob;
+  friend class btMergeJob;
+
  private:
   BTFILE *m_btfhead;
   char *m_directory;
   dt_datalen_t m_total_files_length;
   dt_count_t m_total_opened;  // already opened
+  BTFILE *m_lru_head, *m_lru_tail;  // open files, least recently used first
+  dt_count_t m_opens, m_closes;
+  dt_count_t m_total_mapped;  // files with a mapping
   dt_count_t m_nfiles;
   size_t m_fsizelen;
   BTFILE **m_file;
+  BTFILE **m_extent;          // all files incl. staging, in offset order
+  dt_count_t m_nextents, m_extent_max;
   char *m_torrent_id;         // unique torrent identifier (ASCII)
   char *m_staging_path;       // main staging directory
   char *m_stagedir;           // current staging subdir for new files
   int m_stagecount;           // count of files in staging subdir
   bool m_write_failed;
   time_t m_write_tried;
+  mutable btMutex m_lock;     // file I/O may be done by worker threads
+  btMergeJob *m_merge_job;    // staged data being copied in the background
+  char *m_bounce[MAX_BOUNCE];  // spare direct I/O buffers, under m_lock
+  int m_nbounce;
+  BTFMSG *m_held, *m_held_last;  // messages from worker threads, under m_lock
+  int m_nheld, m_held_dropped;
 
   uint8_t m_flag_automanage:1;
   uint8_t m_need_merge:1;
-  uint8_t m_flag_reserved:6;
+  uint8_t m_flag_writable:1;  // open for writing even to read
+  uint8_t m_alloc_failed:1;   // a preallocation job failed
+  uint8_t m_flag_direct:1;    // open files for direct I/O
+  uint8_t m_flag_reserved:3;
 
+  void _btf_warning(int sev, const char *message, ...);
+  void _btf_debug(const char *message, ...);
+  void _btf_message(int sev, const char *message, va_list ap);
   int _btf_close_oldest();
+  void _btf_lru_add(BTFILE *pbf);
+  void _btf_lru_remove(BTFILE *pbf);
+  void _btf_touch(BTFILE *pbf);
   int _btf_close(BTFILE *pbf);
   int _btf_open(BTFILE *pbf, const int iotype);
+  int _btf_pin(BTFILE *pbf, BTFIO *fio);
+  void _btf_unpin(BTFILE *pbf, BTFIO *fio);
+  void _btf_nodirect(BTFIO *fio);
+  ssize_t _btf_pread(BTFIO *fio, char *buf, size_t len, off_t pos);
+  ssize_t _btf_preadv(BTFIO *fio, struct iovec *iov, int iovcnt, off_t pos);
+  int _btf_pwritev(BTFIO *fio, struct iovec *iov, int iovcnt, off_t pos);
+  int _btf_rw(BTFIO *fio, const int iotype, off_t pos,
+    const struct iovec **iov, int *iovcnt, size_t *skip, size_t len);
+  int _btf_io(const struct iovec *iov, int iovcnt, const int iotype,
+    dt_datalen_t off, bt_length_t len);
+  void _btf_unmap(BTFILE *pbf);
+  int _btf_unmap_oldest();
+  int _btf_path(const BTFILE *pbf, char *fn) const;
+  int _btf_index();
+  dt_count_t _btf_search(dt_datalen_t off) const;
+  BTFILE *_btf_locate(dt_datalen_t off) const;
+  BTFILE *_btf_real(dt_datalen_t off) const;
+  BTFILE *_btf_find(dt_datalen_t off) const;
+  void _btf_index_add(BTFILE *pbf);
+  void _btf_index_remove(BTFILE *pbf);
   int ExtendFile(BTFILE *pbf);
+  int _btf_allocate(BTFILE *pbf, dt_datalen_t newsize);
+  void AllocResult(btAllocJob *job);
   int _btf_ftruncate(int fd, dt_datalen_t length);
   int _btf_destroy();
   int _btf_recurses_directory(const char *cur_path, BTFILE **plastnode);
   int ConvertFilename(char *dst, const char *src, int size);
   int MergeStaging(BTFILE *dst);
+  int _btf_merge_open(BTFILE *dst, off_t *srcpos, dt_datalen_t *len);
+  void _btf_merge_failed(BTFILE *dst);
+  int _btf_merge_start(BTFILE *dst);
+  int _btf_merge_finish(BTFILE *dst);
+  void MergeResult(btMergeJob *job);
   int MergeAny(){ return FindAndMerge(0, 1); }
-  int FindAndMerge(int findall, int dostaging=0);
+  int FindAndMerge(int findall, int dostaging=0, int background=0);
   int ExtendAll();
   int MkPath(const char *pathname);
 
@@ -98,6 +214,13 @@ class btFiles
   int SetupFiles(const char *torrentid, bool check_only);
   int CreateFiles();
   void CloseFile(dt_count_t nfile);
+  void CloseExcess();
+  void SetWritable(bool writable){ m_flag_writable = writable ? 1 : 0; }
+  void SetDirect(bool direct);
+  void Advise(dt_datalen_t off, dt_datalen_t len, dt_advice_t advice);
+  void Report();
+  dt_count_t Opens() const { return m_opens; }
+  dt_count_t Closes() const { return m_closes; }
 
   btFiles();
   ~btFiles();
@@ -109,7 +232,15 @@ class btFiles
   const char *GetDataName() const;
   dt_datalen_t GetTotalLength() const { return m_total_files_length; }
   int IO(char *rbuf, const char *wbuf, dt_datalen_t off, bt_length_t len);
+  int ReadV(const struct iovec *iov, int iovcnt, dt_datalen_t off);
+  int WriteV(const struct iovec *iov, int iovcnt, dt_datalen_t off);
+  const char *Map(dt_datalen_t off, bt_length_t len, bool prefetch);
+  void UnmapAll();
   int FillMetaInfo(FILE *fp);
+  int FindHoles(Bitfield *pHoles, bt_length_t pieceLength);
+  int FillResume(FILE *fp);
+  int CheckResume(const char *b, size_t len, Bitfield *pChanged,
+    bt_length_t pieceLength);
 
   void SetFilter(dt_count_t nfile, Bitfield *pFilter, bt_length_t pieceLength);
 
@@ -119,7 +250,8 @@ class btFiles
   bt_index_t GetFilePieces(dt_count_t nfile) const;
 
   int NeedMerge() const;
-  int MergeNext(){ return FindAndMerge(0); }
+  int MergeNext(){ return FindAndMerge(0, 0, 1); }
+  bool Merging() const { return m_merge_job ? true : false; }
   int MergeAll(){ return FindAndMerge(1); }
   bt_index_t ChoosePiece(const Bitfield &choices, const Bitfield &available,
     bt_index_t preference) const;
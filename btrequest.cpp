@@ -627,16 +627,26 @@ bool RequestQueue::PeekSend(bt_index_t *pidx, bt_offset_t *poff,
 }
 
 
+// Queue the slices of a piece that have not already been received.
 int RequestQueue::AddPiece(bt_index_t idx)
 {
   bt_offset_t off = 0;
   bt_length_t len, remain;
+  bool added = false;
 
   for( remain = BTCONTENT.GetPieceLength(idx); remain; remain -= len ){
     len = (remain < *cfg_req_slice_size) ? remain : *cfg_req_slice_size;
-    if( !Add(idx, off, len) ) return -1;
+    if( !BTCONTENT.PartialHas(idx, off, len) ){
+      if( !Add(idx, off, len) ) return -1;
+      added = true;
+    }
     off += len;
   }
+  if( !added ){
+    // Everything was received, yet the piece is not complete; start over.
+    BTCONTENT.PartialReset(idx);
+    return AddPiece(idx);
+  }
   return 0;
 }
 
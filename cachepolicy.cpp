@@ -0,0 +1,224 @@
+#include "cachepolicy.h"  // def.h
+
+#include "console.h"
+
+#define A1_SHARE      4     // A1 may hold 1/A1_SHARE of the cached data
+#define A1OUT_UNIT    16384 // one remembered piece per this much cache
+
+
+btCachePolicy *NewCachePolicy(dt_cachepolicy_t policy)
+{
+  switch( policy ){
+    case DT_CACHE_2Q:
+      return new btCache2Q;
+    case DT_CACHE_LRU:
+    default:
+      return new btCacheLRU;
+  }
+}
+
+const char *CachePolicyName(int policy)
+{
+  switch( policy ){
+    case DT_CACHE_LRU:
+      return "LRU";
+    case DT_CACHE_2Q:
+      return "2Q";
+    default:
+      return "Unknown";
+  }
+}
+
+
+btCachePolicy::btCachePolicy()
+{
+  m_piece_length = 0;
+  m_hits = m_misses = 0;
+}
+
+inline bt_index_t btCachePolicy::PieceOf(const BTCACHE *p) const
+{
+  return (bt_index_t)(p->bc_off / m_piece_length);
+}
+
+void btCachePolicy::Unlink(BTCACHE *p, BTCACHE **head, BTCACHE **tail)
+{
+  if( *head == p ) *head = p->age_next;
+  else p->age_prev->age_next = p->age_next;
+  if( *tail == p ) *tail = p->age_prev;
+  else p->age_next->age_prev = p->age_prev;
+}
+
+void btCachePolicy::Append(BTCACHE *p, BTCACHE **head, BTCACHE **tail)
+{
+  p->age_next = (BTCACHE *)0;
+  if( *tail ){
+    p->age_prev = *tail;
+    (*tail)->age_next = p;
+  }else{
+    p->age_prev = (BTCACHE *)0;
+    *head = p;
+  }
+  *tail = p;
+}
+
+//===========================================================================
+
+btCacheLRU::btCacheLRU()
+{
+  m_oldest = m_newest = (BTCACHE *)0;
+}
+
+void btCacheLRU::Insert(BTCACHE *p, bool)
+{
+  p->bc_f_hot = p->bc_f_ref = 0;
+  Append(p, &m_oldest, &m_newest);
+}
+
+void btCacheLRU::Touch(BTCACHE *p, bool read)
+{
+  if( read || m_newest == p ) return;
+  Unlink(p, &m_oldest, &m_newest);
+  Append(p, &m_oldest, &m_newest);
+}
+
+void btCacheLRU::Remove(BTCACHE *p, bool)
+{
+  Unlink(p, &m_oldest, &m_newest);
+}
+
+BTCACHE *btCacheLRU::Next(const BTCACHE *p) const
+{
+  return p->age_next;
+}
+
+//===========================================================================
+
+btCache2Q::btCache2Q()
+{
+  m_a1_head = m_a1_tail = m_am_head = m_am_tail = (BTCACHE *)0;
+  m_a1_bytes = m_am_bytes = 0;
+  m_a1_first = true;
+  m_out = (bt_index_t *)0;
+  m_out_size = m_out_next = m_out_count = 0;
+  m_out_set = (Bitfield *)0;
+}
+
+btCache2Q::~btCache2Q()
+{
+  if( m_out ) delete []m_out;
+  if( m_out_set ) delete m_out_set;
+}
+
+void btCache2Q::Configure(bt_index_t npieces, bt_length_t piece_length,
+  dt_mem_t size)
+{
+  bt_index_t want = size / A1OUT_UNIT;
+
+  m_piece_length = piece_length;
+  if( want > npieces ) want = npieces;
+  if( want < 1 ) want = 1;
+  if( want == m_out_size ) return;
+
+  if( m_out ) delete []m_out;
+  if( !m_out_set ) m_out_set = new Bitfield(npieces);
+  else m_out_set->Clear();
+  m_out = new bt_index_t[want];
+#ifndef WINDOWS
+  if( !m_out || !m_out_set ){
+    CONSOLE.Warning(2, "warn, unable to allocate cache policy history");
+    if( m_out ) delete []m_out;
+    m_out = (bt_index_t *)0;
+    want = 0;
+  }
+#endif
+  m_out_size = want;
+  m_out_next = m_out_count = 0;
+}
+
+// Drop the oldest remembered piece.
+void btCache2Q::Forget()
+{
+  bt_index_t oldest;
+
+  oldest = (m_out_next + m_out_size - m_out_count) % m_out_size;
+  m_out_set->UnSet(m_out[oldest]);
+  m_out_count--;
+}
+
+void btCache2Q::Remember(bt_index_t idx)
+{
+  if( !m_out_size || m_out_set->IsSet(idx) ) return;
+  if( m_out_count == m_out_size ) Forget();
+  m_out[m_out_next] = idx;
+  m_out_next = (m_out_next + 1) % m_out_size;
+  m_out_count++;
+  m_out_set->Set(idx);
+}
+
+void btCache2Q::Insert(BTCACHE *p, bool read)
+{
+  p->bc_f_ref = read ? 1 : 0;
+  if( m_out_size && m_out_set->IsSet(PieceOf(p)) ){
+    p->bc_f_hot = 1;
+    Append(p, &m_am_head, &m_am_tail);
+    m_am_bytes += p->bc_len;
+  }else{
+    p->bc_f_hot = 0;
+    Append(p, &m_a1_head, &m_a1_tail);
+    m_a1_bytes += p->bc_len;
+  }
+}
+
+void btCache2Q::Touch(BTCACHE *p, bool)
+{
+  if( p->bc_f_hot ) Renew(p);
+  else if( !p->bc_f_ref ) p->bc_f_ref = 1;  // the use that came with loading
+  else{
+    Unlink(p, &m_a1_head, &m_a1_tail);
+    m_a1_bytes -= p->bc_len;
+    p->bc_f_hot = 1;
+    Append(p, &m_am_head, &m_am_tail);
+    m_am_bytes += p->bc_len;
+  }
+}
+
+// Not a reference; just keep the data from expiring soon.
+void btCache2Q::Renew(BTCACHE *p)
+{
+  if( p->bc_f_hot ){
+    if( m_am_tail != p ){
+      Unlink(p, &m_am_head, &m_am_tail);
+      Append(p, &m_am_head, &m_am_tail);
+    }
+  }else if( m_a1_tail != p ){
+    Unlink(p, &m_a1_head, &m_a1_tail);
+    Append(p, &m_a1_head, &m_a1_tail);
+  }
+}
+
+void btCache2Q::Remove(BTCACHE *p, bool evicted)
+{
+  if( p->bc_f_hot ){
+    Unlink(p, &m_am_head, &m_am_tail);
+    m_am_bytes -= p->bc_len;
+  }else{
+    Unlink(p, &m_a1_head, &m_a1_tail);
+    m_a1_bytes -= p->bc_len;
+    if( evicted ) Remember(PieceOf(p));
+  }
+}
+
+BTCACHE *btCache2Q::First() const
+{
+  m_a1_first = !m_am_head ||
+    (m_a1_head && m_a1_bytes * A1_SHARE > m_a1_bytes + m_am_bytes);
+  return m_a1_first ? m_a1_head : m_am_head;
+}
+
+BTCACHE *btCache2Q::Next(const BTCACHE *p) const
+{
+  if( p->age_next ) return p->age_next;
+  if( p->bc_f_hot ) return m_a1_first ? (BTCACHE *)0 : m_a1_head;
+  return m_a1_first ? m_am_head : (BTCACHE *)0;
+}
@@ -0,0 +1,138 @@
+#ifndef CACHEPOLICY_H
+#define CACHEPOLICY_H
+
+#include "def.h"
+#include <sys/types.h>
+
+#include "bttypes.h"
+#include "bitfield.h"
+
+typedef struct _btcache{
+  dt_datalen_t bc_off;
+  bt_length_t bc_len;
+
+  unsigned char bc_f_flush:1;
+  unsigned char bc_f_free:1;  // arena space on a free list
+  unsigned char bc_f_hot:1;   // on the policy's main list
+  unsigned char bc_f_ref:1;   // referenced since it was loaded
+  unsigned char bc_f_busy:1;  // being written by the flusher
+  unsigned char bc_f_load:1;  // being read in by a reader thread
+  unsigned char bc_f_reserved:1;
+  unsigned char bc_order;     // arena space of CACHE_UNIT << bc_order
+
+  char *bc_buf;
+
+  struct _btcache *bc_next;
+  struct _btcache *bc_prev;
+  struct _btcache *age_next;  // lists kept by the cache policy
+  struct _btcache *age_prev;
+}BTCACHE;
+
+enum dt_cachepolicy_t{
+  DT_CACHE_LRU = 0,
+  DT_CACHE_2Q  = 1,
+  DT_CACHE_NPOLICIES
+};
+
+
+/* Decides which cache entries to expire first.  The policy keeps every
+   entry on its own lists (using the age links) and presents them in
+   eviction order through First() and Next().  Entries that can't be
+   expired yet (unflushed data) are simply skipped by the caller. */
+class btCachePolicy
+{
+ protected:
+  bt_length_t m_piece_length;
+  dt_count_t m_hits, m_misses;
+
+  bt_index_t PieceOf(const BTCACHE *p) const;
+  void Unlink(BTCACHE *p, BTCACHE **head, BTCACHE **tail);
+  void Append(BTCACHE *p, BTCACHE **head, BTCACHE **tail);
+
+ public:
+  btCachePolicy();
+  virtual ~btCachePolicy(){}
+
+  virtual const char *Name() const = 0;
+  virtual void Configure(bt_index_t, bt_length_t piece_length, dt_mem_t){
+    m_piece_length = piece_length;
+  }
+
+  // read is true when the data was read from disk to be sent right away.
+  virtual void Insert(BTCACHE *p, bool read) = 0;
+  // read is true when the data is being sent rather than prefetched.
+  virtual void Touch(BTCACHE *p, bool read) = 0;
+  // The data was received again, or its piece was just completed.
+  virtual void Renew(BTCACHE *p) = 0;
+  // evicted is false if the data was discarded for some other reason.
+  virtual void Remove(BTCACHE *p, bool evicted) = 0;
+  virtual BTCACHE *First() const = 0;
+  virtual BTCACHE *Next(const BTCACHE *p) const = 0;
+
+  void CountHits(dt_count_t n){ m_hits += n; }
+  void CountMisses(dt_count_t n){ m_misses += n; }
+  dt_count_t Hits() const { return m_hits; }
+  dt_count_t Misses() const { return m_misses; }
+};
+
+
+// Least recently used; prefetching or receiving data makes it new again.
+class btCacheLRU : public btCachePolicy
+{
+ private:
+  BTCACHE *m_oldest, *m_newest;
+
+ public:
+  btCacheLRU();
+
+  const char *Name() const { return "LRU"; }
+  void Insert(BTCACHE *p, bool read);
+  void Touch(BTCACHE *p, bool read);
+  void Renew(BTCACHE *p){ Touch(p, false); }
+  void Remove(BTCACHE *p, bool evicted);
+  BTCACHE *First() const { return m_oldest; }
+  BTCACHE *Next(const BTCACHE *p) const;
+};
+
+
+/* 2Q: new data goes on a FIFO probation queue (A1) and only moves to the
+   LRU main queue (Am) when it is referenced again.  The reference that goes
+   with loading the data (the send after a prefetch) does not count.  Pieces
+   recently evicted from A1 are remembered (A1out), and data for them goes
+   straight to Am.  A1 is expired first while it holds more than its share,
+   so a sequential sweep can't push out data that is used repeatedly. */
+class btCache2Q : public btCachePolicy
+{
+ private:
+  BTCACHE *m_a1_head, *m_a1_tail;  // oldest first
+  BTCACHE *m_am_head, *m_am_tail;  // least recently used first
+  dt_mem_t m_a1_bytes, m_am_bytes;
+  mutable bool m_a1_first;  // eviction order chosen by First()
+
+  bt_index_t *m_out;  // ring of pieces recently evicted from A1
+  bt_index_t m_out_size, m_out_next, m_out_count;
+  Bitfield *m_out_set;
+
+  void Forget();
+  void Remember(bt_index_t idx);
+
+ public:
+  btCache2Q();
+  ~btCache2Q();
+
+  const char *Name() const { return "2Q"; }
+  void Configure(bt_index_t npieces, bt_length_t piece_length,
+    dt_mem_t size);
+  void Insert(BTCACHE *p, bool read);
+  void Touch(BTCACHE *p, bool read);
+  void Renew(BTCACHE *p);
+  void Remove(BTCACHE *p, bool evicted);
+  BTCACHE *First() const;
+  BTCACHE *Next(const BTCACHE *p) const;
+};
+
+
+btCachePolicy *NewCachePolicy(dt_cachepolicy_t policy);
+const char *CachePolicyName(int policy);
+
+#endif  // CACHEPOLICY_H
@@ -25,6 +25,8 @@
 #include "util.h"
 #include "bttime.h"
 #include "sigint.h"
+#include "workpool.h"
+#include "scheduler.h"
 
 #if !defined(HAVE_VSNPRINTF) || !defined(HAVE_SNPRINTF) || \
     !defined(HAVE_STRCASECMP)
@@ -1468,13 +1470,26 @@ void Console::Status(int immediate)
         m_status_last = 1;
       }
       if( *cfg_verbose && !m_channels[DT_CHAN_DEBUG].IsSuspended() ){
-        Debug("Cache: %dK/%dM  Hits: %d  Miss: %d  %d%%  Pre: %d/%d",
+        Debug("Cache: %dK/%dM  Hits: %d  Miss: %d  %d%%  Pre: %d/%d"
+          "  Arena: %d/%d  Probe: %.1f/%.1f",
           (int)(BTCONTENT.CacheUsed()/1024), (int)*cfg_cache_size,
           (int)BTCONTENT.CacheHits(), (int)BTCONTENT.CacheMiss(),
           BTCONTENT.CacheHits() ? (int)(100 * BTCONTENT.CacheHits() /
             (BTCONTENT.CacheHits()+BTCONTENT.CacheMiss())) : 0,
           (int)BTCONTENT.CachePre(),
-            (int)(Self.TotalUL() / DEFAULT_SLICE_SIZE));
+            (int)(Self.TotalUL() / DEFAULT_SLICE_SIZE),
+          (int)(BTCONTENT.CacheUnits() - BTCONTENT.CacheUnitsFree()),
+          (int)BTCONTENT.CacheUnits(), BTCONTENT.CacheProbes(),
+          BTCONTENT.CacheWalks());
+        if( *cfg_scrub_rate ){
+          Debug("Scrub: %d pieces  %dK/s  Bad: %d  Passes: %d",
+            (int)BTCONTENT.ScrubbedPieces(),
+            (int)(BTCONTENT.ScrubRate() >> 10),
+            (int)BTCONTENT.ScrubFailures(), (int)BTCONTENT.ScrubPasses());
+        }
+        char tasks[160];
+        SCHEDULER.Report(tasks, sizeof(tasks));
+        Debug("%s", tasks);
         m_channels[DT_CHAN_DEBUG].Clear();
       }
     }
@@ -1504,10 +1519,13 @@ void Console::StatusLine0(char buffer[], size_t length)
       (int)(BTCONTENT.GetNPieces() - BTCONTENT.GetFilter()->Count()) );
   }
 
-  char checked[14] = "";
+  char checked[24] = "";
   if( BTCONTENT.CheckedPieces() < BTCONTENT.GetNPieces() ){
     sprintf( checked, "Checking: %d%%",
       (int)(100 * BTCONTENT.CheckedPieces() / BTCONTENT.GetNPieces()) );
+  }else if( BTCONTENT.Scrubbing() ){
+    snprintf(checked, sizeof(checked), "Scrub: %d%% %dK/s",
+      BTCONTENT.ScrubProgress(), (int)(BTCONTENT.ScrubRate() >> 10));
   }
 
   snprintf(buffer, length,
@@ -1573,10 +1591,13 @@ void Console::StatusLine1(char buffer[], size_t length)
   }
 
 
-  char checked[14] = "";
+  char checked[24] = "";
   if( BTCONTENT.CheckedPieces() < BTCONTENT.GetNPieces() ){
     sprintf(checked, "Checking: %d%%",
       (int)(100 * BTCONTENT.CheckedPieces() / BTCONTENT.GetNPieces()));
+  }else if( BTCONTENT.Scrubbing() ){
+    snprintf(checked, sizeof(checked), "Scrub: %d%% %dK/s",
+      BTCONTENT.ScrubProgress(), (int)(BTCONTENT.ScrubRate() >> 10));
   }
 
   char complete[8];
@@ -2008,6 +2029,11 @@ void Console::Daemonize()
     cfg_cache_size /= 2;
   }
 
+  // Threads are not inherited; finish any work before forking.
+  WORKERS.Stop();
+  FLUSHER.Stop();
+  READER.Stop();
+
   if( (r = fork()) < 0 ){
     Warning(2, "warn, fork to background failed:  %s", strerror(errno));
     cfg_daemon = false;
@@ -22,6 +22,8 @@
 #include "tracker.h"
 #include "ctcs.h"
 #include "console.h"
+#include "workpool.h"
+#include "sha1.h"
 
 #include "config.h"
 #include "util.h"
@@ -87,7 +89,10 @@ int main(int argc, char **argv)
     Exit(EXIT_SUCCESS);
   }
 
-  if( *cfg_verbose ) CONFIG.Dump();
+  if( *cfg_verbose ){
+    CONFIG.Dump();
+    CONSOLE.Debug("SHA-1 routine:  %s", Sha1Backend());
+  }
   cfg_daemon = arg_daemon;  // triggers action
 
   if( BTCONTENT.InitialFromMI(arg_metainfo_file, arg_save_as,
@@ -111,8 +116,11 @@ int main(int argc, char **argv)
       "Press 'h' or '?' for help (display/control client options)." );
 
     Downloader();
+    WORKERS.Stop();
+    READER.Stop();
     WORLD.CloseAll();
     if( *cfg_cache_size ) BTCONTENT.FlushCache();
+    FLUSHER.Stop();
     if( BTCONTENT.NeedMerge() ){
       CONSOLE.Interact_n();
       CONSOLE.Interact_n("Merging staged data");
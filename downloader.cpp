@@ -22,6 +22,8 @@
 #include "btconfig.h"
 #include "console.h"
 #include "bttime.h"
+#include "workpool.h"
+#include "scheduler.h"
 
 #define MAX_SLEEP 1
 
@@ -31,7 +33,8 @@ bool g_disk_access = false;
 void Downloader()
 {
   int nfds = 0, maxfd;
-  int maxfd_tracker, maxfd_ctcs, maxfd_console, maxfd_peer;
+  int maxfd_tracker, maxfd_ctcs, maxfd_console, maxfd_peer, maxfd_workers;
+  int maxfd_flusher, maxfd_reader;
   struct timeval timeout;
   fd_set rfd, rfdnext;
   fd_set wfd, wfdnext;
@@ -59,7 +62,8 @@ void Downloader()
     maxsleep = -1;
     rfd = rfdnext;
     wfd = wfdnext;
-    maxfd_tracker = maxfd_ctcs = maxfd_console = -1;
+    maxfd_tracker = maxfd_ctcs = maxfd_console = maxfd_workers = -1;
+    maxfd_flusher = maxfd_reader = -1;
 
     if( f_poll ){
       FD_ZERO(&rfd);
@@ -75,32 +79,20 @@ void Downloader()
       }
       maxfd_console = CONSOLE.IntervalCheck(&rfd, &wfd);
       if( maxfd_console > maxfd ) maxfd = maxfd_console;
-      if( WORLD.IsIdle() ){
-        if( BTCONTENT.CheckedPieces() < BTCONTENT.GetNPieces() &&
-            !BTCONTENT.NeedFlush() ){
-          if( BTCONTENT.CheckNextPiece() < 0 ){
-            CONSOLE.Warning(1, "Error while checking piece %d of %d",
-              (int)BTCONTENT.CheckedPieces(), (int)BTCONTENT.GetNPieces());
-            TRACKER.Stop();
-            maxsleep = 2;
-          }
-          CheckTime();
-        }
-      }
     }
     maxfd_peer = WORLD.IntervalCheck(&rfd, &wfd);
     if( maxfd_peer > maxfd ) maxfd = maxfd_peer;
 
     if( !f_poll ){
       UpdateTime();
-      while( BTCONTENT.NeedFlush() && WORLD.IsIdle() ){
-        BTCONTENT.FlushQueue();
-        CheckTime();
-      }
-      while( BTCONTENT.NeedMerge() && WORLD.IsIdle() ){
-        BTCONTENT.MergeNext();
-        CheckTime();
-      }
+      if( SCHEDULER.Run(WORLD.IsIdle()) < 0 ) maxsleep = 2;
+      // after any jobs have been submitted
+      maxfd_workers = WORKERS.IntervalCheck(&rfd, &wfd);
+      if( maxfd_workers > maxfd ) maxfd = maxfd_workers;
+      maxfd_flusher = FLUSHER.IntervalCheck(&rfd, &wfd);
+      if( maxfd_flusher > maxfd ) maxfd = maxfd_flusher;
+      maxfd_reader = READER.IntervalCheck(&rfd, &wfd);
+      if( maxfd_reader > maxfd ) maxfd = maxfd_reader;
     }
 
     rfdnext = rfd;
@@ -108,6 +100,8 @@ void Downloader()
 
     if( g_disk_access && WORLD.IdleState() == DT_IDLE_POLLING ){
       maxsleep = 0;
+    }else if( maxsleep < 0 && SCHEDULER.Busy() ){  // more work to do
+      maxsleep = 0;
     }else if( maxsleep < 0 ){  // not yet set
       maxsleep = WORLD.WaitBW();  // must do after intervalchecks!
       if( maxsleep <= -100 ) maxsleep = 0;
@@ -117,7 +111,9 @@ void Downloader()
     timeout.tv_sec = (long)maxsleep;
     timeout.tv_usec = (long)((maxsleep - (long)maxsleep) * 1000000);
 
+    SCHEDULER.Sleep();
     nfds = select(maxfd + 1, &rfd, &wfd, (fd_set *)0, &timeout);
+    SCHEDULER.Wake();
     if( nfds < 0 ){
       CONSOLE.Debug("Error from select:  %s", strerror(errno));
       FD_ZERO(&rfdnext);
@@ -131,6 +127,10 @@ void Downloader()
 
     UpdateTime();
 
+    // Always collect finished work, since its wakeup may have been missed.
+    WORKERS.SocketReady(&rfd, &wfd, &nfds, &rfdnext, &wfdnext);
+    FLUSHER.SocketReady(&rfd, &wfd, &nfds, &rfdnext, &wfdnext);
+    READER.SocketReady(&rfd, &wfd, &nfds, &rfdnext, &wfdnext);
     if( !f_poll && nfds > 0 ){
       if( maxfd_tracker >= 0 )
         TRACKER.SocketReady(&rfd, &wfd, &nfds, &rfdnext, &wfdnext);
@@ -90,6 +90,9 @@ int btPeer::Need_Remote_Data() const
 
 btPeer::btPeer()
 {
+  static dt_count_t serial = 0;
+
+  m_serial = ++serial;
   m_f_keepalive = 0;
   m_status = DT_PEER_CONNECTING;
   m_unchoke_timestamp = (time_t)0;
@@ -207,6 +210,7 @@ int btPeer::RequestPiece()
 
   bf_need = bitfield;
   bf_need.Except(*BTCONTENT.pBF);
+  bf_need.Except(*BTCONTENT.pBVerify);
   bf_need.Except(*BTCONTENT.pBMasterFilter);
   if( m_last_req_piece < BTCONTENT.GetNPieces() && bf_need.Count() > 1 ){
     exclude_last = true;
@@ -228,6 +232,7 @@ int btPeer::RequestPiece()
     do{
       bf_need = bitfield;
       bf_need.Except(*BTCONTENT.pBF);
+      bf_need.Except(*BTCONTENT.pBVerify);
       if( pfilter ){
         bf_need.Except(*pfilter);
         pfilter = BTCONTENT.GetNextFilter(pfilter);
@@ -258,6 +263,7 @@ int btPeer::RequestPiece()
   do{
     bf_need = bitfield;
     bf_need.Except(*BTCONTENT.pBF);
+    bf_need.Except(*BTCONTENT.pBVerify);
     if( pfilter ){
       bf_need.Except(*pfilter);
       pfilter = BTCONTENT.GetNextFilter(pfilter);
@@ -439,6 +445,7 @@ int btPeer::MsgDeliver()
       if( idx >= BTCONTENT.GetNPieces() || bitfield.IsSet(idx) ) return -1;
 
       bitfield.Set(idx);
+      WORLD.PeerHas(idx, true);
 
       if( bitfield.IsFull() ){
         if( BTCONTENT.IsFull() ) return -2;
@@ -463,7 +470,10 @@ int btPeer::MsgDeliver()
 
       idx = get_bt_index(msgbuf + BT_LEN_PRE + BT_LEN_MSGID);
 
-      if( !BTCONTENT.pBF->IsSet(idx) ) return -1;
+      if( !BTCONTENT.pBF->IsSet(idx) ){
+        // We announced it before scrubbing found it bad; not the peer's fault.
+        return BTCONTENT.pBLost->IsSet(idx) ? 0 : -1;
+      }
 
       off = get_bt_offset(msgbuf + BT_LEN_PRE + BT_LEN_MSGID + BT_LEN_IDX);
       len = get_bt_length(msgbuf + BT_LEN_PRE + BT_LEN_MSGID + BT_LEN_IDX +
@@ -501,6 +511,12 @@ int btPeer::MsgDeliver()
               this, (int)m_latency);
           }
         }
+        if( !respond_q.HasPiece(idx) ){
+          // The peer will likely ask for the rest of the piece.
+          BTCONTENT.AdviseSlice(idx, off, BTCONTENT.GetPieceLength(idx) - off,
+            (idx && respond_q.HasPiece(idx - 1)) ? DT_ADVISE_SEQUENTIAL :
+                                                   DT_ADVISE_WILLNEED);
+        }
         retval = respond_q.Add(idx, off, len);
       }
       break;
@@ -516,6 +532,7 @@ int btPeer::MsgDeliver()
       if( msglen - BT_LEN_MSGID != bitfield.NBytes() || !bitfield.IsEmpty() )
         return -1;
       bitfield.SetReferBuffer(msgbuf + BT_LEN_PRE + BT_LEN_MSGID);
+      WORLD.PeerHas(bitfield, true);
       if( bitfield.IsFull() ){
         if(*cfg_verbose) CONSOLE.Debug("%p is a seed (bitfield is full)", this);
         if( BTCONTENT.IsFull() ) return -2;
@@ -567,19 +584,24 @@ int btPeer::RespondSlice()
   int r;
   bt_index_t idx;
   bt_offset_t off;
+  const char *data;
 
   if( !respond_q.Pop(&idx, &off, &len) ){
     CONSOLE.Debug("Nothing to send to peer %p", this);
     return -1;
   }
+  if( !BTCONTENT.pBF->IsSet(idx) ) return 0;  // lost to scrubbing
 
-  if( BTCONTENT.global_buffer_size < len ){
-    delete []BTCONTENT.global_piece_buffer;
-    BTCONTENT.global_piece_buffer = new char[len];
-    BTCONTENT.global_buffer_size = BTCONTENT.global_piece_buffer ? len : 0;
-  }
   g_disk_access = false;
-  r = BTCONTENT.ReadSlice(BTCONTENT.global_piece_buffer, idx, off, len);
+  if( !(data = BTCONTENT.MapSlice(idx, off, len)) ){
+    if( BTCONTENT.global_buffer_size < len ){
+      delete []BTCONTENT.global_piece_buffer;
+      BTCONTENT.global_piece_buffer = new char[len];
+      BTCONTENT.global_buffer_size = BTCONTENT.global_piece_buffer ? len : 0;
+    }
+    r = BTCONTENT.ReadSlice(BTCONTENT.global_piece_buffer, idx, off, len);
+    data = BTCONTENT.global_piece_buffer;
+  }else r = 0;
   CheckTime();
   if( g_disk_access ) Self.OntimeUL(0);  // disk read delay
   if( r < 0 ) return -1;
@@ -609,7 +631,7 @@ int btPeer::RespondSlice()
   m_prefetch_time = (time_t)0;
 
   rightnow = PreciseTime();
-  if( stream.Send_Piece(idx, off, BTCONTENT.global_piece_buffer, len) < 0 ){
+  if( stream.Send_Piece(idx, off, data, len) < 0 ){
     CONSOLE.Debug("%p: %s", this, strerror(errno));
     return -1;
   }else{
@@ -753,31 +775,15 @@ int btPeer::CancelSliceRequest(bt_index_t idx, bt_offset_t off, bt_length_t len)
   return 1;
 }
 
-int btPeer::ReportComplete(bt_index_t idx, bt_length_t len)
+/* The piece is verified in the background; the result is reported through
+   PieceVerified(). */
+int btPeer::ReportComplete(bt_index_t idx)
 {
   int r;
 
-  if( (r = BTCONTENT.APieceComplete(idx)) > 0 ){
-    if(*cfg_verbose) CONSOLE.Debug("Piece #%d completed", (int)idx);
-    PeerError(-1, "Piece completed");
-    WORLD.Tell_World_I_Have(idx);
-    BTCONTENT.CheckFilter();
-    if( BTCONTENT.IsFull() )
-      WORLD.CloseAllConnectionToSeed();
-  }else if( 0 == r ){  // hash check failed
-    /* Don't count an error against the peer in initial or endgame mode, since
-       some slices may have come from other peers. */
-    if( !BTCONTENT.pBMultPeer->IsSet(idx) ){
-      // The entire piece came from this peer.
-      DataUnRec(BTCONTENT.GetPieceLength(idx) - len);
-      if( PeerError(4, "Bad complete") < 0 ) CloseConnection();
-      else{
-        ResetDLTimer();  // set peer rate=0 so we don't favor for upload
-        bitfield.UnSet(idx);  // don't request this piece from this peer again
-      }
-    }
-  }
-  // Need to re-download entire piece if check failed, so cleanup in any case.
+  r = BTCONTENT.APieceComplete(idx, this);
+
+  // The requests are finished whatever the outcome, so clean up.
   m_prefetch_completion = 0;
   if( WORLD.GetDupReqs() && BTCONTENT.pBMultPeer->IsSet(idx) ){
     if( WORLD.CancelPiece(idx) && *cfg_verbose )
@@ -789,6 +795,22 @@ int btPeer::ReportComplete(bt_index_t idx, bt_length_t len)
   return r;
 }
 
+// Called when a piece this peer completed has been verified.
+void btPeer::PieceVerified(bt_index_t idx, bool ok)
+{
+  if( ok ){
+    PeerError(-1, "Piece completed");
+    return;
+  }
+  DataUnRec(BTCONTENT.GetPieceLength(idx));
+  if( PeerError(4, "Bad complete") < 0 ) CloseConnection();
+  else{
+    ResetDLTimer();  // set peer rate=0 so we don't favor for upload
+    bitfield.UnSet(idx);  // don't request this piece from this peer again
+    WORLD.PeerHas(idx, false);
+  }
+}
+
 int btPeer::PieceDeliver(bt_msglen_t mlen)
 {
   bt_index_t idx;
@@ -823,7 +845,7 @@ int btPeer::PieceDeliver(bt_msglen_t mlen)
   if( f_requested || f_accept ){
     if(*cfg_verbose) CONSOLE.Debug("Receiving piece %d/%d/%d from %p",
       (int)idx, (int)off, (int)len, this);
-    if( !BTCONTENT.pBF->IsSet(idx) &&
+    if( !BTCONTENT.pBF->IsSet(idx) && !BTCONTENT.pBVerify->IsSet(idx) &&
         BTCONTENT.WriteSlice(msgbuf + BT_LEN_PRE + BT_MSGLEN_PIECE, idx, off,
           len) < 0 ){
       CONSOLE.Warning(2, "warn, WriteSlice failed; is filesystem full?");
@@ -900,13 +922,14 @@ int btPeer::PieceDeliver(bt_msglen_t mlen)
 
   /* if piece download complete. */
   if( f_success && !BTCONTENT.pBF->IsSet(idx) &&
+      !BTCONTENT.pBVerify->IsSet(idx) &&
       ( (f_requested && (request_q.IsEmpty() || !request_q.HasPiece(idx))) ||
         (f_accept && !WORLD.WhoHas(idx) && !PENDING.HasPiece(idx)) ) ){
     /* Above WriteSlice may have triggered flush failure.  If data was saved,
        slice was deleted from Pending.  If piece is incomplete, it's in
        Pending. */
     if( !(BTCONTENT.FlushFailed() && PENDING.HasPiece(idx)) &&
-        !(f_complete = ReportComplete(idx, len)) ){
+        !(f_complete = ReportComplete(idx)) ){
       f_count = 0;
     }
   }
@@ -147,9 +147,10 @@ class btPeer:public btBasic
   bt_index_t m_haveq[HAVEQ_SIZE];  // need to send HAVE for these pieces
 
   unsigned char m_id[PEER_ID_LEN];
+  dt_count_t m_serial;  // tells apart peers that reuse an address
 
   int PieceDeliver(bt_int_t mlen);
-  int ReportComplete(bt_index_t idx, bt_length_t len);
+  int ReportComplete(bt_index_t idx);
   int RequestCheck();
   int SendRequest();
   int RespondSlice();
@@ -175,6 +176,7 @@ class btPeer:public btBasic
   btPeer();
 
   void CopyStats(btPeer *peer);
+  dt_count_t GetSerial() const { return m_serial; }
 
   int RecvModule();
   int SendModule();
@@ -197,6 +199,7 @@ class btPeer:public btBasic
   int CancelRequest();
   int CancelSliceRequest(bt_index_t idx, bt_offset_t off, bt_length_t len);
   int CancelPiece(bt_index_t idx);
+  void PieceVerified(bt_index_t idx, bool ok);
   bt_index_t FindLastCommonRequest(const Bitfield &proposerbf) const {
     return request_q.FindLastCommonRequest(proposerbf);
   }
@@ -20,6 +20,7 @@
 #include "bttime.h"
 #include "console.h"
 #include "util.h"
+#include "scheduler.h"
 
 #if !defined(HAVE_SNPRINTF) || !defined(HAVE_NTOHS) || !defined(HAVE_HTONS)
 #include "compat.h"
@@ -51,12 +52,13 @@ PeerList::PeerList()
   m_head = m_dead = m_next_dl = m_next_ul = (PEERNODE *)0;
   m_listen_sock = INVALID_SOCKET;
   m_peers_count = m_seeds_count = m_conn_count = m_downloads = 0;
-  m_f_pause = m_endgame = 0;
+  m_f_pause = m_endgame = m_f_flushwait = 0;
   m_max_unchoke = MIN_UNCHOKES;
   m_defer_count = m_missed_count = 0;
   m_upload_count = m_up_opt_count = 0;
   m_prev_limit_up = *cfg_max_bandwidth_up;
   m_dup_req_pieces = 0;
+  m_piece_peers = (dt_count_t *)0;
   m_readycnt = 0;
   m_nset = 0;
 }
@@ -74,10 +76,16 @@ PeerList::~PeerList()
     delete p->peer;
     delete p;
   }
+  if( m_piece_peers ) delete []m_piece_peers;
 }
 
 int PeerList::Init()
 {
+  if( (m_piece_peers = new dt_count_t[BTCONTENT.GetNPieces()]) ){
+    memset(m_piece_peers, 0,
+      BTCONTENT.GetNPieces() * sizeof(dt_count_t));
+  }
+
   cfg_default_port.Lock();
   cfg_default_port.Hide();
   m_max_listen_port = *cfg_default_port;
@@ -95,6 +103,8 @@ void PeerList::CloseAll()
     delete (p->peer);
     delete p;
   }
+  if( m_piece_peers )
+    memset(m_piece_peers, 0, BTCONTENT.GetNPieces() * sizeof(dt_count_t));
 }
 
 int PeerList::NewPeer(struct sockaddr_in addr, SOCKET sk)
@@ -311,6 +321,7 @@ int PeerList::FillFDSet(fd_set *rfdp, fd_set *wfdp, int f_keepalive_check,
 
   m_f_limitu = BandwidthLimitUp(Self.LateUL());
   m_f_limitd = BandwidthLimitDown(Self.LateDL());
+  m_f_flushwait = BTCONTENT.FlushBehind() ? 1 : 0;
   if( *cfg_cache_size && !m_f_pause )
     f_idle = IsIdle();
 
@@ -336,6 +347,7 @@ int PeerList::FillFDSet(fd_set *rfdp, fd_set *wfdp, int f_keepalive_check,
       }
       if( pp ) pp->next = p->next;
       else m_head = p->next;
+      PeerHas(peer->bitfield, false);
       if( peer->TotalDL() || peer->TotalUL() ){  // keep stats
         peer->SetLastTimestamp();
         p->next = m_dead;
@@ -383,7 +395,7 @@ int PeerList::FillFDSet(fd_set *rfdp, fd_set *wfdp, int f_keepalive_check,
 
       if( maxfd < sk ) maxfd = sk;
       if( FD_ISSET(sk, rfdp) ) m_nset++;
-      else if( peer->NeedRead((int)m_f_limitd) ){
+      else if( peer->NeedRead((int)(m_f_limitd || m_f_flushwait)) ){
         FD_SET(sk, rfdp);
         m_nset++;
       }
@@ -393,8 +405,10 @@ int PeerList::FillFDSet(fd_set *rfdp, fd_set *wfdp, int f_keepalive_check,
         m_nset++;
       }
 
-      if( *cfg_cache_size && !m_f_pause && f_idle && peer->NeedPrefetch() ){
+      if( *cfg_cache_size && !m_f_pause && f_idle && peer->NeedPrefetch() &&
+          SCHEDULER.Begin(DT_TASK_PREFETCH) ){
         peer->Prefetch(m_unchoke_check_timestamp + m_unchoke_interval);
+        SCHEDULER.End();
         if( g_disk_access ) f_idle = IsIdle();
       }
 
@@ -1002,6 +1016,29 @@ void PeerList::CheckBitfield(Bitfield &bf) const
   }
 }
 
+/* Keep count of how many connected peers have each piece, as peers report
+   pieces and as they leave. */
+void PeerList::PeerHas(bt_index_t idx, bool has)
+{
+  if( !m_piece_peers ) return;
+  if( has ) m_piece_peers[idx]++;
+  else if( m_piece_peers[idx] ) m_piece_peers[idx]--;
+}
+
+void PeerList::PeerHas(const Bitfield &bf, bool has)
+{
+  if( !m_piece_peers || bf.IsEmpty() ) return;
+  for( bt_index_t idx = 0; idx < BTCONTENT.GetNPieces(); idx++ )
+    if( bf.IsSet(idx) ) PeerHas(idx, has);
+}
+
+// How many connected peers don't have the piece.
+dt_count_t PeerList::PieceNeed(bt_index_t idx) const
+{
+  if( !m_piece_peers || m_piece_peers[idx] >= m_peers_count ) return 0;
+  return m_peers_count - m_piece_peers[idx];
+}
+
 void PeerList::PrintOut() const
 {
   PEERNODE *p = m_head;
@@ -1342,6 +1379,16 @@ void PeerList::CheckInterest()
   }
 }
 
+// The serial number identifies the peer if another has since taken its place.
+int PeerList::IsPeer(const btPeer *peer, dt_count_t serial) const
+{
+  PEERNODE *p;
+
+  for( p = m_head; p; p = p->next )
+    if( p->peer == peer ) return (p->peer->GetSerial() == serial) ? 1 : 0;
+  return 0;
+}
+
 btPeer *PeerList::GetNextPeer(const btPeer *peer) const
 {
   static PEERNODE *p = m_head;
@@ -33,6 +33,7 @@ class PeerList
   time_t m_unchoke_interval, m_opt_interval;
   dt_count_t m_defer_count, m_missed_count, m_upload_count, m_up_opt_count;
   dt_count_t m_dup_req_pieces;
+  dt_count_t *m_piece_peers;  // connected peers that have each piece
   dt_rate_t m_prev_limit_up;
   char m_listen[22];
   dt_count_t m_readycnt;  // cumulative count of ready peers
@@ -45,7 +46,8 @@ class PeerList
   unsigned char m_f_limitd:1;
   unsigned char m_f_limitu:1;
   unsigned char m_endgame:1;
-  unsigned char m_reserved:3;
+  unsigned char m_f_flushwait:1;  // waiting for the cache to be written
+  unsigned char m_reserved:2;
 
   int InitialListenPort();
   int Accepter();
@@ -125,9 +127,13 @@ class PeerList
   void CancelOneRequest(bt_index_t idx);
 
   void CheckBitfield(Bitfield &bf) const;
+  void PeerHas(bt_index_t idx, bool has);
+  void PeerHas(const Bitfield &bf, bool has);
+  dt_count_t PieceNeed(bt_index_t idx) const;
   bt_index_t Pieces_I_Can_Get(Bitfield *ptmpBitfield=(Bitfield *)0) const;
   void CheckInterest();
   btPeer *GetNextPeer(const btPeer *peer) const;
+  int IsPeer(const btPeer *peer, dt_count_t serial) const;
   int Endgame();
   void UnStandby();
 
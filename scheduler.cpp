@@ -0,0 +1,232 @@
+#include "scheduler.h"  // def.h
+
+#include <stdio.h>
+#include <string.h>
+
+#include "btcontent.h"
+#include "tracker.h"
+#include "console.h"
+#include "bttime.h"
+#include "util.h"
+
+
+Scheduler SCHEDULER;
+
+
+static dt_count_t FlushDepth()
+{
+  dt_count_t n;
+
+  if( !BTCONTENT.NeedFlush() ) return 0;
+  n = BTCONTENT.FlushQueueLength();
+  return n ? n : 1;  // cache is full
+}
+
+static int FlushStep()
+{
+  BTCONTENT.FlushQueue();
+  return 1;
+}
+
+static dt_count_t CheckDepth()
+{
+  if( BTCONTENT.NeedFlush() ) return 0;
+  return BTCONTENT.GetNPieces() - BTCONTENT.CheckedPieces();
+}
+
+static int CheckStep()
+{
+  int r;
+
+  if( (r = BTCONTENT.CheckNextPiece()) < 0 ){
+    CONSOLE.Warning(1, "Error while checking piece %d of %d",
+      (int)BTCONTENT.CheckedPieces(), (int)BTCONTENT.GetNPieces());
+    TRACKER.Stop();
+  }
+  return r;
+}
+
+static dt_count_t MergeDepth()
+{
+  return (BTCONTENT.NeedMerge() && !BTCONTENT.FlushFailed() &&
+          !BTCONTENT.Merging()) ? 1 : 0;
+}
+
+static int MergeStep()
+{
+  BTCONTENT.MergeNext();
+  return 1;
+}
+
+static dt_count_t ScrubDepth()
+{
+  return (BTCONTENT.Scrubbing() && !BTCONTENT.NeedFlush()) ? 1 : 0;
+}
+
+static int ScrubStep()
+{
+  int r;
+
+  if( (r = BTCONTENT.ScrubNext()) < 0 ){
+    CONSOLE.Warning(2, "warn, failed to allocate memory for scrubbing");
+    r = 0;
+  }
+  return r;
+}
+
+
+Scheduler::Scheduler()
+{
+  static const struct{
+    const char *name;
+    int share;
+    dt_count_t (*depth)();
+    int (*step)();
+  } tasks[DT_NTASKS] = {
+    { "flush",    40, FlushDepth, FlushStep },
+    { "check",    25, CheckDepth, CheckStep },
+    { "prefetch", 20, 0,          0 },  // run by peers, see Begin()
+    { "merge",    10, MergeDepth, MergeStep },
+    { "scrub",     5, ScrubDepth, ScrubStep }
+  };
+
+  for( int i=0; i < DT_NTASKS; i++ ){
+    m_tasks[i].name = tasks[i].name;
+    m_tasks[i].share = tasks[i].share;
+    m_tasks[i].depth = tasks[i].depth;
+    m_tasks[i].step = tasks[i].step;
+    m_tasks[i].last_run = m_tasks[i].spent = m_tasks[i].used = 0;
+    m_tasks[i].queued = m_tasks[i].asked = 0;
+  }
+  m_budget = TASK_LATENCY;
+  m_wake = m_used = m_fg_avg = m_report_time = m_started = 0;
+  m_loops = 0;
+  m_busy = false;
+  m_current = DT_NTASKS;
+}
+
+
+// The main loop has woken from select().
+void Scheduler::Wake()
+{
+  m_wake = PreciseTime();
+}
+
+
+/* The main loop is about to wait in select().  Measure how long it spent on
+   its own work and set the budget for the next pass. */
+void Scheduler::Sleep()
+{
+  double fg;
+
+  if( m_wake > 0 ){
+    fg = PreciseTime() - m_wake - m_used;
+    if( fg < 0 ) fg = 0;
+    m_fg_avg = (m_fg_avg * 7 + fg) / 8;
+  }
+  m_budget = TASK_LATENCY - m_fg_avg;
+  if( m_budget < TASK_MIN_BUDGET ) m_budget = TASK_MIN_BUDGET;
+  m_used = 0;
+  m_busy = false;
+  m_loops++;
+  for( int i=0; i < DT_NTASKS; i++ ){
+    if( !m_tasks[i].depth ){
+      m_tasks[i].queued = m_tasks[i].asked;
+      m_tasks[i].asked = 0;
+    }
+    m_tasks[i].used = 0;
+  }
+}
+
+
+/* Run background tasks in priority order.  When idle, each task may use its
+   share of the budget plus whatever the tasks before it left over.  When
+   peers are busy, only tasks that have been waiting too long get a turn,
+   and only a single step.
+   Returns -1 if a task failed. */
+int Scheduler::Run(bool idle)
+{
+  TASK *task;
+  double start, rightnow, allow, carry = 0;
+  int r, result = 0;
+
+  rightnow = PreciseTime();
+  for( int i=0; i < DT_NTASKS; i++ ){
+    task = &m_tasks[i];
+    allow = m_budget * task->share / 100 + carry;
+    if( task->depth ){
+      task->queued = task->depth();
+      if( task->queued && !idle && rightnow - task->last_run >= TASK_STARVE )
+        allow = 0;  // one step
+      else if( !idle ) continue;
+
+      while( task->queued && (task->used < allow || !allow) ){
+        start = PreciseTime();
+        r = task->step();
+        CheckTime();
+        rightnow = PreciseTime();
+        task->last_run = rightnow;
+        task->used += rightnow - start;
+        if( r < 0 ) result = -1;
+        if( r <= 0 || !allow ) break;
+        task->queued = task->depth();
+      }
+      if( idle && task->queued && task->used >= allow ) m_busy = true;
+    }
+    carry = (allow > task->used) ? allow - task->used : 0;
+    if( task->depth ){  // others are counted by End()
+      task->spent += task->used;
+      m_used += task->used;
+    }
+  }
+  return result;
+}
+
+
+/* Ask to run a task outside of Run(); End() must follow if this returns
+   true.  Only the task's own share of the budget is available. */
+bool Scheduler::Begin(dt_task_t task)
+{
+  TASK *t = &m_tasks[task];
+
+  t->asked++;
+  if( t->used >= m_budget * t->share / 100 ) return false;
+  m_current = task;
+  m_started = PreciseTime();
+  return true;
+}
+
+void Scheduler::End()
+{
+  TASK *t = &m_tasks[m_current];
+  double rightnow = PreciseTime();
+
+  t->used += rightnow - m_started;
+  t->spent += rightnow - m_started;
+  m_used += rightnow - m_started;
+  t->last_run = rightnow;
+  m_current = DT_NTASKS;
+}
+
+
+/* Summarize queue depths and time spent per task since the last report. */
+void Scheduler::Report(char *buffer, size_t length)
+{
+  double rightnow = PreciseTime();
+  double period = (m_report_time > 0) ? rightnow - m_report_time : 0;
+  size_t len;
+
+  snprintf(buffer, length, "Tasks:");
+  for( int i=0; i < DT_NTASKS; i++ ){
+    len = strlen(buffer);
+    snprintf(buffer + len, length - len, " %s %d/%dms", m_tasks[i].name,
+      (int)m_tasks[i].queued, (int)(m_tasks[i].spent * 1000));
+    m_tasks[i].spent = 0;
+  }
+  len = strlen(buffer);
+  snprintf(buffer + len, length - len, "  Budget: %dms  Loop: %.1fms %.1f/s",
+    (int)(m_budget * 1000), m_fg_avg * 1000,
+    (period > 0) ? m_loops / period : (double)m_loops);
+  m_loops = 0;
+  m_report_time = rightnow;
+}
@@ -0,0 +1,75 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "def.h"
+#include <sys/types.h>
+
+#include "bttypes.h"
+
+// Background disk tasks, in priority order.
+enum dt_task_t{
+  DT_TASK_FLUSH,
+  DT_TASK_CHECK,
+  DT_TASK_PREFETCH,
+  DT_TASK_MERGE,
+  DT_TASK_SCRUB,
+  DT_NTASKS
+};
+
+// Target time for one pass of the main loop, including background work.
+#define TASK_LATENCY     0.05
+// Background time allowed per loop even when the loop is slow.
+#define TASK_MIN_BUDGET  0.005
+// A task that has work but hasn't run for this long gets a turn even when
+// peers are busy.
+#define TASK_STARVE      1.0
+
+
+/* Schedules background disk work between network activity in the main loop.
+   Each loop has a time budget that shrinks as the loop's own (foreground)
+   processing time grows.  Each task has a share of the budget; time left
+   unused by a task passes to the tasks after it.
+*/
+class Scheduler
+{
+ private:
+  typedef struct _task{
+    const char *name;
+    int share;              // percent of each loop's budget
+    dt_count_t (*depth)();  // units of work waiting
+    int (*step)();          // do some; returns units done, or -1 on error
+    double last_run;
+    double used;            // time used this loop
+    double spent;           // time used since last report
+    dt_count_t queued;      // last depth seen
+    dt_count_t asked;       // requests this loop, for tasks run elsewhere
+  }TASK;
+
+  TASK m_tasks[DT_NTASKS];
+  double m_budget;          // for this loop
+  double m_wake;            // when the loop started
+  double m_used;            // background time used this loop
+  double m_fg_avg;          // average foreground time per loop
+  double m_report_time;
+  dt_count_t m_loops;
+  bool m_busy;
+  dt_task_t m_current;
+  double m_started;
+
+ public:
+  Scheduler();
+
+  void Wake();
+  void Sleep();
+  int Run(bool idle);
+  bool Busy() const { return m_busy; }
+
+  bool Begin(dt_task_t task);
+  void End();
+
+  void Report(char *buffer, size_t length);
+};
+
+extern Scheduler SCHEDULER;
+
+#endif  // SCHEDULER_H
@@ -73,19 +73,504 @@ A million repetitions of "a"
 
 #include "sha1.h"
 
-void Sha1(const char *data, size_t len, unsigned char *result)
+#include <string.h>
+
+#if defined(HAVE_CPUID_H) && defined(HAVE_IMMINTRIN_H) && \
+    (defined(__x86_64__) || defined(__i386__)) && \
+    (__GNUC__ >= 5 || defined(__clang__))
+#define SHA1_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#define SHA1_LANES 8  /* buffers per multi-buffer pass */
+
+#define SHA1_F_SHANI 1
+#define SHA1_F_AVX2  2
+
+typedef void (*sha1_blocks_t)(uint32_t *state, const unsigned char *data,
+  size_t nblocks);
+
+static const uint32_t sha1_iv[5] =
+  { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+
+
+#define ROL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define GET32BE(p) (((uint32_t)(p)[0] << 24) | ((uint32_t)(p)[1] << 16) | \
+                    ((uint32_t)(p)[2] << 8) | (uint32_t)(p)[3])
+
+#ifdef SHA1_X86
+
+/* Portable block routine, used to finish up multi-buffer hashes. */
+static void sha1_blocks_c(uint32_t *state, const unsigned char *data,
+  size_t nblocks)
+{
+  uint32_t w[80], a, b, c, d, e, t;
+  int i;
+
+  for( ; nblocks; nblocks--, data += 64 ){
+    for( i=0; i < 16; i++ ) w[i] = GET32BE(data + i*4);
+    for( ; i < 80; i++ ) w[i] = ROL32(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+    a = state[0]; b = state[1]; c = state[2]; d = state[3]; e = state[4];
+    for( i=0; i < 80; i++ ){
+      if( i < 20 ) t = ((b & c) | (~b & d)) + 0x5A827999;
+      else if( i < 40 ) t = (b ^ c ^ d) + 0x6ED9EBA1;
+      else if( i < 60 ) t = ((b & c) | (d & (b | c))) + 0x8F1BBCDC;
+      else t = (b ^ c ^ d) + 0xCA62C1D6;
+      t += ROL32(a, 5) + e + w[i];
+      e = d; d = c; c = ROL32(b, 30); b = a; a = t;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d; state[4] += e;
+  }
+}
+
+
+static int sha1_features = -1;
+
+static int Sha1Features(void)
+{
+  unsigned int a, b, c, d, xlo = 0, xhi = 0;
+  int features = 0, ymm = 0, sse41 = 0;
+
+  if( sha1_features >= 0 ) return sha1_features;
+
+  if( __get_cpuid(1, &a, &b, &c, &d) ){
+    sse41 = (c & (1 << 9)) && (c & (1 << 19));  /* SSSE3 and SSE4.1 */
+    if( (c & (1 << 27)) && (c & (1 << 28)) ){   /* OSXSAVE and AVX */
+      __asm__ __volatile__("xgetbv" : "=a"(xlo), "=d"(xhi) : "c"(0));
+      ymm = ((xlo & 6) == 6);                    /* OS saves YMM state */
+    }
+  }
+  if( __get_cpuid_max(0, (unsigned int *)0) >= 7 ){
+    __cpuid_count(7, 0, a, b, c, d);
+    if( sse41 && (b & (1 << 29)) ) features |= SHA1_F_SHANI;
+    if( ymm && (b & (1 << 5)) ) features |= SHA1_F_AVX2;
+  }
+  return sha1_features = features;
+}
+
+
+/* Single-buffer block routine using the SHA extensions. */
+__attribute__((target("sha,ssse3,sse4.1")))
+static void sha1_blocks_shani(uint32_t *state, const unsigned char *data,
+  size_t nblocks)
+{
+  __m128i abcd, abcd_save, e0, e0_save, e1;
+  __m128i msg0, msg1, msg2, msg3;
+  const __m128i mask =
+    _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+
+  abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state), 0x1B);
+  e0 = _mm_set_epi32((int)state[4], 0, 0, 0);
+
+  for( ; nblocks; nblocks--, data += 64 ){
+    abcd_save = abcd;
+    e0_save = e0;
+
+    /* Rounds 0-3 */
+    msg0 = _mm_shuffle_epi8(
+      _mm_loadu_si128((const __m128i *)(data + 0)), mask);
+    e0 = _mm_add_epi32(e0, msg0);
+    e1 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+    /* Rounds 4-7 */
+    msg1 = _mm_shuffle_epi8(
+      _mm_loadu_si128((const __m128i *)(data + 16)), mask);
+    e1 = _mm_sha1nexte_epu32(e1, msg1);
+    e0 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+    msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+
+    /* Rounds 8-11 */
+    msg2 = _mm_shuffle_epi8(
+      _mm_loadu_si128((const __m128i *)(data + 32)), mask);
+    e0 = _mm_sha1nexte_epu32(e0, msg2);
+    e1 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+    msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+    msg0 = _mm_xor_si128(msg0, msg2);
+
+    /* Rounds 12-15 */
+    msg3 = _mm_shuffle_epi8(
+      _mm_loadu_si128((const __m128i *)(data + 48)), mask);
+    e1 = _mm_sha1nexte_epu32(e1, msg3);
+    e0 = abcd;
+    msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+    msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+    msg1 = _mm_xor_si128(msg1, msg3);
+
+    /* Rounds 16-19 */
+    e0 = _mm_sha1nexte_epu32(e0, msg0);
+    e1 = abcd;
+    msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+    msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+    msg2 = _mm_xor_si128(msg2, msg0);
+
+    /* Rounds 20-23 */
+    e1 = _mm_sha1nexte_epu32(e1, msg1);
+    e0 = abcd;
+    msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 1);
+    msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+    msg3 = _mm_xor_si128(msg3, msg1);
+
+    /* Rounds 24-27 */
+    e0 = _mm_sha1nexte_epu32(e0, msg2);
+    e1 = abcd;
+    msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 1);
+    msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+    msg0 = _mm_xor_si128(msg0, msg2);
+
+    /* Rounds 28-31 */
+    e1 = _mm_sha1nexte_epu32(e1, msg3);
+    e0 = abcd;
+    msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 1);
+    msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+    msg1 = _mm_xor_si128(msg1, msg3);
+
+    /* Rounds 32-35 */
+    e0 = _mm_sha1nexte_epu32(e0, msg0);
+    e1 = abcd;
+    msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 1);
+    msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+    msg2 = _mm_xor_si128(msg2, msg0);
+
+    /* Rounds 36-39 */
+    e1 = _mm_sha1nexte_epu32(e1, msg1);
+    e0 = abcd;
+    msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 1);
+    msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+    msg3 = _mm_xor_si128(msg3, msg1);
+
+    /* Rounds 40-43 */
+    e0 = _mm_sha1nexte_epu32(e0, msg2);
+    e1 = abcd;
+    msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 2);
+    msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+    msg0 = _mm_xor_si128(msg0, msg2);
+
+    /* Rounds 44-47 */
+    e1 = _mm_sha1nexte_epu32(e1, msg3);
+    e0 = abcd;
+    msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 2);
+    msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+    msg1 = _mm_xor_si128(msg1, msg3);
+
+    /* Rounds 48-51 */
+    e0 = _mm_sha1nexte_epu32(e0, msg0);
+    e1 = abcd;
+    msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 2);
+    msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+    msg2 = _mm_xor_si128(msg2, msg0);
+
+    /* Rounds 52-55 */
+    e1 = _mm_sha1nexte_epu32(e1, msg1);
+    e0 = abcd;
+    msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 2);
+    msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+    msg3 = _mm_xor_si128(msg3, msg1);
+
+    /* Rounds 56-59 */
+    e0 = _mm_sha1nexte_epu32(e0, msg2);
+    e1 = abcd;
+    msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 2);
+    msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+    msg0 = _mm_xor_si128(msg0, msg2);
+
+    /* Rounds 60-63 */
+    e1 = _mm_sha1nexte_epu32(e1, msg3);
+    e0 = abcd;
+    msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+    msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+    msg1 = _mm_xor_si128(msg1, msg3);
+
+    /* Rounds 64-67 */
+    e0 = _mm_sha1nexte_epu32(e0, msg0);
+    e1 = abcd;
+    msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+    msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+    msg2 = _mm_xor_si128(msg2, msg0);
+
+    /* Rounds 68-71 */
+    e1 = _mm_sha1nexte_epu32(e1, msg1);
+    e0 = abcd;
+    msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+    msg3 = _mm_xor_si128(msg3, msg1);
+
+    /* Rounds 72-75 */
+    e0 = _mm_sha1nexte_epu32(e0, msg2);
+    e1 = abcd;
+    msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+
+    /* Rounds 76-79 */
+    e1 = _mm_sha1nexte_epu32(e1, msg3);
+    e0 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+
+    e0 = _mm_sha1nexte_epu32(e0, e0_save);
+    abcd = _mm_add_epi32(abcd, abcd_save);
+  }
+
+  _mm_storeu_si128((__m128i *)state, _mm_shuffle_epi32(abcd, 0x1B));
+  state[4] = (uint32_t)_mm_extract_epi32(e0, 3);
+}
+
+
+#define ROL8(x, n) \
+  _mm256_or_si256(_mm256_slli_epi32((x), (n)), _mm256_srli_epi32((x), 32-(n)))
+#define LANE32(p, off) ((int)GET32BE((p) + (off)))
+
+#define SHA1X8_ROUNDS(from, to, F, K) \
+  for( i=(from); i < (to); i++ ){ \
+    if( i >= 16 ) \
+      w[i&15] = ROL8(_mm256_xor_si256( \
+        _mm256_xor_si256(w[(i-3)&15], w[(i-8)&15]), \
+        _mm256_xor_si256(w[(i-14)&15], w[i&15])), 1); \
+    t = _mm256_add_epi32(_mm256_add_epi32(ROL8(a, 5), (F)), \
+        _mm256_add_epi32(_mm256_add_epi32(e, w[i&15]), \
+                         _mm256_set1_epi32((int)(K)))); \
+    e = d; d = c; c = ROL8(b, 30); b = a; a = t; \
+  }
+
+/* Eight-buffer block routine using AVX2.  The state is kept transposed, one
+   lane per buffer: st[word][lane].  All buffers advance by nblocks. */
+__attribute__((target("avx2")))
+static void sha1_x8_avx2(uint32_t st[5][SHA1_LANES],
+  const unsigned char *const *p, size_t nblocks)
+{
+  __m256i a, b, c, d, e, sa, sb, sc, sd, se, t, w[16];
+  size_t off = 0;
+  int i;
+
+  a = _mm256_loadu_si256((const __m256i *)st[0]);
+  b = _mm256_loadu_si256((const __m256i *)st[1]);
+  c = _mm256_loadu_si256((const __m256i *)st[2]);
+  d = _mm256_loadu_si256((const __m256i *)st[3]);
+  e = _mm256_loadu_si256((const __m256i *)st[4]);
+
+  for( ; nblocks; nblocks--, off += 64 ){
+    sa = a; sb = b; sc = c; sd = d; se = e;
+    for( i=0; i < 16; i++ ){
+      w[i] = _mm256_set_epi32(
+        LANE32(p[7], off + i*4), LANE32(p[6], off + i*4),
+        LANE32(p[5], off + i*4), LANE32(p[4], off + i*4),
+        LANE32(p[3], off + i*4), LANE32(p[2], off + i*4),
+        LANE32(p[1], off + i*4), LANE32(p[0], off + i*4));
+    }
+    SHA1X8_ROUNDS(0, 20, _mm256_or_si256(_mm256_and_si256(b, c),
+                                         _mm256_andnot_si256(b, d)),
+                  0x5A827999)
+    SHA1X8_ROUNDS(20, 40, _mm256_xor_si256(_mm256_xor_si256(b, c), d),
+                  0x6ED9EBA1)
+    SHA1X8_ROUNDS(40, 60, _mm256_or_si256(_mm256_and_si256(b, c),
+                            _mm256_and_si256(d, _mm256_or_si256(b, c))),
+                  0x8F1BBCDC)
+    SHA1X8_ROUNDS(60, 80, _mm256_xor_si256(_mm256_xor_si256(b, c), d),
+                  0xCA62C1D6)
+    a = _mm256_add_epi32(a, sa);
+    b = _mm256_add_epi32(b, sb);
+    c = _mm256_add_epi32(c, sc);
+    d = _mm256_add_epi32(d, sd);
+    e = _mm256_add_epi32(e, se);
+  }
+
+  _mm256_storeu_si256((__m256i *)st[0], a);
+  _mm256_storeu_si256((__m256i *)st[1], b);
+  _mm256_storeu_si256((__m256i *)st[2], c);
+  _mm256_storeu_si256((__m256i *)st[3], d);
+  _mm256_storeu_si256((__m256i *)st[4], e);
+}
+
+
+/* Hash up to SHA1_LANES buffers whose lengths have the same number of whole
+   blocks.  The (short) remainders are finished one at a time. */
+static void sha1_batch_x8(int n, const char *const *data, const size_t *len,
+  unsigned char *result)
+{
+  uint32_t st[5][SHA1_LANES];
+  const unsigned char *p[SHA1_LANES];
+  size_t nblocks = len[0] / 64;
+  dt_sha1_t context;
+  int i, j;
+
+  for( i=0; i < SHA1_LANES; i++ ){
+    p[i] = (const unsigned char *)data[(i < n) ? i : 0];
+    for( j=0; j < 5; j++ ) st[j][i] = sha1_iv[j];
+  }
+  sha1_x8_avx2(st, p, nblocks);
+
+  for( i=0; i < n; i++ ){
+    for( j=0; j < 5; j++ ) context.state[j] = st[j][i];
+    context.count = nblocks * 64;
+    context.blocks = sha1_blocks_c;
+    Sha1Update(&context, data[i] + nblocks * 64, len[i] - nblocks * 64);
+    Sha1Final(&context, result + i * 20);
+  }
+}
+
+#endif  /* SHA1_X86 */
+
+
+/* Returns the best single-buffer block routine, or 0 to use the library. */
+static sha1_blocks_t Sha1Blocks(void)
+{
+#ifdef SHA1_X86
+  if( Sha1Features() & SHA1_F_SHANI ) return sha1_blocks_shani;
+#endif
+  return (sha1_blocks_t)0;
+}
+
+
+int Sha1BatchSize(void)
+{
+#ifdef SHA1_X86
+  /* SHA-NI on one buffer beats AVX2 on eight. */
+  if( (Sha1Features() & (SHA1_F_SHANI | SHA1_F_AVX2)) == SHA1_F_AVX2 )
+    return SHA1_LANES;
+#endif
+  return 1;
+}
+
+
+const char *Sha1Backend(void)
+{
+  if( Sha1Blocks() ) return "SHA-NI";
+  if( Sha1BatchSize() > 1 ) return "AVX2 multi-buffer";
+#if defined(USE_STANDALONE_SHA1)
+  return "standalone";
+#else
+  return "library";
+#endif
+}
+
+
+void Sha1Init(dt_sha1_t *context)
+{
+  if( (context->blocks = Sha1Blocks()) ){
+    memcpy(context->state, sha1_iv, sizeof(context->state));
+    context->count = 0;
+  }else{
+#if defined(USE_STANDALONE_SHA1)
+    SHA1Init(&context->ctx);
+#else
+    SHA1_Init(&context->ctx);
+#endif
+  }
+}
+
+
+void Sha1Update(dt_sha1_t *context, const char *data, size_t len)
 {
+  const unsigned char *src = (const unsigned char *)data;
+  size_t used, n;
+
+  if( !context->blocks ){
 #if defined(USE_STANDALONE_SHA1)
-  SHA1_CTX context;
-  SHA1Init(&context);
-  SHA1Update(&context, (unsigned char *)data, len);
-  SHA1Final(result, &context);
+    SHA1Update(&context->ctx, src, len);
 #else
-  SHA_CTX context;
-  SHA1_Init(&context);
-  SHA1_Update(&context, (unsigned char *)data, len);
-  SHA1_Final(result, &context);
+    SHA1_Update(&context->ctx, src, len);
+#endif
+    return;
+  }
+
+  used = (size_t)(context->count % 64);
+  context->count += len;
+  if( used ){
+    n = 64 - used;
+    if( n > len ) n = len;
+    memcpy(context->buffer + used, src, n);
+    src += n;
+    len -= n;
+    if( used + n < 64 ) return;
+    context->blocks(context->state, context->buffer, 1);
+  }
+  if( len >= 64 ){
+    context->blocks(context->state, src, len / 64);
+    src += len & ~(size_t)63;
+    len &= 63;
+  }
+  if( len ) memcpy(context->buffer, src, len);
+}
+
+
+void Sha1Final(dt_sha1_t *context, unsigned char *result)
+{
+  uint64_t bits;
+  size_t used;
+  int i;
+
+  if( !context->blocks ){
+#if defined(USE_STANDALONE_SHA1)
+    SHA1Final(result, &context->ctx);
+#else
+    SHA1_Final(result, &context->ctx);
+#endif
+    return;
+  }
+
+  bits = context->count * 8;
+  used = (size_t)(context->count % 64);
+  context->buffer[used++] = 0x80;
+  if( used > 56 ){
+    memset(context->buffer + used, 0, 64 - used);
+    context->blocks(context->state, context->buffer, 1);
+    used = 0;
+  }
+  memset(context->buffer + used, 0, 56 - used);
+  for( i=0; i < 8; i++ )
+    context->buffer[56 + i] = (unsigned char)(bits >> (56 - i*8));
+  context->blocks(context->state, context->buffer, 1);
+
+  for( i=0; i < 20; i++ )
+    result[i] = (unsigned char)(context->state[i>>2] >> ((3 - (i & 3)) * 8));
+}
+
+
+void Sha1(const char *data, size_t len, unsigned char *result)
+{
+  dt_sha1_t context;
+
+  Sha1Init(&context);
+  Sha1Update(&context, data, len);
+  Sha1Final(&context, result);
+}
+
+
+void Sha1Batch(int n, const char *const *data, const size_t *len,
+  unsigned char *result)
+{
+  int i = 0;
+
+#ifdef SHA1_X86
+  if( n > 1 && Sha1BatchSize() > 1 ){
+    while( i < n ){
+      /* Gather a run of buffers with the same number of whole blocks. */
+      int j = i + 1;
+      while( j < n && j - i < SHA1_LANES && len[j] / 64 == len[i] / 64 ) j++;
+      if( j - i > 1 ) sha1_batch_x8(j - i, data + i, len + i, result + i * 20);
+      else Sha1(data[i], len[i], result + i * 20);
+      i = j;
+    }
+    return;
+  }
 #endif
+  for( ; i < n; i++ ) Sha1(data[i], len[i], result + i * 20);
 }
 
 #ifdef USE_STANDALONE_SHA1
@@ -153,7 +638,7 @@ typedef union {
 } CHAR64LONG16;
 CHAR64LONG16* block;
 #ifdef SHA1HANDSOFF
-static unsigned char workspace[64];
+unsigned char workspace[64];  /* not static, for use by multiple threads */
     block = (CHAR64LONG16*)workspace;
     memcpy(block, buffer, 64);
 #else
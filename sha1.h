@@ -19,12 +19,10 @@ extern "C" {
 #include <stddef.h>  // size_t
 #include "config.h"
 
-void Sha1(const char *data, size_t len, unsigned char *result);
+#include <inttypes.h>
 
 #if defined(USE_STANDALONE_SHA1)
 
-#include <inttypes.h>
-
 typedef struct {
     uint32_t state[5];
     uint32_t count[2];
@@ -44,6 +42,34 @@ void SHA1Final(unsigned char digest[20], SHA1_CTX* context);
 #include <sha.h>
 #endif
 
+/* Incremental hashing state.  An accelerated block routine is used when the
+   CPU supports one; otherwise the library (or standalone) routines are.
+*/
+typedef struct {
+  uint32_t state[5];
+  uint64_t count;            /* bytes hashed */
+  unsigned char buffer[64];
+  void (*blocks)(uint32_t *state, const unsigned char *data, size_t nblocks);
+#if defined(USE_STANDALONE_SHA1)
+  SHA1_CTX ctx;
+#else
+  SHA_CTX ctx;
+#endif
+} dt_sha1_t;
+
+void Sha1(const char *data, size_t len, unsigned char *result);
+void Sha1Init(dt_sha1_t *context);
+void Sha1Update(dt_sha1_t *context, const char *data, size_t len);
+void Sha1Final(dt_sha1_t *context, unsigned char *result);
+
+/* Hash n separate buffers into n consecutive 20-byte results.  Buffers of
+   equal length are hashed together when a multi-buffer routine is available.
+*/
+void Sha1Batch(int n, const char *const *data, const size_t *len,
+  unsigned char *result);
+int Sha1BatchSize(void);  /* number of buffers Sha1Batch can do at once */
+const char *Sha1Backend(void);
+
 #ifdef __cplusplus
 }
 #endif
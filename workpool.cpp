@@ -0,0 +1,337 @@
+#include "workpool.h"  // def.h
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include "setnonblock.h"
+#include "btconfig.h"
+#include "console.h"
+
+
+WorkPool WORKERS("worker");
+WorkPool FLUSHER("flusher");
+WorkPool READER("reader");
+
+#ifdef USE_PTHREADS
+static pthread_t g_main_thread = pthread_self();
+#endif
+
+
+int CpuCount()
+{
+  long n = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+  n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  if( n < 1 ) n = 1;
+  return (n > MAX_WORKERS) ? MAX_WORKERS : (int)n;
+}
+
+// False if called from a worker thread.
+bool MainThread()
+{
+#ifdef USE_PTHREADS
+  return pthread_equal(pthread_self(), g_main_thread) ? true : false;
+#else
+  return true;
+#endif
+}
+
+
+btMutex::btMutex()
+{
+#ifdef USE_PTHREADS
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&m_mutex, &attr);
+  pthread_mutexattr_destroy(&attr);
+#endif
+}
+
+btMutex::~btMutex()
+{
+#ifdef USE_PTHREADS
+  pthread_mutex_destroy(&m_mutex);
+#endif
+}
+
+void btMutex::Lock()
+{
+#ifdef USE_PTHREADS
+  pthread_mutex_lock(&m_mutex);
+#endif
+}
+
+void btMutex::Unlock()
+{
+#ifdef USE_PTHREADS
+  pthread_mutex_unlock(&m_mutex);
+#endif
+}
+
+
+WorkPool::WorkPool(const char *name)
+{
+  m_name = name;
+  m_want = m_nthreads = 0;
+  m_stop = false;
+  m_pid = 0;
+  m_queue = m_queue_last = (WorkJob *)0;
+  m_done = m_done_last = (WorkJob *)0;
+  m_pending = 0;
+  m_pipe[0] = m_pipe[1] = INVALID_SOCKET;
+#ifdef USE_PTHREADS
+  pthread_cond_init(&m_work_cond, (pthread_condattr_t *)0);
+  pthread_cond_init(&m_done_cond, (pthread_condattr_t *)0);
+#endif
+}
+
+
+WorkPool::~WorkPool()
+{
+  WorkJob *job;
+
+#ifdef USE_PTHREADS
+  // Threads do not survive fork(); a child process must not wait for them.
+  if( m_nthreads && getpid() == m_pid ){
+    m_lock.Lock();
+    m_stop = true;
+    pthread_cond_broadcast(&m_work_cond);
+    m_lock.Unlock();
+    for( int i=0; i < m_nthreads; i++ )
+      pthread_join(m_threads[i], (void **)0);
+  }
+  m_nthreads = 0;
+#endif
+  // Too late to report results; just discard anything left over.
+  while( (job = m_queue) ){
+    m_queue = job->m_next;
+    delete job;
+  }
+  while( (job = m_done) ){
+    m_done = job->m_next;
+    delete job;
+  }
+  if( m_pipe[0] != INVALID_SOCKET ) close(m_pipe[0]);
+  if( m_pipe[1] != INVALID_SOCKET ) close(m_pipe[1]);
+#ifdef USE_PTHREADS
+  pthread_cond_destroy(&m_work_cond);
+  pthread_cond_destroy(&m_done_cond);
+#endif
+}
+
+
+/* Set the number of threads to use.  The threads are started when the first
+   job is submitted.  Zero means run jobs synchronously within Submit(). */
+int WorkPool::Start(int nthreads)
+{
+#ifdef USE_PTHREADS
+  if( nthreads < 0 ) nthreads = 0;
+  if( nthreads > MAX_WORKERS ) nthreads = MAX_WORKERS;
+#else
+  nthreads = 0;
+#endif
+  if( m_nthreads && nthreads != m_nthreads ) Stop();
+  m_want = nthreads;
+  return m_want;
+}
+
+
+int WorkPool::Spawn()
+{
+#ifdef USE_PTHREADS
+  if( m_pipe[0] == INVALID_SOCKET ){
+    if( pipe(m_pipe) < 0 ){
+      CONSOLE.Warning(2, "warn, unable to create %s thread pipe:  %s",
+        m_name, strerror(errno));
+      m_pipe[0] = m_pipe[1] = INVALID_SOCKET;
+      m_want = 0;
+      return -1;
+    }
+    setfd_nonblock(m_pipe[0]);
+    setfd_nonblock(m_pipe[1]);
+  }
+
+  m_stop = false;
+  m_pid = getpid();
+  for( m_nthreads = 0; m_nthreads < m_want; m_nthreads++ ){
+    int r = pthread_create(&m_threads[m_nthreads], (pthread_attr_t *)0,
+                           Worker, this);
+    if( r ){
+      CONSOLE.Warning(2, "warn, unable to create %s thread:  %s", m_name,
+        strerror(r));
+      break;
+    }
+  }
+  if( *cfg_verbose )
+    CONSOLE.Debug("Started %d %s thread%s", m_nthreads, m_name,
+      (m_nthreads == 1) ? "" : "s");
+  if( m_nthreads < m_want ) m_want = m_nthreads;
+  return m_nthreads;
+#else
+  return 0;
+#endif
+}
+
+
+/* Wait for all submitted jobs to finish and stop the threads.
+   The pool restarts on the next Submit. */
+void WorkPool::Stop()
+{
+  Wait();
+#ifdef USE_PTHREADS
+  if( m_nthreads ){
+    m_lock.Lock();
+    m_stop = true;
+    pthread_cond_broadcast(&m_work_cond);
+    m_lock.Unlock();
+    for( int i=0; i < m_nthreads; i++ )
+      pthread_join(m_threads[i], (void **)0);
+    m_nthreads = 0;
+  }
+#endif
+  Collect();
+}
+
+
+#ifdef USE_PTHREADS
+void *WorkPool::Worker(void *arg)
+{
+  WorkPool *pool = (WorkPool *)arg;
+  WorkJob *job;
+
+  pthread_mutex_lock(&pool->m_lock.m_mutex);
+  for(;;){
+    while( !pool->m_queue && !pool->m_stop )
+      pthread_cond_wait(&pool->m_work_cond, &pool->m_lock.m_mutex);
+    if( !(job = pool->m_queue) ) break;
+    if( !(pool->m_queue = job->m_next) ) pool->m_queue_last = (WorkJob *)0;
+    pthread_mutex_unlock(&pool->m_lock.m_mutex);
+
+    job->Run();
+    pool->Finished(job);
+
+    pthread_mutex_lock(&pool->m_lock.m_mutex);
+  }
+  pthread_mutex_unlock(&pool->m_lock.m_mutex);
+  return (void *)0;
+}
+#endif
+
+
+void WorkPool::Finished(WorkJob *job)
+{
+  btLock lock(m_lock);
+
+  job->m_next = (WorkJob *)0;
+  if( m_done_last ) m_done_last->m_next = job;
+  else m_done = job;
+  m_done_last = job;
+
+#ifdef USE_PTHREADS
+  {
+    char c = 0;
+    pthread_cond_broadcast(&m_done_cond);
+    // A full pipe already has a wakeup pending, so errors can be ignored.
+    if( write(m_pipe[1], &c, 1) < 0 ) errno = 0;
+  }
+#endif
+}
+
+
+// With no threads, the job is run and reported before Submit returns.
+void WorkPool::Submit(WorkJob *job)
+{
+  if( m_want && !m_nthreads ) Spawn();
+
+  if( !m_nthreads ){
+    job->Run();
+    job->Done();
+    return;
+  }
+
+#ifdef USE_PTHREADS
+  btLock lock(m_lock);
+  m_pending++;
+  job->m_next = (WorkJob *)0;
+  if( m_queue_last ) m_queue_last->m_next = job;
+  else m_queue = job;
+  m_queue_last = job;
+  pthread_cond_signal(&m_work_cond);
+#endif
+}
+
+
+/* Report finished jobs on the main thread.  Returns the number collected. */
+int WorkPool::Collect()
+{
+  WorkJob *list, *job;
+  int count = 0;
+
+  if( !m_done ) return 0;  // racy peek; a missed job will wake us again
+
+  m_lock.Lock();
+  list = m_done;
+  m_done = m_done_last = (WorkJob *)0;
+  m_lock.Unlock();
+
+  while( (job = list) ){
+    list = job->m_next;
+    m_pending--;
+    count++;
+    job->Done();  // may Submit() more work
+  }
+  return count;
+}
+
+
+// Wait for at least one job to finish, and report it.
+int WorkPool::WaitOne()
+{
+  if( !m_pending ) return 0;
+#ifdef USE_PTHREADS
+  m_lock.Lock();
+  while( !m_done )
+    pthread_cond_wait(&m_done_cond, &m_lock.m_mutex);
+  m_lock.Unlock();
+#endif
+  return Collect();
+}
+
+
+// Wait for all outstanding jobs (including any they submit) to finish.
+void WorkPool::Wait()
+{
+  while( m_pending ) WaitOne();
+}
+
+
+int WorkPool::IntervalCheck(fd_set *rfdp, fd_set *wfdp)
+{
+  if( m_pipe[0] == INVALID_SOCKET ) return -1;
+
+  if( m_nthreads && m_pending ){
+    FD_SET(m_pipe[0], rfdp);
+    return m_pipe[0];
+  }
+  FD_CLR(m_pipe[0], rfdp);
+  return -1;
+}
+
+
+void WorkPool::SocketReady(fd_set *rfdp, fd_set *wfdp, int *nfds,
+  fd_set *rfdnextp, fd_set *wfdnextp)
+{
+  char buf[64];
+
+  if( m_pipe[0] == INVALID_SOCKET ) return;
+
+  if( *nfds > 0 && FD_ISSET(m_pipe[0], rfdp) ){
+    (*nfds)--;
+    while( read(m_pipe[0], buf, sizeof(buf)) > 0 );
+  }
+  Collect();
+}
+
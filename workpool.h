@@ -0,0 +1,127 @@
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+#include "def.h"
+#include <sys/types.h>
+
+#if !defined(HAVE_SYS_TIME_H) || defined(TIME_WITH_SYS_TIME)
+#include <time.h>
+#endif
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#ifdef USE_PTHREADS
+#include <pthread.h>
+#endif
+
+#include "bttypes.h"
+
+/* Maximum number of worker threads in a pool.  Each busy hash worker holds a
+   piece-sized buffer, so this also bounds memory use. */
+#define MAX_WORKERS 64
+
+
+/* Recursive mutex; a no-op when threads are not available. */
+class btMutex
+{
+  friend class WorkPool;
+
+ private:
+#ifdef USE_PTHREADS
+  pthread_mutex_t m_mutex;
+#endif
+
+ public:
+  btMutex();
+  ~btMutex();
+
+  void Lock();
+  void Unlock();
+};
+
+// Holds a btMutex for the lifetime of the object.
+class btLock
+{
+ private:
+  btMutex &m_mutex;
+
+ public:
+  btLock(btMutex &mutex): m_mutex(mutex){ m_mutex.Lock(); }
+  ~btLock(){ m_mutex.Unlock(); }
+};
+
+
+/* A unit of work for a WorkPool.
+   Run() is called on a worker thread (or within Submit() if there are no
+   threads) and must not touch main-loop state.  Done() is then called on the
+   main thread and is responsible for deleting or recycling the job.
+*/
+class WorkJob
+{
+  friend class WorkPool;
+
+ private:
+  WorkJob *m_next;
+
+ public:
+  WorkJob(){ m_next = (WorkJob *)0; }
+  virtual ~WorkJob(){}
+
+  virtual void Run() = 0;
+  virtual void Done() = 0;
+};
+
+
+class WorkPool
+{
+ private:
+  const char *m_name;
+  int m_want;               // configured number of threads
+  int m_nthreads;           // threads currently running
+  bool m_stop;
+  pid_t m_pid;              // process that owns the threads
+  WorkJob *m_queue, *m_queue_last;  // waiting to run
+  WorkJob *m_done, *m_done_last;    // waiting for Done()
+  dt_count_t m_pending;     // submitted but not yet collected
+  int m_pipe[2];            // wakes the main loop when a job finishes
+  btMutex m_lock;
+
+#ifdef USE_PTHREADS
+  pthread_t m_threads[MAX_WORKERS];
+  pthread_cond_t m_work_cond;
+  pthread_cond_t m_done_cond;
+
+  static void *Worker(void *arg);
+#endif
+  int Spawn();
+  void Finished(WorkJob *job);
+
+ public:
+  WorkPool(const char *name);
+  ~WorkPool();
+
+  int Start(int nthreads);
+  void Stop();
+  int Threads() const { return m_want; }
+
+  void Submit(WorkJob *job);
+  dt_count_t Pending() const { return m_pending; }
+  int Collect();
+  int WaitOne();
+  void Wait();
+
+  int IntervalCheck(fd_set *rfdp, fd_set *wfdp);
+  void SocketReady(fd_set *rfdp, fd_set *wfdp, int *nfds,
+    fd_set *rfdnextp, fd_set *wfdnextp);
+};
+
+int CpuCount();
+bool MainThread();
+
+extern WorkPool WORKERS;
+extern WorkPool FLUSHER;
+extern WorkPool READER;
+
+#endif  // WORKPOOL_H
+